@@ -51,14 +51,85 @@ static int lua_isinteger(lua_State *L, int idx) {
 }
 #endif
 
+#define FMT_FORMAT "fmt.Format"
+#define FMT_BUFFER "fmt.Buffer"
+
+/* every function has both metatables as upvalues, which is cheaper to
+ * check against than looking them up by name on each call */
+#define FMT_FORMATMT lua_upvalueindex(1)
+#define FMT_BUFFERMT lua_upvalueindex(2)
+
+static void *fmt_toudata(lua_State *L, int idx, int mt) {
+    void *p = lua_touserdata(L, idx);
+    int ok;
+    if (p == NULL || !lua_getmetatable(L, idx)) return NULL;
+    ok = lua_rawequal(L, -1, mt);
+    lua_pop(L, 1);
+    return ok ? p : NULL;
+}
+
+typedef struct fmt_Buffer {
+    char  *p;
+    size_t len, cap;
+} fmt_Buffer;
+
 typedef struct fmt_State {
     lua_State *L;
     luaL_Buffer B;
+    fmt_Buffer *buff;   /* output goes here instead of B if not NULL */
+    const char *s, *e;  /* format string */
+    int arg0;           /* stack index of the format, arguments follow */
     int idx, top, zeroing;
 } fmt_State;
 
 #define fmt_check(S,cond,...) ((void)((cond)||luaL_error((S)->L,__VA_ARGS__)))
 
+/* output */
+
+static char *fmt_buffreserve(lua_State *L, fmt_Buffer *b, size_t n) {
+    if (n > b->cap - b->len) {
+        void *ud, *p;
+        lua_Alloc allocf = lua_getallocf(L, &ud);
+        size_t cap = b->cap < LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : b->cap;
+        while (cap - b->len < n) {
+            if (cap > (~(size_t)0)/2) luaL_error(L, "buffer too large");
+            cap *= 2;
+        }
+        p = allocf(ud, b->p, b->cap, cap);
+        if (p == NULL) luaL_error(L, "not enough memory");
+        b->p = (char*)p, b->cap = cap;
+    }
+    return b->p + b->len;
+}
+
+static char *fmt_prepbuffsize(fmt_State *S, size_t len) {
+    if (S->buff == NULL) return luaL_prepbuffsize(&S->B, len);
+    return fmt_buffreserve(S->L, S->buff, len);
+}
+
+static void fmt_addsize(fmt_State *S, size_t len) {
+    if (S->buff == NULL) luaL_addsize(&S->B, len);
+    else S->buff->len += len;
+}
+
+static void fmt_addlstring(fmt_State *S, const char *s, size_t len) {
+    if (S->buff == NULL)
+        luaL_addlstring(&S->B, s, len);
+    else {
+        memcpy(fmt_buffreserve(S->L, S->buff, len), s, len);
+        S->buff->len += len;
+    }
+}
+
+static void fmt_addchar(fmt_State *S, int ch) {
+    if (S->buff == NULL)
+        luaL_addchar(&S->B, (char)ch);
+    else {
+        *fmt_buffreserve(S->L, S->buff, 1) = (char)ch;
+        S->buff->len += 1;
+    }
+}
+
 /* read argid */
 
 #define fmt_argslot(S)  ((S)->top+1)
@@ -78,8 +149,7 @@ static void fmt_manualidx(fmt_State *S)
 
 static int fmt_autoidx(fmt_State *S) {
     fmt_check(S, S->idx != 0, FMT_M2A);
-    fmt_check(S, ++S->idx <= S->top, "automatic index out of range");
-    return S->idx;
+    return ++S->idx;
 }
 
 static int fmt_integer(fmt_State *S, const char **pp) {
@@ -93,65 +163,98 @@ static int fmt_integer(fmt_State *S, const char **pp) {
     return (*pp = p), v;
 }
 
-static void fmt_identity(fmt_State *S, const char **pp) {
+static void fmt_identity(const char **pp) {
     const char *p = *pp;
     while (*++p && (fmt_isalpha(*p) || fmt_isdigit(*p)))
         ;
-    lua_pushlstring(S->L, *pp, p - *pp);
     *pp = p;
 }
 
 static void fmt_accessor(fmt_State *S, int to, const char **pp, const char *e) {
     /* "." (number | identity) | "[" <anychar except ']'> "]" */
+    /* only checked if to is 0, else applied to the value at to */
     const char *p = *pp;
     do {
         int idx;
         if (*p++ == '.') {
-            if (fmt_isdigit(*p))
-                lua_geti(S->L, to, fmt_integer(S, &p));
-            else if (fmt_isalpha(*p))
-                fmt_identity(S, &p), lua_gettable(S->L, to);
-            else luaL_error(S->L, "unexpected '%c' in field name", *p);
+            const char *b = p;
+            if (fmt_isdigit(*p)) {
+                idx = fmt_integer(S, &p);
+                if (to) lua_geti(S->L, to, idx);
+            } else if (fmt_isalpha(*p)) {
+                fmt_identity(&p);
+                if (to) lua_pushlstring(S->L, b, p - b), lua_gettable(S->L, to);
+            } else luaL_error(S->L, "unexpected '%c' in field name", *p);
         } else { /* *p == '[' */
             const char *c = p;
-            if (fmt_isdigit(*c) && ((idx = fmt_integer(S, &c)), *c == ']'))
-                lua_geti(S->L, to, idx);
-            else {
+            if (fmt_isdigit(*c) && ((idx = fmt_integer(S, &c)), *c == ']')) {
+                if (to) lua_geti(S->L, to, idx);
+            } else {
                 while (c < e && *c != ']') ++c;
                 fmt_check(S, c < e,  "expected '}' before end of string1");
-                lua_pushlstring(S->L, p, c - p);
-                lua_gettable(S->L, to);
+                if (to) lua_pushlstring(S->L, p, c - p), lua_gettable(S->L, to);
             }
             p = c + 1;
         }
-        lua_replace(S->L, to);
+        if (to) lua_replace(S->L, to);
     } while (*p == '.' || *p == '[');
     *pp = p;
 }
 
-static void fmt_argid(fmt_State *S, int to, const char **pp, const char *e) {
+#define FMT_ARGNONE  0
+#define FMT_ARGAUTO  1
+#define FMT_ARGINDEX 2
+#define FMT_ARGNAME  3
+
+typedef struct fmt_Arg {
+    int kind;          /* FMT_ARG* */
+    int idx;           /* FMT_ARGAUTO/FMT_ARGINDEX, 2 for the first argument */
+    unsigned name, namelen; /* FMT_ARGNAME, key into the first argument */
+    unsigned acc, acclen;   /* accessors after it */
+} fmt_Arg;
+
+static void fmt_argid(fmt_State *S, fmt_Arg *a, const char **pp, const char *e) {
     /* [(number | identity) [accessor]] */
     const char *p = *pp;
     fmt_check(S, p < e, "expected '}' before end of string2");
-    do {
-        int idx;
-        if (*p == ':' || *p == '}') {
-            idx = fmt_autoidx(S);
-            lua_copy(S->L, idx, to);
-        } else if (fmt_isdigit(*p)) {
-            fmt_manualidx(S);
-            idx = fmt_integer(S, &p) + 1;
-            fmt_check(S, idx>1 && idx<=S->top, "argument index out of range");
-            lua_copy(S->L, idx, to);
-        } else if (fmt_isalpha(*p)) {
-            fmt_manualidx(S);
-            fmt_identity(S, &p);
-            lua_gettable(S->L, 2);
-            lua_replace(S->L, to);
-        } else luaL_error(S->L, "unexpected '%c' in field name", *p);
-    } while (0);
+    if (*p == ':' || *p == '}')
+        a->kind = FMT_ARGAUTO, a->idx = fmt_autoidx(S);
+    else if (fmt_isdigit(*p)) {
+        fmt_manualidx(S);
+        a->kind = FMT_ARGINDEX, a->idx = fmt_integer(S, &p) + 1;
+    } else if (fmt_isalpha(*p)) {
+        const char *b = p;
+        fmt_manualidx(S);
+        fmt_identity(&p);
+        a->kind = FMT_ARGNAME;
+        a->name = (unsigned)(b - S->s), a->namelen = (unsigned)(p - b);
+    } else luaL_error(S->L, "unexpected '%c' in field name", *p);
+    a->acc = (unsigned)(p - S->s);
+    if (*p == '.' || *p == '[') fmt_accessor(S, 0, &p, e);
+    a->acclen = (unsigned)(p - S->s) - a->acc;
     *pp = p;
-    if (*p == '.' || *p == '[') fmt_accessor(S, to, pp, e);
+}
+
+static void fmt_fetch(fmt_State *S, const fmt_Arg *a, int to) {
+    int nargs = S->top - S->arg0 + 1; /* counting the format */
+    switch (a->kind) {
+    case FMT_ARGAUTO:
+        fmt_check(S, a->idx <= nargs, "automatic index out of range");
+        lua_copy(S->L, S->arg0 - 1 + a->idx, to);
+        break;
+    case FMT_ARGINDEX:
+        fmt_check(S, a->idx>1 && a->idx<=nargs, "argument index out of range");
+        lua_copy(S->L, S->arg0 - 1 + a->idx, to);
+        break;
+    default:
+        lua_pushlstring(S->L, S->s + a->name, a->namelen);
+        lua_gettable(S->L, S->arg0 + 1);
+        lua_replace(S->L, to);
+    }
+    if (a->acclen) {
+        const char *p = S->s + a->acc;
+        fmt_accessor(S, to, &p, S->e);
+    }
 }
 
 /* read spec */
@@ -168,24 +271,28 @@ typedef struct fmt_Spec {
     int type;
 } fmt_Spec;
 
+typedef struct fmt_Field {
+    fmt_Arg  arg;
+    fmt_Arg  width;      /* '{' argid '}' in the spec, if kind is set */
+    fmt_Arg  precision;
+    fmt_Spec spec;
+} fmt_Field;
+
 static int fmt_readchar(fmt_State *S, const char **pp, const char *e) {
     int ch = *(*pp)++;
     fmt_check(S, *pp < e, "unmatched '{' in format spec");
     return ch;
 }
 
-static int fmt_readint(fmt_State *S, const char *name, const char **pp, const char *e) {
+static int fmt_readint(fmt_State *S, const char *name, fmt_Arg *a, const char **pp, const char *e) {
     /* number | '{' argid '}' */
     const char *p = *pp;
-    int isint, v = 0;
+    int v = 0;
     if (*p == '{') {
         p += 1;
-        fmt_argid(S, fmt_tmpslot(S), &p, e);
+        fmt_argid(S, a, &p, e);
         fmt_check(S, *p == '}', "unexpected '%c' in field name", *p);
         *pp = p + 1;
-        v = (int)lua_tointegerx(S->L, fmt_tmpslot(S), &isint);
-        fmt_check(S, isint, "integer expected for %s, got %s",
-                name, luaL_typename(S->L, fmt_tmpslot(S)));
     } else if (fmt_isdigit(*p)) {
         v = fmt_integer(S, pp);
         fmt_check(S, *pp < e, "unmatched '{' in format spec");
@@ -193,8 +300,18 @@ static int fmt_readint(fmt_State *S, const char *name, const char **pp, const ch
     return v;
 }
 
-static void fmt_spec(fmt_State *S, fmt_Spec *d, const char **pp, const char *e) {
+static int fmt_argint(fmt_State *S, const char *name, const fmt_Arg *a) {
+    int isint, v;
+    fmt_fetch(S, a, fmt_tmpslot(S));
+    v = (int)lua_tointegerx(S->L, fmt_tmpslot(S), &isint);
+    fmt_check(S, isint, "integer expected for %s, got %s",
+            name, luaL_typename(S->L, fmt_tmpslot(S)));
+    return v;
+}
+
+static void fmt_spec(fmt_State *S, fmt_Field *f, const char **pp, const char *e) {
     /* [[fill]align][sign]["#"]["0"][width][grouping]["." precision][type] */
+    fmt_Spec *d = &f->spec;
     const char *p = *pp;
     if (p[1] == '<' || p[1] == '>' || p[1] == '^') {
         d->fill  = fmt_readchar(S, &p, e);
@@ -205,9 +322,11 @@ static void fmt_spec(fmt_State *S, fmt_Spec *d, const char **pp, const char *e)
         d->sign = fmt_readchar(S, &p, e);
     if (*p == '#') d->alter = fmt_readchar(S, &p, e);
     if (*p == '0') d->zero  = fmt_readchar(S, &p, e);
-    if (fmt_isdigit(*p) || *p == '{') d->width = fmt_readint(S, "width", &p, e);
+    if (fmt_isdigit(*p) || *p == '{')
+        d->width = fmt_readint(S, "width", &f->width, &p, e);
     if (*p == '_' || *p == ',') d->grouping = fmt_readchar(S, &p, e);
-    if (*p == '.') ++p, d->precision = fmt_readint(S, "precision", &p, e);
+    if (*p == '.')
+        ++p, d->precision = fmt_readint(S, "precision", &f->precision, &p, e);
     if (*p != '}') {
         const char *b = p++;
         d->type = *b;
@@ -234,33 +353,33 @@ static void fmt_addpadding(fmt_State *S, int ch, size_t len) {
     char *s;
     if (ch == 0) ch = ' ';
     while (len > LUAL_BUFFERSIZE) {
-        s = luaL_prepbuffer(&S->B);
+        s = fmt_prepbuffsize(S, LUAL_BUFFERSIZE);
         memset(s, ch, LUAL_BUFFERSIZE);
-        luaL_addsize(&S->B, LUAL_BUFFERSIZE);
+        fmt_addsize(S, LUAL_BUFFERSIZE);
         len -= LUAL_BUFFERSIZE;
     }
-    s = luaL_prepbuffer(&S->B);
+    s = fmt_prepbuffsize(S, len);
     memset(s, ch, len);
-    luaL_addsize(&S->B, len);
+    fmt_addsize(S, len);
 }
 
 static void fmt_addzeroing(fmt_State *S, const fmt_Spec *d, size_t len) {
-    char *s = luaL_prepbuffer(&S->B);
+    char *s = fmt_prepbuffsize(S, LUAL_BUFFERSIZE);
     if (len > (size_t)S->zeroing) {
         int pref = (len - S->zeroing) % 4;
-        if (pref > 2) *s++ = '0', luaL_addsize(&S->B, 1);
-        if (pref > 0) *s++ = '0', *s++ = d->grouping, luaL_addsize(&S->B, 2);
+        if (pref > 2) *s++ = '0', fmt_addsize(S, 1);
+        if (pref > 0) *s++ = '0', *s++ = d->grouping, fmt_addsize(S, 2);
         len -= pref;
         while (len > 4) {
             size_t curr = len > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : len;
-            s = luaL_prepbuffer(&S->B);
+            s = fmt_prepbuffsize(S, LUAL_BUFFERSIZE);
             while (curr > 4) {
                 s[0] = s[1] = s[2] = '0', s[3] = d->grouping;
-                s += 4, luaL_addsize(&S->B, 4), curr -= 4, len -= 4;
+                s += 4, fmt_addsize(S, 4), curr -= 4, len -= 4;
             }
         }
     }
-    memset(s, '0', len), luaL_addsize(&S->B, len);
+    memset(s, '0', len), fmt_addsize(S, len);
 }
 
 static void fmt_addstring(fmt_State *S, int shrink, const fmt_Spec *d, const char *s, size_t len) {
@@ -268,7 +387,7 @@ static void fmt_addstring(fmt_State *S, int shrink, const fmt_Spec *d, const cha
     if (shrink && d->precision)
         len = len > (size_t)d->precision ? (size_t)d->precision : len;
     if (len > (size_t)d->width) {
-        luaL_addlstring(&S->B, s, len);
+        fmt_addlstring(S, s, len);
         return;
     }
     plen = d->width - (int)len;
@@ -277,11 +396,11 @@ static void fmt_addstring(fmt_State *S, int shrink, const fmt_Spec *d, const cha
     case '<': !d->zero || d->grouping == 0 ?
               fmt_addpadding(S, d->fill ? d->fill : d->zero, plen) :
                   fmt_addzeroing(S, d, plen);
-              luaL_addlstring(&S->B, s, len); break;
-    case '>': luaL_addlstring(&S->B, s, len);
+              fmt_addlstring(S, s, len); break;
+    case '>': fmt_addlstring(S, s, len);
               fmt_addpadding(S, d->fill, plen); break;
     case '^': fmt_addpadding(S, d->fill, plen/2);
-              luaL_addlstring(&S->B, s, len);
+              fmt_addlstring(S, s, len);
               fmt_addpadding(S, d->fill, plen - plen/2); break;
     }
 }
@@ -368,7 +487,7 @@ static void fmt_dumpint(fmt_State *S, lua_Integer v, fmt_Spec *d) {
         *--p = d->type, *--p = '0';
     if ((p[-1] = fmt_writesign(sign, d->sign)) != 0) --p;
     if (d->zero && d->width > FMT_INTBUFFSIZ - (p-buff)) {
-        if (b > p) luaL_addlstring(&S->B, p, b - p);
+        if (b > p) fmt_addlstring(S, p, b - p);
         width -= (int)(b - p), p = b;
     }
     d->width = width;
@@ -407,7 +526,7 @@ static void fmt_dumpflt(fmt_State *S, lua_Number v, fmt_Spec *d) {
     if ((*dp = fmt_writesign(sign, d->sign)) != 0) ++dp;
     len = fmt_writeflt(dp, FMT_FLTBUFFSIZ - (dp-buff), v, d);
     if (d->zero && width > len) {
-        if (dp > p) luaL_addlstring(&S->B, buff, dp - p);
+        if (dp > p) fmt_addlstring(S, buff, dp - p);
         width -= (int)(dp - buff), p = dp;
     }
     d->width = width;
@@ -452,51 +571,258 @@ static void fmt_dump(fmt_State *S, fmt_Spec *d) {
 
 /* format */
 
-static void fmt_parse(fmt_State *S, fmt_Spec *d, const char **pp, const char *e) {
+static void fmt_parse(fmt_State *S, fmt_Field *f, const char **pp, const char *e) {
     /* "{" [arg_id] [":" format_spec] "}" */
     const char *p = *pp;
-    fmt_argid(S, fmt_argslot(S), &p, e);
+    fmt_argid(S, &f->arg, &p, e);
     if (*p == ':' && ++p < e)
-        fmt_spec(S, d, &p, e);
+        fmt_spec(S, f, &p, e);
     fmt_check(S, p < e && *p == '}', "expected '}' before end of string3");
     *pp = p + 1;
 }
 
-static int fmt_format(fmt_State *S, const char *p, const char *e) {
-    lua_settop(S->L, S->top + 2); /* two helper slot */
-    luaL_buffinit(S->L, &S->B);
+static void fmt_field(fmt_State *S, const fmt_Field *f) {
+    fmt_Spec d = f->spec; /* the dump routines change it */
+    fmt_fetch(S, &f->arg, fmt_argslot(S));
+    if (f->width.kind) d.width = fmt_argint(S, "width", &f->width);
+    if (f->precision.kind)
+        d.precision = fmt_argint(S, "precision", &f->precision);
+    fmt_dump(S, &d);
+}
+
+static void fmt_format(fmt_State *S, const char *p, const char *e) {
     for (;;) {
         const char *b = p;
         while (p < e && *p != '{' && *p != '}') ++p;
-        if (b < p) luaL_addlstring(&S->B, b, p - b);
+        if (b < p) fmt_addlstring(S, b, p - b);
         if (p >= e) break;
         if (*p == p[1])
-            luaL_addchar(&S->B, *p), p += 2;
+            fmt_addchar(S, *p), p += 2;
         else {
-            fmt_Spec d;
+            fmt_Field f;
             if (*p++ == '}' || p >= e)
-                return luaL_error(S->L,
+                luaL_error(S->L,
                     "Single '%c' encountered in format string", p[-1]);
-            memset(&d, 0, sizeof(d));
-            fmt_parse(S, &d, &p, e);
-            fmt_dump(S, &d);
+            memset(&f, 0, sizeof(f));
+            fmt_parse(S, &f, &p, e);
+            fmt_field(S, &f);
         }
     }
-    return luaL_pushresult(&S->B), 1;
+}
+
+/* compiled format: the literal text and parsed fields of a format string,
+ * so formatting with it skips the parsing */
+
+typedef struct fmt_Item {
+    unsigned  lit, litlen; /* literal text before the field */
+    int       hasfield;
+    fmt_Field f;
+} fmt_Item;
+
+typedef struct fmt_Format {
+    fmt_Item *items;
+    int       count;
+    size_t    len;
+    char     *s;  /* copy of the format string, after the items */
+} fmt_Format;
+
+static void fmt_compiled(fmt_State *S, const fmt_Format *f) {
+    int i;
+    for (i = 0; i < f->count; ++i) {
+        const fmt_Item *it = &f->items[i];
+        if (it->litlen) fmt_addlstring(S, f->s + it->lit, it->litlen);
+        if (it->hasfield) fmt_field(S, &it->f);
+    }
+}
+
+static void fmt_run(fmt_State *S, int arg0, fmt_Buffer *buff) {
+    lua_State *L = S->L;
+    fmt_Format *f = (fmt_Format*)fmt_toudata(L, arg0, FMT_FORMATMT);
+    size_t len;
+    S->arg0 = arg0;
+    S->buff = buff;
+    S->idx  = 1;
+    S->top  = lua_gettop(L);
+    if (f != NULL)
+        S->s = f->s, S->e = f->s + f->len;
+    else {
+        S->s = luaL_checklstring(L, arg0, &len);
+        S->e = S->s + len;
+    }
+    lua_settop(L, S->top + 2); /* two helper slot */
+    if (buff == NULL) luaL_buffinit(L, &S->B);
+    if (f != NULL)
+        fmt_compiled(S, f);
+    else
+        fmt_format(S, S->s, S->e);
+    if (buff == NULL) luaL_pushresult(&S->B);
 }
 
 static int Lformat(lua_State *L) {
     fmt_State S;
-    size_t len;
-    const char *p = luaL_checklstring(L, 1, &len);
-    S.L   = L;
-    S.idx = 1;
-    S.top = lua_gettop(L);
-    return fmt_format(&S, p, p+len);
+    S.L = L;
+    fmt_run(&S, 1, NULL);
+    return 1;
+}
+
+static int Lcall(lua_State *L)
+{ return lua_remove(L, 1), Lformat(L); }
+
+static int Lcompile(lua_State *L) {
+    fmt_State S;
+    luaL_Buffer B;
+    fmt_Format *f;
+    size_t len, n = 0;
+    const char *p = luaL_checklstring(L, 1, &len), *e = p + len;
+    memset(&S, 0, sizeof(S));
+    S.L = L, S.s = p, S.e = e, S.idx = 1;
+    luaL_buffinit(L, &B); /* collects the items */
+    for (;;) {
+        const char *b = p;
+        fmt_Item it;
+        memset(&it, 0, sizeof(it));
+        while (p < e && *p != '{' && *p != '}') ++p;
+        it.lit = (unsigned)(b - S.s), it.litlen = (unsigned)(p - b);
+        if (p < e && *p == p[1])
+            it.litlen += 1, p += 2;
+        else if (p < e) {
+            if (*p++ == '}' || p >= e)
+                luaL_error(L, "Single '%c' encountered in format string", p[-1]);
+            fmt_parse(&S, &it.f, &p, e);
+            it.hasfield = 1;
+        }
+        if (it.litlen || it.hasfield)
+            luaL_addlstring(&B, (const char*)&it, sizeof(it)), ++n;
+        if (p >= e) break;
+    }
+    luaL_pushresult(&B);
+    f = (fmt_Format*)lua_newuserdata(L, sizeof(fmt_Format)
+            + n*sizeof(fmt_Item) + len + 1);
+    f->items = (fmt_Item*)(f + 1);
+    f->count = (int)n;
+    f->len   = len;
+    f->s     = (char*)(f->items + n);
+    memcpy(f->items, lua_tostring(L, -2), n*sizeof(fmt_Item));
+    memcpy(f->s, S.s, len), f->s[len] = '\0';
+    lua_pushvalue(L, FMT_FORMATMT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int Lformat_tostring(lua_State *L) {
+    fmt_Format *f = (fmt_Format*)fmt_toudata(L, 1, FMT_FORMATMT);
+    if (f == NULL) f = (fmt_Format*)luaL_checkudata(L, 1, FMT_FORMAT);
+    lua_pushfstring(L, "fmt.Format: %s", f->s);
+    return 1;
+}
+
+/* native buffer: formats append to it with buf:format(fmt, ...), where
+ * fmt is a format string or a compiled format, and its bytes go to
+ * native code with buf:pointer() or to Lua with buf:tostring(). On an
+ * error the output of the failed call is left partly written. */
+
+static fmt_Buffer *fmt_checkbuffer(lua_State *L, int idx) {
+    fmt_Buffer *b = (fmt_Buffer*)fmt_toudata(L, idx, FMT_BUFFERMT);
+    return b ? b : (fmt_Buffer*)luaL_checkudata(L, idx, FMT_BUFFER);
+}
+
+static int Lbuffer(lua_State *L) {
+    lua_Integer cap = luaL_optinteger(L, 1, 0);
+    fmt_Buffer *b = (fmt_Buffer*)lua_newuserdata(L, sizeof(fmt_Buffer));
+    b->p = NULL, b->len = b->cap = 0;
+    lua_pushvalue(L, FMT_BUFFERMT);
+    lua_setmetatable(L, -2);
+    if (cap > 0) fmt_buffreserve(L, b, (size_t)cap);
+    return 1;
+}
+
+static int Lbuf_format(lua_State *L) {
+    fmt_State S;
+    S.L = L;
+    fmt_run(&S, 2, fmt_checkbuffer(L, 1));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lbuf_tostring(lua_State *L) {
+    fmt_Buffer *b = fmt_checkbuffer(L, 1);
+    lua_pushlstring(L, b->p ? b->p : "", b->len);
+    return 1;
+}
+
+static int Lbuf_len(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)fmt_checkbuffer(L, 1)->len);
+    return 1;
+}
+
+static int Lbuf_reset(lua_State *L) {
+    fmt_checkbuffer(L, 1)->len = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lbuf_pointer(lua_State *L) {
+    fmt_Buffer *b = fmt_checkbuffer(L, 1);
+    lua_pushlightuserdata(L, b->p);
+    lua_pushinteger(L, (lua_Integer)b->len);
+    return 2;
+}
+
+static int Lbuf_gc(lua_State *L) {
+    fmt_Buffer *b = fmt_checkbuffer(L, 1);
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    allocf(ud, b->p, b->cap, 0);
+    b->p = NULL, b->len = b->cap = 0;
+    return 0;
+}
+
+static void fmt_setfuncs(lua_State *L, int idx, const luaL_Reg *l) {
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    luaL_setfuncs(L, l, 2);
+    lua_pop(L, 1);
 }
 
 LUALIB_API int luaopen_fmt(lua_State *L) {
-    lua_pushcfunction(L, Lformat);
+    luaL_Reg libs[] = {
+        { "format",  Lformat  },
+        { "compile", Lcompile },
+        { "buffer",  Lbuffer  },
+        { NULL, NULL }
+    };
+    luaL_Reg format[] = {
+        { "__call",     Lformat          },
+        { "__tostring", Lformat_tostring },
+        { NULL, NULL }
+    };
+    luaL_Reg buffer[] = {
+        { "__len",      Lbuf_len      },
+        { "__tostring", Lbuf_tostring },
+        { "__gc",       Lbuf_gc       },
+        { "format",     Lbuf_format   },
+        { "tostring",   Lbuf_tostring },
+        { "reset",      Lbuf_reset    },
+        { "pointer",    Lbuf_pointer  },
+        { NULL, NULL }
+    };
+    luaL_Reg call[] = {
+        { "__call", Lcall }, /* fmt(...) still formats */
+        { NULL, NULL }
+    };
+    lua_settop(L, 0);
+    luaL_newmetatable(L, FMT_FORMAT);
+    luaL_newmetatable(L, FMT_BUFFER);
+    lua_pushvalue(L, 2);
+    lua_setfield(L, 2, "__index");
+    fmt_setfuncs(L, 1, format);
+    fmt_setfuncs(L, 2, buffer);
+    luaL_newlibtable(L, libs);
+    fmt_setfuncs(L, 3, libs);
+    lua_createtable(L, 0, 1);
+    fmt_setfuncs(L, 4, call);
+    lua_setmetatable(L, 3);
     return 1;
 }
 
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <DetourCommon.h>
+#include <DetourNavMesh.h>
+#include <DetourNavMeshQuery.h>
+
+namespace pluto
+{
+    // Distance field over the polygons of a dtNavMesh, flowing towards one
+    // target (Dijkstra from the target polygon).
+    //
+    // Every reached polygon keeps its distance to the target, the next
+    // polygon on the way there, and a waypoint on the edge shared with it.
+    // Walking straight to the waypoint stays inside the (convex) polygon, so
+    // agents only need the polygon they stand on to steer: one lookup instead
+    // of one A* per agent.
+    class flow_field
+    {
+    public:
+        bool build(const dtNavMesh *mesh, const dtQueryFilter *filter, dtPolyRef target, const float *pos, float max_dist)
+        {
+            mesh_ = mesh;
+            filter_ = filter;
+            max_dist_ = max_dist > 0.0f ? max_dist : FLT_MAX;
+            drift_ = 0.0f;
+            index_polys();
+
+            int source = slot_of(target);
+            if (source < 0)
+                return false;
+
+            nodes_.assign(refs_.size(), node{FLT_MAX, -1, {0.0f, 0.0f, 0.0f}});
+            target_ = target;
+            dtVcopy(target_pos_, pos);
+
+            search(source, pos, max_dist_, [](int)
+                   { return true; },
+                   [this](int slot, float dist, int parent, const float *waypoint)
+                   {
+                       node &n = nodes_[slot];
+                       n.dist = dist;
+                       n.parent = parent;
+                       dtVcopy(n.waypoint, waypoint);
+                   });
+            return true;
+        }
+
+        // Follow a target that moved a short distance. Only polygons within
+        // about twice the move (plus `repair`) of the old target are searched
+        // again; everything further out keeps its old next polygon, which
+        // leads into the repaired area and from there to the new target. The
+        // far distances drift by up to the distance moved, so the field is
+        // rebuilt once the drift adds up to more than 4 * repair.
+        bool move(dtPolyRef target, const float *pos, float repair)
+        {
+            int source = slot_of(target);
+            if (source < 0)
+                return false;
+
+            if (target == target_)
+            {
+                dtVcopy(target_pos_, pos);
+                return true;
+            }
+
+            int old_source = slot_of(target_);
+            float moved = nodes_[source].dist;
+            if (old_source < 0 || moved == FLT_MAX || drift_ + moved > 4.0f * repair)
+                return build(mesh_, filter_, target, pos, max_dist_);
+
+            thread_local std::vector<node> repaired;
+            thread_local std::vector<int> touched;
+            repaired.resize(nodes_.size());
+            touched.clear();
+
+            const float radius = 2.0f * moved + repair;
+            search(source, pos, max_dist_, [this, radius](int slot)
+                   { return nodes_[slot].dist <= radius; },
+                   [](int slot, float dist, int parent, const float *waypoint)
+                   {
+                       node &n = repaired[slot];
+                       n.dist = dist;
+                       n.parent = parent;
+                       dtVcopy(n.waypoint, waypoint);
+                       touched.push_back(slot);
+                   });
+
+            // The old target must be reachable inside the repaired area, or
+            // the chains that end there would be cut.
+            bool linked = false;
+            for (int slot : touched)
+                linked = linked || slot == old_source;
+            if (!linked)
+                return build(mesh_, filter_, target, pos, max_dist_);
+
+            for (int slot : touched)
+                nodes_[slot] = repaired[slot];
+            drift_ += nodes_[old_source].dist;
+            target_ = target;
+            dtVcopy(target_pos_, pos);
+            return true;
+        }
+
+        // Next point to walk to from pos, standing on polygon ref.
+        bool next(dtPolyRef ref, const float *pos, float *waypoint, float *dist) const
+        {
+            int slot = slot_of(ref);
+            if (slot < 0 || nodes_[slot].dist == FLT_MAX)
+                return false;
+
+            if (ref == target_)
+            {
+                // on the target polygon, head straight for the target
+                dtVcopy(waypoint, target_pos_);
+                *dist = dtVdist(pos, target_pos_);
+                return true;
+            }
+            // Standing on the waypoint means standing on the shared edge, where
+            // the polygon lookup may still answer the polygon being left.
+            const node *n = &nodes_[slot];
+            while (n->parent >= 0 && refs_[n->parent] != target_ && dtVdist2DSqr(pos, n->waypoint) < 1e-4f)
+                n = &nodes_[n->parent];
+            if (n->parent >= 0 && refs_[n->parent] == target_ && dtVdist2DSqr(pos, n->waypoint) < 1e-4f)
+            {
+                dtVcopy(waypoint, target_pos_);
+                *dist = dtVdist(pos, target_pos_);
+                return true;
+            }
+            dtVcopy(waypoint, n->waypoint);
+            *dist = n->dist;
+            return true;
+        }
+
+        dtPolyRef target() const
+        {
+            return target_;
+        }
+
+        const float *target_pos() const
+        {
+            return target_pos_;
+        }
+
+    private:
+        struct node
+        {
+            float dist;
+            int parent; // slot of the next polygon towards the target
+            float waypoint[3];
+        };
+
+        void index_polys()
+        {
+            const int max_tiles = mesh_->getMaxTiles();
+            tile_base_.assign((size_t)max_tiles + 1, 0);
+            refs_.clear();
+            centers_.clear();
+            for (int i = 0; i < max_tiles; ++i)
+            {
+                const dtMeshTile *tile = mesh_->getTile(i);
+                int n = (tile && tile->header) ? tile->header->polyCount : 0;
+                tile_base_[(size_t)i + 1] = tile_base_[i] + n;
+                if (n == 0)
+                    continue;
+
+                dtPolyRef base = mesh_->getPolyRefBase(tile);
+                for (int p = 0; p < n; ++p)
+                {
+                    const dtPoly *poly = &tile->polys[p];
+                    float c[3] = {0.0f, 0.0f, 0.0f};
+                    for (int k = 0; k < poly->vertCount; ++k)
+                        dtVadd(c, c, &tile->verts[poly->verts[k] * 3]);
+                    dtVscale(c, c, 1.0f / (float)poly->vertCount);
+                    refs_.push_back(base | (dtPolyRef)p);
+                    centers_.insert(centers_.end(), c, c + 3);
+                }
+            }
+        }
+
+        int slot_of(dtPolyRef ref) const
+        {
+            if (nullptr == mesh_ || !mesh_->isValidPolyRef(ref))
+                return -1;
+            int tile = (int)mesh_->decodePolyIdTile(ref);
+            int poly = (int)mesh_->decodePolyIdPoly(ref);
+            if ((size_t)tile + 1 >= tile_base_.size() || poly >= tile_base_[(size_t)tile + 1] - tile_base_[tile])
+                return -1;
+            int slot = tile_base_[tile] + poly;
+            return refs_[slot] == ref ? slot : -1;
+        }
+
+        // Dijkstra from `source` (entered at pos) over the polygons accepted by
+        // `inside`. `reach` is called every time a polygon gets a shorter
+        // distance, so the last call for each polygon is the final one.
+        template <typename Inside, typename Reach>
+        void search(int source, const float *pos, float max_dist, Inside &&inside, Reach &&reach) const
+        {
+            thread_local std::vector<float> g;
+            thread_local std::vector<uint32_t> stamps;
+            thread_local uint32_t stamp = 0;
+            if (g.size() < refs_.size())
+            {
+                g.resize(refs_.size());
+                stamps.resize(refs_.size(), 0);
+            }
+            if (++stamp == 0)
+            {
+                std::fill(stamps.begin(), stamps.end(), 0);
+                stamp = 1;
+            }
+
+            // node positions: the target itself for the source, centers elsewhere
+            auto position = [&](int slot)
+            { return slot == source ? pos : &centers_[(size_t)slot * 3]; };
+
+            using item = std::pair<float, int>;
+            std::priority_queue<item, std::vector<item>, std::greater<item>> open;
+            g[source] = 0.0f;
+            stamps[source] = stamp;
+            open.emplace(0.0f, source);
+            reach(source, 0.0f, -1, pos);
+
+            while (!open.empty())
+            {
+                auto [d, u] = open.top();
+                open.pop();
+                if (d > g[u])
+                    continue;
+
+                const dtMeshTile *tile = nullptr;
+                const dtPoly *poly = nullptr;
+                mesh_->getTileAndPolyByRefUnsafe(refs_[u], &tile, &poly);
+                for (unsigned int k = poly->firstLink; k != DT_NULL_LINK; k = tile->links[k].next)
+                {
+                    const dtLink &link = tile->links[k];
+                    const dtMeshTile *ntile = nullptr;
+                    const dtPoly *npoly = nullptr;
+                    mesh_->getTileAndPolyByRefUnsafe(link.ref, &ntile, &npoly);
+                    // dtQueryFilter::passFilter is not visible outside Detour unless it is virtual
+                    if (npoly->getType() == DT_POLYTYPE_OFFMESH_CONNECTION
+                        || (npoly->flags & filter_->getIncludeFlags()) == 0
+                        || (npoly->flags & filter_->getExcludeFlags()) != 0)
+                        continue;
+
+                    int v = slot_of(link.ref);
+                    if (v < 0 || !inside(v))
+                        continue;
+
+                    // waypoint for v: the middle of the part of the edge it shares with u
+                    const float *va = &tile->verts[poly->verts[link.edge] * 3];
+                    const float *vb = &tile->verts[poly->verts[(link.edge + 1) % poly->vertCount] * 3];
+                    float tmin = 0.0f;
+                    float tmax = 1.0f;
+                    if (link.side != 0xff)
+                    {
+                        tmin = link.bmin / 255.0f;
+                        tmax = link.bmax / 255.0f;
+                    }
+                    float mid[3];
+                    dtVlerp(mid, va, vb, (tmin + tmax) * 0.5f);
+
+                    float cost = dtVdist(position(u), mid) * filter_->getAreaCost(poly->getArea())
+                                 + dtVdist(mid, position(v)) * filter_->getAreaCost(npoly->getArea());
+                    float nd = d + cost;
+                    if (nd > max_dist || (stamps[v] == stamp && g[v] <= nd))
+                        continue;
+                    g[v] = nd;
+                    stamps[v] = stamp;
+                    open.emplace(nd, v);
+                    reach(v, nd, u, mid);
+                }
+            }
+        }
+
+        const dtNavMesh *mesh_ = nullptr;
+        const dtQueryFilter *filter_ = nullptr;
+        std::vector<int> tile_base_;  // first poly slot of each tile
+        std::vector<dtPolyRef> refs_; // poly ref of each slot
+        std::vector<float> centers_;  // poly center of each slot
+        std::vector<node> nodes_;
+        dtPolyRef target_ = 0;
+        float target_pos_[3] = {0.0f, 0.0f, 0.0f};
+        float max_dist_ = FLT_MAX;
+        float drift_ = 0.0f;
+    };
+} // namespace pluto
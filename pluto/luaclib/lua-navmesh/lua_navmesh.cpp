@@ -1,3 +1,4 @@
+#include <vector>
 #include <lua.hpp>
 #include "navmesh.hpp"
 
@@ -51,6 +52,51 @@ Type lua_check(lua_State *L, int index)
     }
 }
 
+// Packed float array argument: either a string of native floats, or a
+// (light)userdata pointer followed by the element count. `next` is set to
+// the index of the first argument after it.
+static const float *lua_check_floats(lua_State *L, int index, size_t stride, size_t &count, int &next)
+{
+    const size_t elem = stride * sizeof(float);
+    if (lua_type(L, index) == LUA_TSTRING)
+    {
+        size_t size;
+        const char *sz = lua_tolstring(L, index, &size);
+        luaL_argcheck(L, size % elem == 0, index, "packed float array size mismatch");
+        count = size / elem;
+        next = index + 1;
+        return reinterpret_cast<const float *>(sz);
+    }
+    const float *p = (const float *)lua_touserdata(L, index);
+    if (nullptr == p)
+        luaL_typeerror(L, index, "string or userdata");
+    auto n = luaL_checkinteger(L, index + 1);
+    luaL_argcheck(L, n > 0 && static_cast<lua_Unsigned>(n) <= SIZE_MAX / elem, index + 1, "invalid element count");
+    count = static_cast<size_t>(n);
+    // a full userdata knows its size, a light one has to be trusted
+    if (lua_type(L, index) == LUA_TUSERDATA)
+        luaL_argcheck(L, count * elem <= lua_rawlen(L, index), index + 1, "element count exceeds the buffer");
+    next = index + 2;
+    return p;
+}
+
+// Caller-supplied output: a (light)userdata followed by its capacity in
+// elements of elem bytes, which must hold count elements. Returns nullptr
+// if the argument is absent and not required.
+static void *lua_opt_output(lua_State *L, int index, size_t elem, size_t count, bool required)
+{
+    if (!required && lua_isnoneornil(L, index))
+        return nullptr;
+    void *p = lua_touserdata(L, index);
+    if (nullptr == p)
+        luaL_typeerror(L, index, "userdata");
+    auto cap = luaL_checkinteger(L, index + 1);
+    luaL_argcheck(L, cap >= 0 && static_cast<lua_Unsigned>(cap) >= count, index + 1, "output capacity too small");
+    if (lua_type(L, index) == LUA_TUSERDATA)
+        luaL_argcheck(L, count * elem <= lua_rawlen(L, index), index, "output buffer too small");
+    return p;
+}
+
 static int load_static(lua_State *L)
 {
     auto meshfile = lua_check<std::string>(L, 1);
@@ -65,6 +111,13 @@ static int load_static(lua_State *L)
     return 2;
 }
 
+static int unload_static(lua_State *L)
+{
+    auto meshfile = lua_check<std::string>(L, 1);
+    lua_pushboolean(L, pluto::navmesh::unload_static(meshfile));
+    return 1;
+}
+
 static int load_dynamic(lua_State *L)
 {
     navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
@@ -110,6 +163,36 @@ static int find_straight_path(lua_State *L)
     return 2;
 }
 
+static int find_hierarchical_path(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto sx = lua_check<float>(L, 2);
+    auto sy = lua_check<float>(L, 3);
+    auto sz = lua_check<float>(L, 4);
+    auto ex = lua_check<float>(L, 5);
+    auto ey = lua_check<float>(L, 6);
+    auto ez = lua_check<float>(L, 7);
+    int lookahead = (int)luaL_optinteger(L, 8, 4);
+    std::vector<float> paths;
+    bool complete = true;
+    if (p->find_hierarchical_path(sx, sy, sz, ex, ey, ez, lookahead, paths, complete))
+    {
+        lua_createtable(L, (int)paths.size(), 0);
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            lua_pushnumber(L, paths[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushboolean(L, complete);
+        return 2;
+    }
+    lua_pushboolean(L, 0);
+    lua_pushlstring(L, p->get_status().data(), p->get_status().size());
+    return 2;
+}
+
 static int valid(lua_State *L)
 {
     navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
@@ -185,6 +268,168 @@ static int recast(lua_State *L)
     return 4;
 }
 
+// Batch queries write into caller buffers when an output userdata and its
+// capacity follow the input (flags, then float3 positions) and return the
+// element count; without one the results come back as packed strings.
+static int valid_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    size_t n = 0;
+    int next = 0;
+    const float *points = lua_check_floats(L, 2, 3, n, next);
+
+    if (auto out = (uint8_t *)lua_opt_output(L, next, 1, n, false))
+    {
+        p->valid_batch(points, n, out);
+        lua_pushinteger(L, (lua_Integer)n);
+        return 1;
+    }
+    thread_local std::vector<uint8_t> valid;
+    valid.resize(n);
+    p->valid_batch(points, n, valid.data());
+    lua_pushlstring(L, (const char *)valid.data(), n);
+    return 1;
+}
+
+static int recast_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    size_t n = 0;
+    int next = 0;
+    const float *segments = lua_check_floats(L, 2, 6, n, next);
+
+    if (auto out = (uint8_t *)lua_opt_output(L, next, 1, n, false))
+    {
+        auto out_pos = (float *)lua_opt_output(L, next + 2, 3 * sizeof(float), n, true);
+        p->recast_batch(segments, n, out, out_pos);
+        lua_pushinteger(L, (lua_Integer)n);
+        return 1;
+    }
+    thread_local std::vector<uint8_t> hit;
+    thread_local std::vector<float> hitPos;
+    hit.resize(n);
+    hitPos.assign(n * 3, 0.0f);
+    p->recast_batch(segments, n, hit.data(), hitPos.data());
+    lua_pushlstring(L, (const char *)hit.data(), n);
+    lua_pushlstring(L, (const char *)hitPos.data(), hitPos.size() * sizeof(float));
+    return 2;
+}
+
+static int random_position_around_circle_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    size_t n = 0;
+    int next = 0;
+    const float *circles = lua_check_floats(L, 2, 4, n, next);
+
+    if (auto out = (uint8_t *)lua_opt_output(L, next, 1, n, false))
+    {
+        auto out_pos = (float *)lua_opt_output(L, next + 2, 3 * sizeof(float), n, true);
+        p->random_position_around_circle_batch(circles, n, out, out_pos);
+        lua_pushinteger(L, (lua_Integer)n);
+        return 1;
+    }
+    thread_local std::vector<uint8_t> found;
+    thread_local std::vector<float> pos;
+    found.resize(n);
+    pos.resize(n * 3);
+    p->random_position_around_circle_batch(circles, n, found.data(), pos.data());
+    lua_pushlstring(L, (const char *)found.data(), n);
+    lua_pushlstring(L, (const char *)pos.data(), pos.size() * sizeof(float));
+    return 2;
+}
+
+static int flow_create(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto x = lua_check<float>(L, 2);
+    auto y = lua_check<float>(L, 3);
+    auto z = lua_check<float>(L, 4);
+    auto max_dist = (float)luaL_optnumber(L, 5, 0.0);
+    int id = p->flow_create(x, y, z, max_dist);
+    if (id > 0)
+    {
+        lua_pushinteger(L, id);
+        return 1;
+    }
+    return 0;
+}
+
+static int flow_move(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto id = lua_check<int>(L, 2);
+    auto x = lua_check<float>(L, 3);
+    auto y = lua_check<float>(L, 4);
+    auto z = lua_check<float>(L, 5);
+    auto repair = (float)luaL_optnumber(L, 6, 8.0);
+    lua_pushboolean(L, p->flow_move(id, x, y, z, repair));
+    return 1;
+}
+
+static int flow_next(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto id = lua_check<int>(L, 2);
+    auto x = lua_check<float>(L, 3);
+    auto y = lua_check<float>(L, 4);
+    auto z = lua_check<float>(L, 5);
+    float pos[3];
+    float dist = 0.0f;
+    if (p->flow_next(id, x, y, z, pos, dist))
+    {
+        lua_pushnumber(L, pos[0]);
+        lua_pushnumber(L, pos[1]);
+        lua_pushnumber(L, pos[2]);
+        lua_pushnumber(L, dist);
+        return 4;
+    }
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+static int flow_next_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto id = lua_check<int>(L, 2);
+    size_t n = 0;
+    int next = 0;
+    const float *points = lua_check_floats(L, 3, 3, n, next);
+
+    thread_local std::vector<uint8_t> found;
+    thread_local std::vector<float> out;
+    found.resize(n);
+    out.resize(n * 4);
+    p->flow_next_batch(id, points, n, found.data(), out.data());
+    lua_pushlstring(L, (const char *)found.data(), n);
+    lua_pushlstring(L, (const char *)out.data(), out.size() * sizeof(float));
+    return 2;
+}
+
+static int flow_destroy(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto id = lua_check<int>(L, 2);
+    lua_pushboolean(L, p->flow_destroy(id));
+    return 1;
+}
+
 static int add_capsule_obstacle(lua_State *L)
 {
     navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
@@ -205,6 +450,99 @@ static int add_capsule_obstacle(lua_State *L)
     return 0;
 }
 
+static int add_box_obstacle(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+
+    auto minx = lua_check<float>(L, 2);
+    auto miny = lua_check<float>(L, 3);
+    auto minz = lua_check<float>(L, 4);
+    auto maxx = lua_check<float>(L, 5);
+    auto maxy = lua_check<float>(L, 6);
+    auto maxz = lua_check<float>(L, 7);
+    auto obstacleId = p->add_box_obstacle(minx, miny, minz, maxx, maxy, maxz);
+    if (obstacleId > 0)
+    {
+        lua_pushinteger(L, obstacleId);
+        return 1;
+    }
+    return 0;
+}
+
+static int add_oriented_box_obstacle(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+
+    auto x = lua_check<float>(L, 2);
+    auto y = lua_check<float>(L, 3);
+    auto z = lua_check<float>(L, 4);
+    auto hx = lua_check<float>(L, 5);
+    auto hy = lua_check<float>(L, 6);
+    auto hz = lua_check<float>(L, 7);
+    auto yaw = lua_check<float>(L, 8);
+    auto obstacleId = p->add_oriented_box_obstacle(x, y, z, hx, hy, hz, yaw);
+    if (obstacleId > 0)
+    {
+        lua_pushinteger(L, obstacleId);
+        return 1;
+    }
+    return 0;
+}
+
+// Bulk adds return the ids as a packed uint32 string, 0 where an obstacle
+// could not be added; remove_obstacle_batch accepts that string back.
+template <size_t Stride, void (navmesh_type::*Add)(const float *, size_t, uint32_t *)>
+static int add_obstacle_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    size_t n = 0;
+    int next = 0;
+    const float *items = lua_check_floats(L, 2, Stride, n, next);
+
+    thread_local std::vector<uint32_t> ids;
+    ids.resize(n);
+    (p->*Add)(items, n, ids.data());
+    lua_pushlstring(L, (const char *)ids.data(), n * sizeof(uint32_t));
+    return 1;
+}
+
+static int remove_obstacle_batch(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+
+    thread_local std::vector<uint32_t> ids;
+    ids.clear();
+    if (lua_type(L, 2) == LUA_TSTRING)
+    {
+        size_t size;
+        const char *sz = lua_tolstring(L, 2, &size);
+        luaL_argcheck(L, size % sizeof(uint32_t) == 0, 2, "packed id array size mismatch");
+        ids.resize(size / sizeof(uint32_t));
+        memcpy(ids.data(), sz, size);
+    }
+    else
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_Integer n = luaL_len(L, 2);
+        for (lua_Integer i = 1; i <= n; ++i)
+        {
+            lua_rawgeti(L, 2, i);
+            ids.push_back(lua_check<uint32_t>(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pushinteger(L, (lua_Integer)p->remove_obstacle_batch(ids.data(), ids.size()));
+    return 1;
+}
+
 static int remove_obstacle(lua_State *L)
 {
     navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
@@ -232,7 +570,18 @@ static int update(lua_State *L)
     if (nullptr == p)
         return luaL_error(L, "Invalid navmesh pointer");
     auto dt = lua_check<float>(L, 2);
-    p->update(dt);
+    lua_pushinteger(L, p->update(dt));
+    return 1;
+}
+
+static int set_async_rebuild(lua_State *L)
+{
+    navmesh_type *p = (navmesh_type *)lua_touserdata(L, 1);
+    if (nullptr == p)
+        return luaL_error(L, "Invalid navmesh pointer");
+    auto enable = lua_check<bool>(L, 2);
+    int budget = (int)luaL_optinteger(L, 3, 4);
+    p->set_async_rebuild(enable, budget);
     return 0;
 }
 
@@ -257,14 +606,30 @@ static int lcreate(lua_State *L)
     {
         luaL_Reg l[] = {{"load_dynamic", load_dynamic},
                         {"find_straight_path", find_straight_path},
+                        {"find_hierarchical_path", find_hierarchical_path},
                         {"valid", valid},
                         {"random_position", random_position},
                         {"random_position_around_circle", random_position_around_circle},
                         {"recast", recast},
+                        {"valid_batch", valid_batch},
+                        {"recast_batch", recast_batch},
+                        {"random_position_around_circle_batch", random_position_around_circle_batch},
+                        {"flow_create", flow_create},
+                        {"flow_move", flow_move},
+                        {"flow_next", flow_next},
+                        {"flow_next_batch", flow_next_batch},
+                        {"flow_destroy", flow_destroy},
                         {"add_capsule_obstacle", add_capsule_obstacle},
+                        {"add_box_obstacle", add_box_obstacle},
+                        {"add_oriented_box_obstacle", add_oriented_box_obstacle},
+                        {"add_capsule_obstacle_batch", add_obstacle_batch<5, &navmesh_type::add_capsule_obstacle_batch>},
+                        {"add_box_obstacle_batch", add_obstacle_batch<6, &navmesh_type::add_box_obstacle_batch>},
+                        {"add_oriented_box_obstacle_batch", add_obstacle_batch<7, &navmesh_type::add_oriented_box_obstacle_batch>},
                         {"remove_obstacle", remove_obstacle},
+                        {"remove_obstacle_batch", remove_obstacle_batch},
                         {"clear_all_obstacle", clear_all_obstacle},
                         {"update", update},
+                        {"set_async_rebuild", set_async_rebuild},
                         {NULL, NULL}};
         luaL_newlib(L, l);              //{}
         lua_setfield(L, -2, "__index"); // mt[__index] = {}
@@ -280,7 +645,7 @@ extern "C"
 {
     int luaopen_navmesh(lua_State *L)
     {
-        luaL_Reg l[] = {{"new", lcreate}, {"load_static", load_static}, {NULL, NULL}};
+        luaL_Reg l[] = {{"new", lcreate}, {"load_static", load_static}, {"unload_static", unload_static}, {NULL, NULL}};
         luaL_newlib(L, l);
         return 1;
     }
@@ -1,13 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <DetourCommon.h>
 #include <DetourNavMesh.h>
@@ -16,6 +25,8 @@
 #include <DetourTileCache.h>
 #include <DetourTileCacheBuilder.h>
 #include "fastlz.h"
+#include "flow_field.hpp"
+#include "tile_graph.hpp"
 
 namespace pluto
 {
@@ -151,6 +162,10 @@ namespace pluto
 
     struct FastLZCompressor : public dtTileCacheCompressor
     {
+        // While set, decompress refuses, so dtTileCache::update() only does its
+        // obstacle bookkeeping and leaves the navmesh alone (see settle_obstacles).
+        bool defer = false;
+
         virtual int maxCompressedSize(const int bufferSize)
         {
             return (int)(bufferSize * 1.05f);
@@ -174,6 +189,8 @@ namespace pluto
             const int maxBufferSize,
             int *bufferSize)
         {
+            if (defer)
+                return DT_FAILURE;
             *bufferSize = fastlz_decompress(compressed, compressedSize, buffer, maxBufferSize);
             return *bufferSize < 0 ? DT_FAILURE : DT_SUCCESS;
         }
@@ -221,8 +238,236 @@ namespace pluto
         std::unique_ptr<dtQueryFilter> mFilter;
     };
 
+    // Rebuilds dirty tile-cache tiles on a process-wide pool of worker threads.
+    //
+    // A job carries copies of everything the build reads (compressed layer,
+    // cache params and the obstacles touching the tile), so workers never
+    // touch the dtTileCache or the dtNavMesh. Finished tile data is handed
+    // back through the submitter's sink and swapped into the dtNavMesh by the
+    // owning service in navmesh::update(), between two queries.
+    class tile_rebuilder
+    {
+    public:
+        struct result
+        {
+            dtCompressedTileRef ref = 0;
+            uint32_t version = 0;
+            int tx = 0;
+            int ty = 0;
+            int tlayer = 0;
+            bool ok = false;
+            unsigned char *data = nullptr; // nullptr with ok means the tile is now empty
+            int size = 0;
+        };
+
+        // Results of one tile cache. Shared with the jobs in flight, so the
+        // navmesh can be reloaded or destroyed without waiting for them.
+        class sink
+        {
+        public:
+            ~sink()
+            {
+                for (auto &r : done_)
+                    dtFree(r.data);
+            }
+
+            void push(result &&r)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.push_back(std::move(r));
+            }
+
+            void pop_all(std::vector<result> &out)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                out.insert(out.end(), done_.begin(), done_.end());
+                done_.clear();
+            }
+
+        private:
+            std::mutex mutex_;
+            std::vector<result> done_;
+        };
+
+        struct job
+        {
+            std::shared_ptr<sink> target;
+            dtCompressedTileRef ref = 0;
+            uint32_t version = 0;
+            dtTileCacheParams params;
+            std::vector<unsigned char> data;
+            std::vector<dtTileCacheObstacle> obstacles;
+        };
+
+        tile_rebuilder() = default;
+
+        tile_rebuilder(const tile_rebuilder &) = delete;
+        tile_rebuilder &operator=(const tile_rebuilder &) = delete;
+
+        ~tile_rebuilder()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            for (auto &t : threads_)
+                t.join();
+        }
+
+        void submit(job &&j)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (threads_.empty())
+                {
+                    // started on first use so services without async rebuild pay nothing
+                    unsigned int n = std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+                    for (unsigned int i = 0; i < n; ++i)
+                        threads_.emplace_back([this]
+                                              { run(); });
+                }
+                jobs_.push_back(std::move(j));
+            }
+            cond_.notify_one();
+        }
+
+        // Same steps as dtTileCache::buildNavMeshTile, minus the navmesh update.
+        static result build(job &j)
+        {
+            thread_local LinearAllocator talloc(32 * 1024);
+            thread_local FastLZCompressor tcomp;
+            thread_local MeshProcess tmproc;
+
+            result res;
+            res.ref = j.ref;
+            res.version = j.version;
+
+            dtTileCacheLayerHeader header;
+            if (j.data.size() < sizeof(header))
+                return res;
+            memcpy(&header, j.data.data(), sizeof(header));
+            res.tx = header.tx;
+            res.ty = header.ty;
+            res.tlayer = header.tlayer;
+
+            talloc.reset();
+
+            struct build_context
+            {
+                dtTileCacheAlloc *alloc;
+                dtTileCacheLayer *layer = nullptr;
+                dtTileCacheContourSet *lcset = nullptr;
+                dtTileCachePolyMesh *lmesh = nullptr;
+
+                ~build_context()
+                {
+                    dtFreeTileCacheLayer(alloc, layer);
+                    dtFreeTileCacheContourSet(alloc, lcset);
+                    dtFreeTileCachePolyMesh(alloc, lmesh);
+                }
+            } bc{&talloc};
+
+            const dtTileCacheParams &p = j.params;
+            const int walkableClimbVx = (int)(p.walkableClimb / p.ch);
+
+            dtStatus status = dtDecompressTileCacheLayer(&talloc, &tcomp, j.data.data(), (int)j.data.size(), &bc.layer);
+            if (dtStatusFailed(status))
+                return res;
+
+            for (const auto &ob : j.obstacles)
+            {
+                if (ob.type == DT_OBSTACLE_CYLINDER)
+                    dtMarkCylinderArea(*bc.layer, header.bmin, p.cs, p.ch, ob.cylinder.pos, ob.cylinder.radius, ob.cylinder.height, 0);
+                else if (ob.type == DT_OBSTACLE_BOX)
+                    dtMarkBoxArea(*bc.layer, header.bmin, p.cs, p.ch, ob.box.bmin, ob.box.bmax, 0);
+                else if (ob.type == DT_OBSTACLE_ORIENTED_BOX)
+                    dtMarkBoxArea(*bc.layer, header.bmin, p.cs, p.ch, ob.orientedBox.center, ob.orientedBox.halfExtents, ob.orientedBox.rotAux, 0);
+            }
+
+            status = dtBuildTileCacheRegions(&talloc, *bc.layer, walkableClimbVx);
+            if (dtStatusFailed(status))
+                return res;
+
+            bc.lcset = dtAllocTileCacheContourSet(&talloc);
+            if (!bc.lcset)
+                return res;
+            status = dtBuildTileCacheContours(&talloc, *bc.layer, walkableClimbVx, p.maxSimplificationError, *bc.lcset);
+            if (dtStatusFailed(status))
+                return res;
+
+            bc.lmesh = dtAllocTileCachePolyMesh(&talloc);
+            if (!bc.lmesh)
+                return res;
+            status = dtBuildTileCachePolyMesh(&talloc, *bc.lcset, *bc.lmesh);
+            if (dtStatusFailed(status))
+                return res;
+
+            res.ok = true;
+            if (!bc.lmesh->npolys)
+                return res;
+
+            dtNavMeshCreateParams params;
+            memset(&params, 0, sizeof(params));
+            params.verts = bc.lmesh->verts;
+            params.vertCount = bc.lmesh->nverts;
+            params.polys = bc.lmesh->polys;
+            params.polyAreas = bc.lmesh->areas;
+            params.polyFlags = bc.lmesh->flags;
+            params.polyCount = bc.lmesh->npolys;
+            params.nvp = DT_VERTS_PER_POLYGON;
+            params.walkableHeight = p.walkableHeight;
+            params.walkableRadius = p.walkableRadius;
+            params.walkableClimb = p.walkableClimb;
+            params.tileX = header.tx;
+            params.tileY = header.ty;
+            params.tileLayer = header.tlayer;
+            params.cs = p.cs;
+            params.ch = p.ch;
+            params.buildBvTree = false;
+            dtVcopy(params.bmin, header.bmin);
+            dtVcopy(params.bmax, header.bmax);
+
+            tmproc.process(&params, bc.lmesh->areas, bc.lmesh->flags);
+
+            if (!dtCreateNavMeshData(&params, &res.data, &res.size))
+                res.ok = false;
+            return res;
+        }
+
+    private:
+        void run()
+        {
+            for (;;)
+            {
+                job j;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cond_.wait(lock, [this]
+                               { return stop_ || !jobs_.empty(); });
+                    if (stop_)
+                        return;
+                    j = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+                auto target = std::move(j.target);
+                target->push(build(j));
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<job> jobs_;
+        std::vector<std::thread> threads_;
+        bool stop_ = false;
+    };
+
+    class navmesh_builder;
+
     class navmesh
     {
+        friend class navmesh_builder;
+
     private:
         static constexpr int NAVMESHSET_MAGIC = 'M' << 24 | 'S' << 16 | 'E' << 8 | 'T'; //'MSET';
         static constexpr int NAVMESHSET_VERSION = 1;
@@ -283,6 +528,7 @@ namespace pluto
             std::unique_ptr<LinearAllocator> talloc;
             std::unique_ptr<FastLZCompressor> tcomp;
             std::unique_ptr<MeshProcess> tmproc;
+            std::unique_ptr<tile_graph> graph;
 
             navmesh_context() = default;
 
@@ -291,6 +537,57 @@ namespace pluto
             navmesh_context &operator=(navmesh_context &&other) = default;
         };
 
+        using static_mesh_ptr = std::shared_ptr<const navmesh_context>;
+
+        // Process-wide table of static meshes shared by every navmesh instance.
+        // Readers take a shared lock only to copy a handle; the mesh itself is
+        // kept alive by the handles, so unload and hot-swap never free a mesh
+        // that an instance is still querying.
+        class static_mesh_registry
+        {
+        public:
+            static_mesh_registry() : generation_(0) {}
+
+            void publish(const std::string &meshfile, static_mesh_ptr mesh)
+            {
+                {
+                    std::unique_lock<std::shared_mutex> lock(mutex_);
+                    meshes_[meshfile] = std::move(mesh);
+                }
+                generation_.fetch_add(1, std::memory_order_release);
+            }
+
+            bool remove(const std::string &meshfile)
+            {
+                size_t n = 0;
+                {
+                    std::unique_lock<std::shared_mutex> lock(mutex_);
+                    n = meshes_.erase(meshfile);
+                }
+                if (n > 0)
+                    generation_.fetch_add(1, std::memory_order_release);
+                return n > 0;
+            }
+
+            static_mesh_ptr find(const std::string &meshfile) const
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                if (auto iter = meshes_.find(meshfile); iter != meshes_.end())
+                    return iter->second;
+                return nullptr;
+            }
+
+            uint64_t generation() const
+            {
+                return generation_.load(std::memory_order_acquire);
+            }
+
+        private:
+            mutable std::shared_mutex mutex_;
+            std::unordered_map<std::string, static_mesh_ptr> meshes_;
+            std::atomic<uint64_t> generation_;
+        };
+
         static std::string read_all(const std::string &path, std::ios::openmode Mode)
         {
             std::fstream is(path, Mode);
@@ -327,6 +624,166 @@ namespace pluto
                 p[2] = -p[2];
         }
 
+        // Rebind to the latest published version of the static mesh. The
+        // generation check is a single atomic load, so it is cheap enough to
+        // run before every query.
+        void sync_static()
+        {
+            if (static_name_.empty())
+                return;
+
+            uint64_t generation = static_mesh_.generation();
+            if (generation == static_generation_)
+                return;
+
+            // Nothing to rebind to: a later publish bumps the generation again.
+            auto mesh = static_mesh_.find(static_name_);
+            if (nullptr == mesh || mesh == static_ref_)
+            {
+                static_generation_ = generation;
+                return;
+            }
+
+            auto query = std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter>(dtAllocNavMeshQuery());
+            if (nullptr == query)
+                return;
+
+            dtStatus status = query->init(mesh->mesh.get(), 65535);
+            if (dtStatusFailed(status))
+                return;
+
+            // Only now is the generation seen; a failed rebind retries on the
+            // next query instead of keeping the stale mesh for good.
+            meshQuery = std::move(query);
+            static_ref_ = std::move(mesh);
+            static_generation_ = generation;
+            ++mesh_version_;
+        }
+
+        // Flow fields index the polygons of the mesh they were built on, so
+        // rebuild one after a reload or tile rebuild before reading it.
+        flow_field *sync_flow(int id)
+        {
+            sync_static();
+            auto iter = flows_.find(id);
+            if (iter == flows_.end() || !meshQuery)
+                return nullptr;
+
+            flow_entry &e = iter->second;
+            if (e.version != mesh_version_)
+            {
+                e.version = mesh_version_;
+                float pos[3];
+                dtVcopy(pos, e.field.target_pos());
+                dtPolyRef ref = nearest_poly(pos);
+                if (!ref || !e.field.build(meshQuery->getAttachedNavMesh(), &queryFilter, ref, pos, e.max_dist))
+                    return nullptr;
+            }
+            return &e.field;
+        }
+
+        dtPolyRef nearest_poly(float *pos)
+        {
+            const float extents[3] = {2.0f, 4.f, 2.0f};
+            dtPolyRef ref = 0;
+            float nearest[3];
+            dtStatus status = meshQuery->findNearestPoly(pos, extents, &queryFilter, &ref, nearest);
+            if (!dtStatusSucceed(status) || !ref)
+                return 0;
+            dtVcopy(pos, nearest);
+            return ref;
+        }
+
+        // Polygon A* from startRef to endRef, appending the straight path to paths.
+        bool find_path(
+            dtPolyRef startRef,
+            dtPolyRef endRef,
+            const float *spos,
+            const float *epos,
+            std::vector<float> &paths)
+        {
+            static thread_local std::array<dtPolyRef, MAX_POLYS> mPolys;
+            static thread_local std::array<float, MAX_POLYS * 3> mStraightPath;
+            static thread_local std::array<uint8_t, MAX_POLYS> mStraightPathFlags;
+            static thread_local std::array<dtPolyRef, MAX_POLYS> mStraightPathPolys;
+
+            int nPolys = 0;
+            int nStraightPath = 0;
+
+            dtStatus status = meshQuery->findPath(
+                startRef,
+                endRef,
+                spos,
+                epos,
+                &queryFilter,
+                mPolys.data(),
+                &nPolys,
+                MAX_POLYS);
+            if (!dtStatusSucceed(status))
+            {
+                return false;
+            }
+
+            if (status & DT_OUT_OF_NODES)
+            {
+                status_ = "find_straight_path findPath: DT_OUT_OF_NODES!";
+                return false;
+            }
+
+            // if (status & DT_PARTIAL_RESULT)
+            //{
+            //     //This happens when the A* open list is exhausted, and the goal has not been reached.
+            //     //In these situations it returns the best path it can findand sets this flag to indicate that the path is not complete.
+            //     return false;
+            // }
+
+            if (nPolys)
+            {
+                float tmp[3];
+                dtVcopy(tmp, epos);
+
+                if (mPolys[(size_t)nPolys - 1] != endRef)
+                {
+                    // In case of partial path, make sure the end point is clamped to the last polygon.
+                    status = meshQuery->closestPointOnPoly(mPolys[(size_t)nPolys - 1], epos, tmp, 0);
+                    if (!dtStatusSucceed(status))
+                    {
+                        return false;
+                    }
+                }
+
+                status = meshQuery->findStraightPath(
+                    spos,
+                    epos,
+                    mPolys.data(),
+                    nPolys,
+                    mStraightPath.data(),
+                    mStraightPathFlags.data(),
+                    mStraightPathPolys.data(),
+                    &nStraightPath,
+                    MAX_POLYS);
+                if (!dtStatusSucceed(status))
+                {
+                    return false;
+                }
+
+                if (status & DT_BUFFER_TOO_SMALL)
+                {
+                    return false;
+                }
+
+                for (int i = 0; i < nStraightPath * 3;)
+                {
+                    paths.push_back(mStraightPath[i++]);
+                    paths.push_back(mStraightPath[i++]);
+                    paths.push_back(mStraightPath[i++]);
+                    coord_transform(paths.data() + (paths.size() - 3));
+                }
+                return true;
+            }
+            return false;
+        }
+
     public:
         enum coord_transform_mask
         {
@@ -427,12 +884,21 @@ namespace pluto
                 return false;
             }
 
-            navmesh_context ctx;
-            ctx.mesh = std::move(mesh);
-            static_mesh_.emplace(meshfile, std::move(ctx));
+            auto ctx = std::make_shared<navmesh_context>();
+            ctx->mesh = std::move(mesh);
+            ctx->graph = std::make_unique<tile_graph>();
+            ctx->graph->build(ctx->mesh.get());
+            static_mesh_.publish(meshfile, std::move(ctx));
             return true;
         }
 
+        // Instances keep using the mesh they hold until their next query, and
+        // the memory is released once the last of them lets go.
+        static bool unload_static(const std::string &meshfile)
+        {
+            return static_mesh_.remove(meshfile);
+        }
+
         bool load_dynamic(const std::string &meshfile, std::string &err)
         {
             auto content = read_all(meshfile, std::ios::binary | std::ios::in);
@@ -562,6 +1028,15 @@ namespace pluto
             meshQuery->init(ctx.mesh.get(), 65535);
 
             dynamic_ = std::move(ctx);
+            static_name_.clear();
+            static_ref_ = nullptr;
+
+            // rebuilds in flight belong to the old tile cache
+            dirty_tiles_.clear();
+            rebuild_versions_.clear();
+            if (rebuild_sink_)
+                rebuild_sink_ = std::make_shared<tile_rebuilder::sink>();
+            ++mesh_version_;
             return true;
         }
 
@@ -570,19 +1045,8 @@ namespace pluto
             if (meshfile.empty())
                 return;
 
-            if (auto iter = static_mesh_.find(meshfile); iter != static_mesh_.end())
-            {
-                meshQuery =
-                    std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter>(dtAllocNavMeshQuery());
-                if (nullptr != meshQuery)
-                {
-                    dtStatus status = meshQuery->init(iter->second.mesh.get(), 65535);
-                    if (dtStatusFailed(status))
-                    {
-                        meshQuery = nullptr;
-                    }
-                }
-            }
+            static_name_ = meshfile;
+            sync_static();
         }
 
         bool find_straight_path(
@@ -595,9 +1059,8 @@ namespace pluto
             std::vector<float> &paths)
         {
             static thread_local std::array<dtPolyRef, MAX_POLYS> mPolys;
-            static thread_local std::array<float, MAX_POLYS * 3> mStraightPath;
-            static thread_local std::array<uint8_t, MAX_POLYS> mStraightPathFlags;
-            static thread_local std::array<dtPolyRef, MAX_POLYS> mStraightPathPolys;
+
+            sync_static();
 
             if (!meshQuery)
             {
@@ -648,7 +1111,6 @@ namespace pluto
             }
 
             int nPolys = 0;
-            int nStraightPath = 0;
 
             if (dtVdist2DSqr(spos, epos) < 10000.0f)
             {
@@ -673,86 +1135,91 @@ namespace pluto
                     paths.push_back(ez);
                     return true;
                 }
-                nPolys = 0;
-                nStraightPath = 0;
             }
 
-            status = meshQuery->findPath(
-                startRef,
-                endRef,
-                spos,
-                epos,
-                &queryFilter,
-                mPolys.data(),
-                &nPolys,
-                MAX_POLYS);
-            if (!dtStatusSucceed(status))
-            {
-                return false;
-            }
+            return find_path(startRef, endRef, spos, epos, paths);
+        }
 
-            if (status & DT_OUT_OF_NODES)
+        // Long distance path over the tile graph of a static mesh. Only the
+        // first `lookahead` portals of the abstract route are refined, and
+        // `complete` is false when the returned path stops at the last of
+        // them, so the caller queries again once it gets there.
+        bool find_hierarchical_path(
+            float sx,
+            float sy,
+            float sz,
+            float ex,
+            float ey,
+            float ez,
+            int lookahead,
+            std::vector<float> &paths,
+            bool &complete)
+        {
+            thread_local std::vector<tile_graph::step> route;
+
+            sync_static();
+
+            complete = true;
+            const tile_graph *graph = static_ref_ ? static_ref_->graph.get() : nullptr;
+            if (!meshQuery || nullptr == graph || lookahead <= 0)
             {
-                status_ = "find_straight_path findPath: DT_OUT_OF_NODES!";
-                return false;
+                return find_straight_path(sx, sy, sz, ex, ey, ez, paths);
             }
 
-            // if (status & DT_PARTIAL_RESULT)
-            //{
-            //     //This happens when the A* open list is exhausted, and the goal has not been reached.
-            //     //In these situations it returns the best path it can findand sets this flag to indicate that the path is not complete.
-            //     return false;
-            // }
+            status_.clear();
 
-            if (nPolys)
-            {
-                float tmp[3];
-                dtVcopy(tmp, epos);
+            float spos[3] = {sx, sy, sz};
+            float epos[3] = {ex, ey, ez};
 
-                if (mPolys[(size_t)nPolys - 1] != endRef)
-                {
-                    // In case of partial path, make sure the end point is clamped to the last polygon.
-                    status = meshQuery->closestPointOnPoly(mPolys[(size_t)nPolys - 1], epos, tmp, 0);
-                    if (!dtStatusSucceed(status))
-                    {
-                        return false;
-                    }
-                }
+            coord_transform(spos);
+            coord_transform(epos);
 
-                status = meshQuery->findStraightPath(
-                    spos,
-                    epos,
-                    mPolys.data(),
-                    nPolys,
-                    mStraightPath.data(),
-                    mStraightPathFlags.data(),
-                    mStraightPathPolys.data(),
-                    &nStraightPath,
-                    MAX_POLYS);
-                if (!dtStatusSucceed(status))
-                {
-                    return false;
-                }
+            const float extents[3] = {8.0f, 4.f, 8.0f};
 
-                if (status & DT_BUFFER_TOO_SMALL)
-                {
-                    return false;
-                }
+            dtPolyRef startRef = 0;
+            dtPolyRef endRef = 0;
+            meshQuery->findNearestPoly(spos, extents, &queryFilter, &startRef, nullptr);
+            meshQuery->findNearestPoly(epos, extents, &queryFilter, &endRef, nullptr);
+
+            // Short routes, disconnected regions and unresolved end points go
+            // through the regular path finding.
+            const dtNavMesh *mesh = meshQuery->getAttachedNavMesh();
+            if (!startRef || !endRef
+                || !graph->search(
+                    queryFilter, graph->region_of(mesh, startRef), spos, graph->region_of(mesh, endRef), epos, route))
+            {
+                return find_straight_path(sx, sy, sz, ex, ey, ez, paths);
+            }
 
-                for (int i = 0; i < nStraightPath * 3;)
-                {
-                    paths.push_back(mStraightPath[i++]);
-                    paths.push_back(mStraightPath[i++]);
-                    paths.push_back(mStraightPath[i++]);
-                    coord_transform(paths.data() + (paths.size() - 3));
-                }
-                return true;
+            // Stop on a portal into regular polygons, never midway through an
+            // off-mesh connection.
+            auto off_mesh = [mesh](dtPolyRef ref)
+            {
+                const dtMeshTile *tile = nullptr;
+                const dtPoly *poly = nullptr;
+                mesh->getTileAndPolyByRefUnsafe(ref, &tile, &poly);
+                return poly->getType() == DT_POLYTYPE_OFFMESH_CONNECTION;
+            };
+            size_t k = (size_t)lookahead - 1;
+            while (k < route.size() && off_mesh(graph->get_portal(route[k].portal).poly[route[k].side]))
+            {
+                ++k;
             }
-            return false;
+            if (k + 1 >= route.size())
+            {
+                return find_straight_path(sx, sy, sz, ex, ey, ez, paths);
+            }
+
+            const tile_graph::step &next = route[k];
+            const tile_graph::portal &portal = graph->get_portal(next.portal);
+            complete = false;
+            return find_path(startRef, portal.poly[next.side], spos, portal.pos, paths);
         }
 
-        bool valid(float x, float y, float z) const
+        bool valid(float x, float y, float z)
         {
+            sync_static();
+
             if (!meshQuery)
                 return false;
 
@@ -781,6 +1248,8 @@ namespace pluto
 
         bool random_position(float *out)
         {
+            sync_static();
+
             if (!meshQuery)
                 return false;
 
@@ -802,6 +1271,8 @@ namespace pluto
 
         bool random_position_around_circle(float x, float y, float z, float r, float *out)
         {
+            sync_static();
+
             if (!meshQuery)
                 return false;
 
@@ -847,10 +1318,12 @@ namespace pluto
             return true;
         }
 
-        bool recast(float sx, float sy, float sz, float ex, float ey, float ez, float *hitPos) const
+        bool recast(float sx, float sy, float sz, float ex, float ey, float ez, float *hitPos)
         {
             thread_local static dtPolyRef polys[MAX_POLYS];
 
+            sync_static();
+
             if (!meshQuery)
             {
                 return false;
@@ -907,6 +1380,49 @@ namespace pluto
             return hit;
         }
 
+        // Batch variants read packed float arrays and write one result per
+        // element, so callers can validate many points in a single call.
+        // points: n * {x, y, z}, valid: n bytes
+        void valid_batch(const float *points, size_t n, uint8_t *valid)
+        {
+            for (size_t i = 0; i < n; ++i, points += 3)
+            {
+                valid[i] = this->valid(points[0], points[1], points[2]) ? 1 : 0;
+            }
+        }
+
+        // segments: n * {sx, sy, sz, ex, ey, ez}, hit: n bytes, hitPos: n * {x, y, z}
+        void recast_batch(const float *segments, size_t n, uint8_t *hit, float *hitPos)
+        {
+            for (size_t i = 0; i < n; ++i, segments += 6, hitPos += 3)
+            {
+                const float *seg = segments;
+                hit[i] = recast(seg[0], seg[1], seg[2], seg[3], seg[4], seg[5], hitPos) ? 1 : 0;
+            }
+        }
+
+        // circles: n * {x, y, z, r}, found: n bytes, out: n * {x, y, z}
+        void random_position_around_circle_batch(
+            const float *circles,
+            size_t n,
+            uint8_t *found,
+            float *out)
+        {
+            for (size_t i = 0; i < n; ++i, circles += 4, out += 3)
+            {
+                const float *c = circles;
+                if (random_position_around_circle(c[0], c[1], c[2], c[3], out))
+                {
+                    found[i] = 1;
+                }
+                else
+                {
+                    found[i] = 0;
+                    out[0] = out[1] = out[2] = 0.0f;
+                }
+            }
+        }
+
         unsigned int add_capsule_obstacle(float x, float y, float z, float radius, float height)
         {
             if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
@@ -914,22 +1430,94 @@ namespace pluto
 
             float pos[3] = {x, y, z};
             coord_transform(pos);
+            return add_obstacle([&](dtObstacleRef *ref)
+                                { return dynamic_.tilecache->addObstacle(pos, radius, height, ref); });
+        }
 
-            dtObstacleRef obstacleId;
-            dtStatus status = dynamic_.tilecache->addObstacle(pos, radius, height, &obstacleId);
-            if (!dtStatusSucceed(status))
-            {
+        unsigned int add_box_obstacle(float minx, float miny, float minz, float maxx, float maxy, float maxz)
+        {
+            if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
                 return 0;
-            }
-            return (unsigned int)obstacleId;
+
+            float a[3] = {minx, miny, minz};
+            float b[3] = {maxx, maxy, maxz};
+            coord_transform(a);
+            coord_transform(b);
+            float bmin[3], bmax[3];
+            dtVcopy(bmin, a);
+            dtVmin(bmin, b);
+            dtVcopy(bmax, a);
+            dtVmax(bmax, b);
+            return add_obstacle([&](dtObstacleRef *ref)
+                                { return dynamic_.tilecache->addBoxObstacle(bmin, bmax, ref); });
+        }
+
+        // Box of half extents (hx, hy, hz) around (x, y, z), rotated by yaw radians around the y axis.
+        unsigned int add_oriented_box_obstacle(float x, float y, float z, float hx, float hy, float hz, float yaw)
+        {
+            if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
+                return 0;
+
+            float center[3] = {x, y, z};
+            float extents[3] = {hx, hy, hz};
+            coord_transform(center);
+            // mirroring one horizontal axis turns the rotation the other way
+            if (((coord_mask_ & negative_x_axis) != 0) != ((coord_mask_ & negative_z_axis) != 0))
+                yaw = -yaw;
+            return add_obstacle([&](dtObstacleRef *ref)
+                                { return dynamic_.tilecache->addBoxObstacle(center, extents, yaw, ref); });
         }
 
         bool remove_obstacle(unsigned int obstacleId)
         {
             if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
                 return false;
-            dtStatus status = dynamic_.tilecache->removeObstacle((dtObstacleRef)obstacleId);
-            return dtStatusSucceed(status);
+            return remove_obstacle_ref((dtObstacleRef)obstacleId);
+        }
+
+        // Bulk variants take packed arrays and write one id per element (0 on
+        // failure). Tiles touched by several obstacles are rebuilt once.
+        // capsules: n * {x, y, z, radius, height}
+        void add_capsule_obstacle_batch(const float *capsules, size_t n, uint32_t *ids)
+        {
+            for (size_t i = 0; i < n; ++i, capsules += 5)
+            {
+                const float *c = capsules;
+                ids[i] = add_capsule_obstacle(c[0], c[1], c[2], c[3], c[4]);
+            }
+        }
+
+        // boxes: n * {minx, miny, minz, maxx, maxy, maxz}
+        void add_box_obstacle_batch(const float *boxes, size_t n, uint32_t *ids)
+        {
+            for (size_t i = 0; i < n; ++i, boxes += 6)
+            {
+                const float *b = boxes;
+                ids[i] = add_box_obstacle(b[0], b[1], b[2], b[3], b[4], b[5]);
+            }
+        }
+
+        // boxes: n * {x, y, z, hx, hy, hz, yaw}
+        void add_oriented_box_obstacle_batch(const float *boxes, size_t n, uint32_t *ids)
+        {
+            for (size_t i = 0; i < n; ++i, boxes += 7)
+            {
+                const float *b = boxes;
+                ids[i] = add_oriented_box_obstacle(b[0], b[1], b[2], b[3], b[4], b[5], b[6]);
+            }
+        }
+
+        size_t remove_obstacle_batch(const uint32_t *ids, size_t n)
+        {
+            if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
+                return 0;
+            size_t removed = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (ids[i] != 0 && remove_obstacle_ref((dtObstacleRef)ids[i]))
+                    ++removed;
+            }
+            return removed;
         }
 
         void clear_all_obstacle()
@@ -942,15 +1530,165 @@ namespace pluto
                 const dtTileCacheObstacle *ob = dynamic_.tilecache->getObstacle(i);
                 if (ob->state == DT_OBSTACLE_EMPTY)
                     continue;
-                dynamic_.tilecache->removeObstacle(dynamic_.tilecache->getObstacleRef(ob));
+                remove_obstacle_ref(dynamic_.tilecache->getObstacleRef(ob));
             }
         }
 
-        void update(float dt)
+        // Move tile rebuilds off the calling service. `budget` caps the tiles
+        // swapped into the navmesh (or rebuilt inline, when disabled) per
+        // update(); the rest wait for the next tick. Turning it off hands the
+        // outstanding tiles back to the inline rebuild.
+        void set_async_rebuild(bool enable, int budget)
         {
-            if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
+            rebuild_budget_ = budget > 0 ? budget : 1;
+            if (enable)
+            {
+                if (!rebuild_sink_)
+                    rebuild_sink_ = std::make_shared<tile_rebuilder::sink>();
                 return;
-            dynamic_.tilecache->update(dt, dynamic_.mesh.get());
+            }
+
+            if (!rebuild_sink_)
+                return;
+            rebuild_sink_ = nullptr;
+            for (auto &[ref, version] : rebuild_versions_)
+                dirty_tiles_.insert(ref);
+            rebuild_versions_.clear();
+        }
+
+        // Returns the number of tiles still waiting to be rebuilt.
+        int update(float dt)
+        {
+            if (nullptr == dynamic_.mesh || nullptr == dynamic_.tilecache)
+                return 0;
+
+            settle_obstacles(dt);
+
+            dtNavMesh *mesh = dynamic_.mesh.get();
+            if (!rebuild_sink_)
+            {
+                int built = 0;
+                for (auto iter = dirty_tiles_.begin(); iter != dirty_tiles_.end() && built < rebuild_budget_; ++built)
+                {
+                    dynamic_.tilecache->buildNavMeshTile(*iter, mesh);
+                    iter = dirty_tiles_.erase(iter);
+                }
+                if (built > 0)
+                    ++mesh_version_;
+                return (int)dirty_tiles_.size();
+            }
+
+            for (auto ref : dirty_tiles_)
+                submit_rebuild(ref);
+            dirty_tiles_.clear();
+
+            // Safe point: queries run on this thread, so each swap is seen whole.
+            thread_local std::vector<tile_rebuilder::result> done;
+            rebuild_sink_->pop_all(done);
+            int committed = 0;
+            size_t i = 0;
+            for (; i < done.size() && committed < rebuild_budget_; ++i)
+            {
+                auto &r = done[i];
+                auto iter = rebuild_versions_.find(r.ref);
+                if (iter == rebuild_versions_.end() || iter->second != r.version || !r.ok)
+                {
+                    // superseded by a newer rebuild, or failed: keep the current tile
+                    if (iter != rebuild_versions_.end() && iter->second == r.version)
+                        rebuild_versions_.erase(iter);
+                    dtFree(r.data);
+                    continue;
+                }
+                rebuild_versions_.erase(iter);
+
+                mesh->removeTile(mesh->getTileRefAt(r.tx, r.ty, r.tlayer), 0, 0);
+                if (r.data && dtStatusFailed(mesh->addTile(r.data, r.size, DT_TILE_FREE_DATA, 0, 0)))
+                    dtFree(r.data);
+                ++committed;
+            }
+            // over budget: hand the rest back for the next tick
+            for (; i < done.size(); ++i)
+                rebuild_sink_->push(std::move(done[i]));
+            done.clear();
+            if (committed > 0)
+                ++mesh_version_;
+            return (int)rebuild_versions_.size();
+        }
+
+        // Flow fields: one distance field per target, shared by every agent
+        // chasing it. Polygons further than max_dist (0: no limit) from the
+        // target are left out. Returns the field id, 0 on failure.
+        int flow_create(float x, float y, float z, float max_dist)
+        {
+            sync_static();
+            if (!meshQuery)
+                return 0;
+
+            float pos[3] = {x, y, z};
+            coord_transform(pos);
+            dtPolyRef ref = nearest_poly(pos);
+            if (!ref)
+                return 0;
+
+            flow_entry e;
+            e.version = mesh_version_;
+            e.max_dist = max_dist;
+            if (!e.field.build(meshQuery->getAttachedNavMesh(), &queryFilter, ref, pos, max_dist))
+                return 0;
+
+            if (++flow_id_ <= 0)
+                flow_id_ = 1;
+            flows_[flow_id_] = std::move(e);
+            return flow_id_;
+        }
+
+        // Move the target of a field; small moves only repair the area
+        // around the target (see flow_field::move).
+        bool flow_move(int id, float x, float y, float z, float repair)
+        {
+            flow_field *field = sync_flow(id);
+            if (nullptr == field)
+                return false;
+
+            float pos[3] = {x, y, z};
+            coord_transform(pos);
+            dtPolyRef ref = nearest_poly(pos);
+            if (!ref)
+                return false;
+            return field->move(ref, pos, repair);
+        }
+
+        // Next waypoint from (x, y, z) towards the target of the field, and
+        // the remaining distance along the field.
+        bool flow_next(int id, float x, float y, float z, float *waypoint, float &dist)
+        {
+            flow_field *field = sync_flow(id);
+            if (nullptr == field)
+                return false;
+            return next_waypoint(*field, x, y, z, waypoint, dist);
+        }
+
+        // points: n * {x, y, z}, found: n bytes, out: n * {x, y, z, dist}
+        void flow_next_batch(int id, const float *points, size_t n, uint8_t *found, float *out)
+        {
+            flow_field *field = sync_flow(id);
+            for (size_t i = 0; i < n; ++i, points += 3, out += 4)
+            {
+                if (field && next_waypoint(*field, points[0], points[1], points[2], out, out[3]))
+                {
+                    found[i] = 1;
+                }
+                else
+                {
+                    found[i] = 0;
+                    out[0] = out[1] = out[2] = out[3] = 0.0f;
+                }
+            }
+        }
+
+        bool flow_destroy(int id)
+        {
+            return flows_.erase(id) > 0;
         }
 
         const std::string &get_status() const
@@ -959,10 +1697,122 @@ namespace pluto
         }
 
     private:
-        inline static std::unordered_map<std::string, navmesh_context> static_mesh_;
+        struct flow_entry
+        {
+            flow_field field;
+            uint64_t version = 0;
+            float max_dist = 0.0f;
+        };
+
+        bool next_waypoint(const flow_field &field, float x, float y, float z, float *waypoint, float &dist)
+        {
+            float pos[3] = {x, y, z};
+            coord_transform(pos);
+            dtPolyRef ref = nearest_poly(pos);
+            if (!ref || !field.next(ref, pos, waypoint, &dist))
+                return false;
+            coord_transform(waypoint);
+            return true;
+        }
+
+        // Obstacle edits only queue requests in the tile cache. Settling them
+        // runs dtTileCache::update with the compressor deferred, which updates
+        // obstacle states without building tiles; the tiles an edit touches
+        // are collected in dirty_tiles_ instead, so a tile shared by many
+        // obstacles is rebuilt once and the cache's 64 entry queues never drop one.
+        void settle_obstacles(float dt)
+        {
+            bool upToDate = false;
+            dynamic_.tcomp->defer = true;
+            while (!upToDate)
+                dynamic_.tilecache->update(dt, dynamic_.mesh.get(), &upToDate);
+            dynamic_.tcomp->defer = false;
+        }
+
+        template <typename F>
+        unsigned int add_obstacle(F &&add)
+        {
+            dtObstacleRef ref = 0;
+            dtStatus status = add(&ref);
+            if (dtStatusDetail(status, DT_BUFFER_TOO_SMALL))
+            {
+                // request queue full
+                settle_obstacles(0.0f);
+                status = add(&ref);
+            }
+            if (!dtStatusSucceed(status))
+                return 0;
+            mark_dirty(ref);
+            return (unsigned int)ref;
+        }
+
+        bool remove_obstacle_ref(dtObstacleRef ref)
+        {
+            mark_dirty(ref);
+            dtStatus status = dynamic_.tilecache->removeObstacle(ref);
+            if (dtStatusDetail(status, DT_BUFFER_TOO_SMALL))
+            {
+                settle_obstacles(0.0f);
+                status = dynamic_.tilecache->removeObstacle(ref);
+            }
+            return dtStatusSucceed(status);
+        }
+
+        void mark_dirty(dtObstacleRef ref)
+        {
+            const dtTileCacheObstacle *ob = dynamic_.tilecache->getObstacleByRef(ref);
+            if (nullptr == ob)
+                return;
+
+            float bmin[3], bmax[3];
+            dynamic_.tilecache->getObstacleBounds(ob, bmin, bmax);
+            dtCompressedTileRef touched[DT_MAX_TOUCHED_TILES];
+            int ntouched = 0;
+            dynamic_.tilecache->queryTiles(bmin, bmax, touched, &ntouched, DT_MAX_TOUCHED_TILES);
+            dirty_tiles_.insert(touched, touched + ntouched);
+        }
+
+        void submit_rebuild(dtCompressedTileRef ref)
+        {
+            const dtTileCache *tc = dynamic_.tilecache.get();
+            const dtCompressedTile *tile = tc->getTileByRef(ref);
+            if (nullptr == tile || nullptr == tile->data)
+                return;
+
+            tile_rebuilder::job j;
+            j.target = rebuild_sink_;
+            j.ref = ref;
+            j.version = ++rebuild_version_;
+            j.params = *tc->getParams();
+            j.data.assign(tile->data, tile->data + tile->dataSize);
+            for (int i = 0; i < tc->getObstacleCount(); ++i)
+            {
+                const dtTileCacheObstacle *ob = tc->getObstacle(i);
+                if (ob->state == DT_OBSTACLE_EMPTY || ob->state == DT_OBSTACLE_REMOVING)
+                    continue;
+                if (std::find(ob->touched, ob->touched + ob->ntouched, ref) != ob->touched + ob->ntouched)
+                    j.obstacles.push_back(*ob);
+            }
+            rebuild_versions_[ref] = j.version;
+            rebuilder_.submit(std::move(j));
+        }
+
+        inline static static_mesh_registry static_mesh_;
+        inline static tile_rebuilder rebuilder_;
+        std::string static_name_;
+        static_mesh_ptr static_ref_;
+        uint64_t static_generation_ = 0;
         int coord_mask_ = 0;
         std::unique_ptr<dtNavMeshQuery, dtNavMeshQueryDeleter> meshQuery;
         navmesh_context dynamic_;
+        std::shared_ptr<tile_rebuilder::sink> rebuild_sink_;
+        std::unordered_set<dtCompressedTileRef> dirty_tiles_;
+        std::unordered_map<dtCompressedTileRef, uint32_t> rebuild_versions_;
+        uint32_t rebuild_version_ = 0;
+        int rebuild_budget_ = 1;
+        uint64_t mesh_version_ = 0;
+        std::unordered_map<int, flow_entry> flows_;
+        int flow_id_ = 0;
         Filter filter_;
         dtQueryFilter queryFilter;
         std::string status_;
@@ -0,0 +1,852 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Recast.h>
+#include "navmesh.hpp"
+
+namespace pluto
+{
+    // Build parameters, in world units unless noted. The defaults match the
+    // RecastDemo tile samples.
+    struct navmesh_build_config
+    {
+        float cell_size = 0.3f;
+        float cell_height = 0.2f;
+        float agent_height = 2.0f;
+        float agent_radius = 0.6f;
+        float agent_max_climb = 0.9f;
+        float agent_max_slope = 45.0f; // degrees
+        float region_min_size = 8.0f;  // cells
+        float region_merge_size = 20.0f;
+        float edge_max_len = 12.0f;
+        float edge_max_error = 1.3f;
+        int verts_per_poly = 6;
+        float detail_sample_dist = 6.0f;
+        float detail_sample_max_error = 1.0f;
+        int tile_size = 48;      // cells
+        int max_obstacles = 128; // tilecache only
+    };
+
+    // Turns triangle geometry into the tiled navmesh ('MSET') and tilecache
+    // ('TSET') files read by navmesh::load_static and navmesh::load_dynamic.
+    //
+    // Tiles are built in parallel. A '<outfile>.hash' manifest records a
+    // content hash per tile, so a rebuild copies the tiles whose geometry and
+    // settings did not change from the previous output instead of building
+    // them again.
+    class navmesh_builder
+    {
+    public:
+        struct build_stats
+        {
+            int tiles = 0;
+            int built = 0;
+            int reused = 0;
+        };
+
+        navmesh_build_config config;
+        int threads = 0; // 0: one per hardware thread
+
+        // Wavefront OBJ, only 'v' and 'f' records are used. Polygons are
+        // triangulated as fans.
+        bool load_obj(const std::string &path, std::string &err)
+        {
+            std::ifstream is(path);
+            if (!is.is_open())
+            {
+                err = "can not open " + path;
+                return false;
+            }
+
+            std::vector<float> verts;
+            std::vector<int> tris;
+            std::vector<int> face;
+            std::string line;
+            while (std::getline(is, line))
+            {
+                std::istringstream ss(line);
+                std::string tag;
+                ss >> tag;
+                if (tag == "v")
+                {
+                    float x = 0, y = 0, z = 0;
+                    ss >> x >> y >> z;
+                    verts.push_back(x);
+                    verts.push_back(y);
+                    verts.push_back(z);
+                }
+                else if (tag == "f")
+                {
+                    face.clear();
+                    std::string token;
+                    while (ss >> token)
+                    {
+                        int vi = std::atoi(token.c_str()); // "v", "v/vt", "v//vn" and "v/vt/vn"
+                        vi = vi < 0 ? (int)(verts.size() / 3) + vi : vi - 1;
+                        if (vi < 0 || vi >= (int)(verts.size() / 3))
+                        {
+                            err = "invalid face index in " + path;
+                            return false;
+                        }
+                        face.push_back(vi);
+                    }
+                    for (size_t i = 2; i < face.size(); ++i)
+                    {
+                        tris.push_back(face[0]);
+                        tris.push_back(face[i - 1]);
+                        tris.push_back(face[i]);
+                    }
+                }
+            }
+
+            if (tris.empty())
+            {
+                err = "no triangles in " + path;
+                return false;
+            }
+            set_geometry(std::move(verts), std::move(tris));
+            return true;
+        }
+
+        // Regular grid of width * depth heights, row major along x, with
+        // cell_size spacing starting at the origin.
+        void load_heightfield(int width, int depth, float cell_size, const float *heights)
+        {
+            std::vector<float> verts;
+            std::vector<int> tris;
+            verts.reserve((size_t)width * depth * 3);
+            for (int z = 0; z < depth; ++z)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    verts.push_back(x * cell_size);
+                    verts.push_back(heights[(size_t)z * width + x]);
+                    verts.push_back(z * cell_size);
+                }
+            }
+
+            for (int z = 0; z + 1 < depth; ++z)
+            {
+                for (int x = 0; x + 1 < width; ++x)
+                {
+                    int a = z * width + x;
+                    int b = a + 1;
+                    int c = a + width;
+                    int d = c + 1;
+                    // counter clockwise seen from above, so the normals point up
+                    tris.insert(tris.end(), {a, c, b, b, c, d});
+                }
+            }
+            set_geometry(std::move(verts), std::move(tris));
+        }
+
+        void set_geometry(std::vector<float> verts, std::vector<int> tris)
+        {
+            verts_ = std::move(verts);
+            tris_ = std::move(tris);
+        }
+
+        bool build_navmesh(const std::string &outfile, std::string &err)
+        {
+            return build(outfile, false, err);
+        }
+
+        bool build_tilecache(const std::string &outfile, std::string &err)
+        {
+            return build(outfile, true, err);
+        }
+
+        const build_stats &stats() const
+        {
+            return stats_;
+        }
+
+    private:
+        static constexpr uint32_t HASHSET_MAGIC = 'N' << 24 | 'H' << 16 | 'S' << 8 | 'H'; //'NHSH'
+        static constexpr int32_t HASHSET_VERSION = 1;
+        static constexpr int MAX_LAYERS = 32;
+        static constexpr int EXPECTED_LAYERS_PER_TILE = 4;
+
+        template <typename T, void (*F)(T *)>
+        struct unique_deleter
+        {
+            void operator()(T *p)
+            {
+                F(p);
+            }
+        };
+
+        using heightfield_ptr = std::unique_ptr<rcHeightfield, unique_deleter<rcHeightfield, rcFreeHeightField>>;
+        using compact_ptr = std::unique_ptr<rcCompactHeightfield, unique_deleter<rcCompactHeightfield, rcFreeCompactHeightfield>>;
+        using layerset_ptr = std::unique_ptr<rcHeightfieldLayerSet, unique_deleter<rcHeightfieldLayerSet, rcFreeHeightfieldLayerSet>>;
+        using contourset_ptr = std::unique_ptr<rcContourSet, unique_deleter<rcContourSet, rcFreeContourSet>>;
+        using polymesh_ptr = std::unique_ptr<rcPolyMesh, unique_deleter<rcPolyMesh, rcFreePolyMesh>>;
+        using detailmesh_ptr = std::unique_ptr<rcPolyMeshDetail, unique_deleter<rcPolyMeshDetail, rcFreePolyMeshDetail>>;
+
+        struct hash_entry
+        {
+            int32_t tx;
+            int32_t ty;
+            int32_t count; // number of tile blobs, 0 for an empty tile
+            int32_t reserved;
+            uint64_t hash;
+        };
+
+        struct tile_job
+        {
+            int tx;
+            int ty;
+            uint64_t hash;
+            bool ok;
+            std::vector<std::string> blobs; // one per layer
+        };
+
+        static uint64_t tile_key(int tx, int ty)
+        {
+            return (uint64_t)(uint32_t)tx << 32 | (uint32_t)ty;
+        }
+
+        static void fnv1a(uint64_t &h, const void *data, size_t size)
+        {
+            const unsigned char *p = (const unsigned char *)data;
+            for (size_t i = 0; i < size; ++i)
+            {
+                h ^= p[i];
+                h *= 0x100000001b3ULL;
+            }
+        }
+
+        static std::string take_blob(unsigned char *data, int size)
+        {
+            std::string blob((const char *)data, (size_t)size);
+            dtFree(data);
+            return blob;
+        }
+
+        rcConfig make_config() const
+        {
+            rcConfig cfg;
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.cs = config.cell_size;
+            cfg.ch = config.cell_height;
+            cfg.walkableSlopeAngle = config.agent_max_slope;
+            cfg.walkableHeight = (int)ceilf(config.agent_height / cfg.ch);
+            cfg.walkableClimb = (int)floorf(config.agent_max_climb / cfg.ch);
+            cfg.walkableRadius = (int)ceilf(config.agent_radius / cfg.cs);
+            cfg.maxEdgeLen = (int)(config.edge_max_len / cfg.cs);
+            cfg.maxSimplificationError = config.edge_max_error;
+            cfg.minRegionArea = (int)rcSqr(config.region_min_size);
+            cfg.mergeRegionArea = (int)rcSqr(config.region_merge_size);
+            cfg.maxVertsPerPoly = config.verts_per_poly;
+            cfg.tileSize = config.tile_size;
+            cfg.borderSize = cfg.walkableRadius + 3;
+            cfg.width = cfg.tileSize + cfg.borderSize * 2;
+            cfg.height = cfg.tileSize + cfg.borderSize * 2;
+            cfg.detailSampleDist = config.detail_sample_dist < 0.9f ? 0 : cfg.cs * config.detail_sample_dist;
+            cfg.detailSampleMaxError = cfg.ch * config.detail_sample_max_error;
+            rcVcopy(cfg.bmin, bmin_);
+            rcVcopy(cfg.bmax, bmax_);
+            return cfg;
+        }
+
+        void tile_bounds(rcConfig &cfg, int tx, int ty) const
+        {
+            const float tcs = cfg.tileSize * cfg.cs;
+            cfg.bmin[0] = bmin_[0] + tx * tcs - cfg.borderSize * cfg.cs;
+            cfg.bmin[2] = bmin_[2] + ty * tcs - cfg.borderSize * cfg.cs;
+            cfg.bmax[0] = bmin_[0] + (tx + 1) * tcs + cfg.borderSize * cfg.cs;
+            cfg.bmax[2] = bmin_[2] + (ty + 1) * tcs + cfg.borderSize * cfg.cs;
+        }
+
+        // Bucket triangles into every tile their bounds (plus border) overlap.
+        void bin_triangles(const rcConfig &cfg)
+        {
+            const float tcs = cfg.tileSize * cfg.cs;
+            const float border = cfg.borderSize * cfg.cs;
+            tile_tris_.assign((size_t)tw_ * th_, std::vector<int>());
+            const int ntris = (int)(tris_.size() / 3);
+            for (int i = 0; i < ntris; ++i)
+            {
+                float tmin[3];
+                float tmax[3];
+                rcVcopy(tmin, &verts_[(size_t)tris_[i * 3] * 3]);
+                rcVcopy(tmax, tmin);
+                for (int k = 1; k < 3; ++k)
+                {
+                    const float *v = &verts_[(size_t)tris_[i * 3 + k] * 3];
+                    rcVmin(tmin, v);
+                    rcVmax(tmax, v);
+                }
+                int x0 = rcClamp((int)floorf((tmin[0] - border - bmin_[0]) / tcs), 0, tw_ - 1);
+                int x1 = rcClamp((int)floorf((tmax[0] + border - bmin_[0]) / tcs), 0, tw_ - 1);
+                int y0 = rcClamp((int)floorf((tmin[2] - border - bmin_[2]) / tcs), 0, th_ - 1);
+                int y1 = rcClamp((int)floorf((tmax[2] + border - bmin_[2]) / tcs), 0, th_ - 1);
+                for (int y = y0; y <= y1; ++y)
+                    for (int x = x0; x <= x1; ++x)
+                        tile_tris_[(size_t)y * tw_ + x].push_back(i);
+            }
+        }
+
+        // Everything a tile depends on: settings, grid origin, its position
+        // and the triangles that touch it.
+        uint64_t tile_hash(int tx, int ty, bool tilecache) const
+        {
+            uint64_t h = 0xcbf29ce484222325ULL;
+            fnv1a(h, &config, sizeof(config));
+            fnv1a(h, &tilecache, sizeof(tilecache));
+            fnv1a(h, bmin_, sizeof(bmin_));
+            fnv1a(h, &bmax_[1], sizeof(float));
+            fnv1a(h, &tx, sizeof(tx));
+            fnv1a(h, &ty, sizeof(ty));
+            for (int t : tile_tris_[(size_t)ty * tw_ + tx])
+            {
+                for (int k = 0; k < 3; ++k)
+                    fnv1a(h, &verts_[(size_t)tris_[t * 3 + k] * 3], sizeof(float) * 3);
+            }
+            return h;
+        }
+
+        // Rasterize the triangles of a tile into an eroded compact heightfield.
+        compact_ptr rasterize_tile(rcContext *ctx, const rcConfig &cfg, int tx, int ty) const
+        {
+            const std::vector<int> &ids = tile_tris_[(size_t)ty * tw_ + tx];
+            std::vector<int> tris;
+            tris.reserve(ids.size() * 3);
+            for (int t : ids)
+                tris.insert(tris.end(), &tris_[(size_t)t * 3], &tris_[(size_t)t * 3] + 3);
+            std::vector<unsigned char> areas(ids.size(), 0);
+            const int nverts = (int)(verts_.size() / 3);
+            const int ntris = (int)ids.size();
+
+            heightfield_ptr solid(rcAllocHeightfield());
+            if (!solid || !rcCreateHeightfield(ctx, *solid, cfg.width, cfg.height, cfg.bmin, cfg.bmax, cfg.cs, cfg.ch))
+                return nullptr;
+
+            rcMarkWalkableTriangles(ctx, cfg.walkableSlopeAngle, verts_.data(), nverts, tris.data(), ntris, areas.data());
+            if (!rcRasterizeTriangles(ctx, verts_.data(), nverts, tris.data(), areas.data(), ntris, *solid, cfg.walkableClimb))
+                return nullptr;
+
+            rcFilterLowHangingWalkableObstacles(ctx, cfg.walkableClimb, *solid);
+            rcFilterLedgeSpans(ctx, cfg.walkableHeight, cfg.walkableClimb, *solid);
+            rcFilterWalkableLowHeightSpans(ctx, cfg.walkableHeight, *solid);
+
+            compact_ptr chf(rcAllocCompactHeightfield());
+            if (!chf || !rcBuildCompactHeightfield(ctx, cfg.walkableHeight, cfg.walkableClimb, *solid, *chf))
+                return nullptr;
+            if (!rcErodeWalkableArea(ctx, cfg.walkableRadius, *chf))
+                return nullptr;
+            return chf;
+        }
+
+        // Sample_TileMesh.cpp
+        bool build_mesh_tile(const rcConfig &base, tile_job &job) const
+        {
+            rcContext ctx(false);
+            rcConfig cfg = base;
+            tile_bounds(cfg, job.tx, job.ty);
+
+            compact_ptr chf = rasterize_tile(&ctx, cfg, job.tx, job.ty);
+            if (!chf)
+                return false;
+
+            if (!rcBuildDistanceField(&ctx, *chf))
+                return false;
+            if (!rcBuildRegions(&ctx, *chf, cfg.borderSize, cfg.minRegionArea, cfg.mergeRegionArea))
+                return false;
+
+            contourset_ptr cset(rcAllocContourSet());
+            if (!cset || !rcBuildContours(&ctx, *chf, cfg.maxSimplificationError, cfg.maxEdgeLen, *cset))
+                return false;
+            if (cset->nconts == 0)
+                return true; // nothing walkable in this tile
+
+            polymesh_ptr pmesh(rcAllocPolyMesh());
+            if (!pmesh || !rcBuildPolyMesh(&ctx, *cset, cfg.maxVertsPerPoly, *pmesh))
+                return false;
+
+            detailmesh_ptr dmesh(rcAllocPolyMeshDetail());
+            if (!dmesh || !rcBuildPolyMeshDetail(&ctx, *pmesh, *chf, cfg.detailSampleDist, cfg.detailSampleMaxError, *dmesh))
+                return false;
+
+            if (pmesh->nverts >= 0xffff || cfg.maxVertsPerPoly > DT_VERTS_PER_POLYGON)
+                return false;
+            if (pmesh->npolys == 0)
+                return true;
+
+            for (int i = 0; i < pmesh->npolys; ++i)
+            {
+                if (pmesh->areas[i] == RC_WALKABLE_AREA)
+                {
+                    pmesh->areas[i] = POLYAREA_GROUND;
+                    pmesh->flags[i] = POLYFLAGS_WALK;
+                }
+            }
+
+            dtNavMeshCreateParams params;
+            memset(&params, 0, sizeof(params));
+            params.verts = pmesh->verts;
+            params.vertCount = pmesh->nverts;
+            params.polys = pmesh->polys;
+            params.polyAreas = pmesh->areas;
+            params.polyFlags = pmesh->flags;
+            params.polyCount = pmesh->npolys;
+            params.nvp = pmesh->nvp;
+            params.detailMeshes = dmesh->meshes;
+            params.detailVerts = dmesh->verts;
+            params.detailVertsCount = dmesh->nverts;
+            params.detailTris = dmesh->tris;
+            params.detailTriCount = dmesh->ntris;
+            params.walkableHeight = config.agent_height;
+            params.walkableRadius = config.agent_radius;
+            params.walkableClimb = config.agent_max_climb;
+            params.tileX = job.tx;
+            params.tileY = job.ty;
+            params.tileLayer = 0;
+            rcVcopy(params.bmin, pmesh->bmin);
+            rcVcopy(params.bmax, pmesh->bmax);
+            params.cs = cfg.cs;
+            params.ch = cfg.ch;
+            params.buildBvTree = true;
+
+            unsigned char *data = nullptr;
+            int size = 0;
+            if (!dtCreateNavMeshData(&params, &data, &size))
+                return false;
+            job.blobs.push_back(take_blob(data, size));
+            return true;
+        }
+
+        // Sample_TempObstacles.cpp
+        bool build_cache_tile(const rcConfig &base, tile_job &job) const
+        {
+            rcContext ctx(false);
+            FastLZCompressor comp;
+            rcConfig cfg = base;
+            tile_bounds(cfg, job.tx, job.ty);
+
+            compact_ptr chf = rasterize_tile(&ctx, cfg, job.tx, job.ty);
+            if (!chf)
+                return false;
+
+            layerset_ptr lset(rcAllocHeightfieldLayerSet());
+            if (!lset || !rcBuildHeightfieldLayers(&ctx, *chf, cfg.borderSize, cfg.walkableHeight, *lset))
+                return false;
+
+            for (int i = 0; i < rcMin(lset->nlayers, MAX_LAYERS); ++i)
+            {
+                const rcHeightfieldLayer *layer = &lset->layers[i];
+
+                dtTileCacheLayerHeader header;
+                header.magic = DT_TILECACHE_MAGIC;
+                header.version = DT_TILECACHE_VERSION;
+                header.tx = job.tx;
+                header.ty = job.ty;
+                header.tlayer = i;
+                dtVcopy(header.bmin, layer->bmin);
+                dtVcopy(header.bmax, layer->bmax);
+                header.width = (unsigned char)layer->width;
+                header.height = (unsigned char)layer->height;
+                header.minx = (unsigned char)layer->minx;
+                header.maxx = (unsigned char)layer->maxx;
+                header.miny = (unsigned char)layer->miny;
+                header.maxy = (unsigned char)layer->maxy;
+                header.hmin = (unsigned short)layer->hmin;
+                header.hmax = (unsigned short)layer->hmax;
+
+                unsigned char *data = nullptr;
+                int size = 0;
+                dtStatus status = dtBuildTileCacheLayer(&comp, &header, layer->heights, layer->areas, layer->cons, &data, &size);
+                if (dtStatusFailed(status))
+                    return false;
+                job.blobs.push_back(take_blob(data, size));
+            }
+            return true;
+        }
+
+        // Tile blobs of a previous output, keyed by tile position, in layer order.
+        static std::unordered_map<uint64_t, std::vector<std::string>> read_tiles(const std::string &file, bool tilecache)
+        {
+            std::unordered_map<uint64_t, std::vector<std::string>> tiles;
+            std::string content = navmesh::read_all(file, std::ios::binary | std::ios::in);
+            size_t offset = 0;
+            int32_t ntiles = 0;
+            if (tilecache)
+            {
+                if (content.size() < sizeof(navmesh::TileCacheSetHeader))
+                    return tiles;
+                navmesh::TileCacheSetHeader header;
+                memcpy(&header, content.data(), sizeof(header));
+                if (header.magic != navmesh::TILECACHESET_MAGIC || header.version != navmesh::TILECACHESET_VERSION)
+                    return tiles;
+                ntiles = header.numTiles;
+                offset = sizeof(header);
+            }
+            else
+            {
+                if (content.size() < sizeof(navmesh::NavMeshSetHeader))
+                    return tiles;
+                navmesh::NavMeshSetHeader header;
+                memcpy(&header, content.data(), sizeof(header));
+                if (header.magic != navmesh::NAVMESHSET_MAGIC || header.version != navmesh::NAVMESHSET_VERSION)
+                    return tiles;
+                ntiles = header.numTiles;
+                offset = sizeof(header);
+            }
+
+            for (int32_t i = 0; i < ntiles; ++i)
+            {
+                int32_t size = 0;
+                if (tilecache)
+                {
+                    if (content.size() - offset < sizeof(navmesh::TileCacheTileHeader))
+                        break;
+                    navmesh::TileCacheTileHeader tileHeader;
+                    memcpy(&tileHeader, content.data() + offset, sizeof(tileHeader));
+                    size = tileHeader.dataSize;
+                    offset += sizeof(tileHeader);
+                }
+                else
+                {
+                    if (content.size() - offset < sizeof(navmesh::NavMeshTileHeader))
+                        break;
+                    navmesh::NavMeshTileHeader tileHeader;
+                    memcpy(&tileHeader, content.data() + offset, sizeof(tileHeader));
+                    size = tileHeader.dataSize;
+                    offset += sizeof(tileHeader);
+                }
+
+                if (size <= 0 || content.size() - offset < (size_t)size)
+                    break;
+
+                const char *data = content.data() + offset;
+                offset += size;
+                int tx = 0, ty = 0, layer = 0;
+                if (tilecache)
+                {
+                    if ((size_t)size < sizeof(dtTileCacheLayerHeader))
+                        continue;
+                    dtTileCacheLayerHeader h;
+                    memcpy(&h, data, sizeof(h));
+                    tx = h.tx, ty = h.ty, layer = h.tlayer;
+                }
+                else
+                {
+                    if ((size_t)size < sizeof(dtMeshHeader))
+                        continue;
+                    dtMeshHeader h;
+                    memcpy(&h, data, sizeof(h));
+                    tx = h.x, ty = h.y, layer = h.layer;
+                }
+
+                auto &blobs = tiles[tile_key(tx, ty)];
+                if ((int)blobs.size() <= layer)
+                    blobs.resize((size_t)layer + 1);
+                blobs[layer].assign(data, (size_t)size);
+            }
+            return tiles;
+        }
+
+        static std::unordered_map<uint64_t, hash_entry> read_hashes(const std::string &file)
+        {
+            std::unordered_map<uint64_t, hash_entry> hashes;
+            std::string content = navmesh::read_all(file, std::ios::binary | std::ios::in);
+            if (content.size() < sizeof(uint32_t) + sizeof(int32_t) * 2)
+                return hashes;
+
+            uint32_t magic;
+            int32_t version, count;
+            memcpy(&magic, content.data(), sizeof(magic));
+            memcpy(&version, content.data() + 4, sizeof(version));
+            memcpy(&count, content.data() + 8, sizeof(count));
+            if (magic != HASHSET_MAGIC || version != HASHSET_VERSION || count < 0
+                || content.size() - 12 < (size_t)count * sizeof(hash_entry))
+                return hashes;
+
+            for (int32_t i = 0; i < count; ++i)
+            {
+                hash_entry e;
+                memcpy(&e, content.data() + 12 + i * sizeof(hash_entry), sizeof(e));
+                hashes.emplace(tile_key(e.tx, e.ty), e);
+            }
+            return hashes;
+        }
+
+        bool write_hashes(const std::string &file, const std::vector<tile_job> &jobs) const
+        {
+            std::ofstream os(file, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!os.is_open())
+                return false;
+            int32_t count = (int32_t)jobs.size();
+            os.write((const char *)&HASHSET_MAGIC, sizeof(HASHSET_MAGIC));
+            os.write((const char *)&HASHSET_VERSION, sizeof(HASHSET_VERSION));
+            os.write((const char *)&count, sizeof(count));
+            for (const auto &job : jobs)
+            {
+                hash_entry e{job.tx, job.ty, (int32_t)job.blobs.size(), 0, job.hash};
+                os.write((const char *)&e, sizeof(e));
+            }
+            return os.good();
+        }
+
+        bool write_navmesh(const std::string &file, const dtNavMeshParams &params, std::vector<tile_job> &jobs, std::string &err) const
+        {
+            // Adding the tiles to a real mesh validates them and yields the
+            // tile refs that load_static restores.
+            std::unique_ptr<dtNavMesh, unique_deleter<dtNavMesh, dtFreeNavMesh>> mesh(dtAllocNavMesh());
+            if (!mesh || dtStatusFailed(mesh->init(&params)))
+            {
+                err = "mesh init failed";
+                return false;
+            }
+
+            navmesh::NavMeshSetHeader header;
+            header.magic = navmesh::NAVMESHSET_MAGIC;
+            header.version = navmesh::NAVMESHSET_VERSION;
+            header.numTiles = 0;
+            header.params = params;
+
+            std::vector<navmesh::NavMeshTileHeader> refs;
+            std::vector<const std::string *> blobs;
+            for (auto &job : jobs)
+            {
+                for (auto &blob : job.blobs)
+                {
+                    dtTileRef ref = 0;
+                    dtStatus status = mesh->addTile((unsigned char *)&blob[0], (int)blob.size(), 0, 0, &ref);
+                    if (dtStatusFailed(status))
+                    {
+                        err = "add tile failed";
+                        return false;
+                    }
+                    refs.push_back(navmesh::NavMeshTileHeader{ref, (int)blob.size()});
+                    blobs.push_back(&blob);
+                }
+            }
+            header.numTiles = (int)refs.size();
+
+            std::ofstream os(file, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!os.is_open())
+            {
+                err = "can not open " + file;
+                return false;
+            }
+            os.write((const char *)&header, sizeof(header));
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                os.write((const char *)&refs[i], sizeof(refs[i]));
+                os.write(blobs[i]->data(), (std::streamsize)blobs[i]->size());
+            }
+            return os.good();
+        }
+
+        bool write_tilecache(
+            const std::string &file,
+            const dtNavMeshParams &meshParams,
+            const dtTileCacheParams &cacheParams,
+            std::vector<tile_job> &jobs,
+            std::string &err) const
+        {
+            LinearAllocator talloc(32 * 1024);
+            FastLZCompressor tcomp;
+            MeshProcess tmproc;
+            std::unique_ptr<dtTileCache, unique_deleter<dtTileCache, dtFreeTileCache>> tilecache(dtAllocTileCache());
+            if (!tilecache || dtStatusFailed(tilecache->init(&cacheParams, &talloc, &tcomp, &tmproc)))
+            {
+                err = "tileCache init failed";
+                return false;
+            }
+
+            navmesh::TileCacheSetHeader header;
+            header.magic = navmesh::TILECACHESET_MAGIC;
+            header.version = navmesh::TILECACHESET_VERSION;
+            header.numTiles = 0;
+            header.meshParams = meshParams;
+            header.cacheParams = cacheParams;
+
+            std::vector<navmesh::TileCacheTileHeader> refs;
+            std::vector<const std::string *> blobs;
+            for (auto &job : jobs)
+            {
+                for (auto &blob : job.blobs)
+                {
+                    dtCompressedTileRef ref = 0;
+                    dtStatus status = tilecache->addTile((unsigned char *)&blob[0], (int)blob.size(), 0, &ref);
+                    if (dtStatusFailed(status))
+                    {
+                        err = "add tile failed";
+                        return false;
+                    }
+                    refs.push_back(navmesh::TileCacheTileHeader{ref, (int32_t)blob.size()});
+                    blobs.push_back(&blob);
+                }
+            }
+            header.numTiles = (int32_t)refs.size();
+
+            std::ofstream os(file, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!os.is_open())
+            {
+                err = "can not open " + file;
+                return false;
+            }
+            os.write((const char *)&header, sizeof(header));
+            for (size_t i = 0; i < refs.size(); ++i)
+            {
+                os.write((const char *)&refs[i], sizeof(refs[i]));
+                os.write(blobs[i]->data(), (std::streamsize)blobs[i]->size());
+            }
+            return os.good();
+        }
+
+        bool build(const std::string &outfile, bool tilecache, std::string &err)
+        {
+            stats_ = build_stats{};
+            if (tris_.empty() || verts_.empty())
+            {
+                err = "no input geometry";
+                return false;
+            }
+
+            rcCalcBounds(verts_.data(), (int)(verts_.size() / 3), bmin_, bmax_);
+            rcConfig cfg = make_config();
+            int gw = 0, gh = 0;
+            rcCalcGridSize(bmin_, bmax_, cfg.cs, &gw, &gh);
+            tw_ = (gw + cfg.tileSize - 1) / cfg.tileSize;
+            th_ = (gh + cfg.tileSize - 1) / cfg.tileSize;
+            bin_triangles(cfg);
+
+            // Hash every tile, take unchanged ones from the previous output.
+            auto old_tiles = read_tiles(outfile, tilecache);
+            auto old_hashes = read_hashes(outfile + ".hash");
+
+            std::vector<tile_job> jobs;
+            std::vector<size_t> pending;
+            for (int y = 0; y < th_; ++y)
+            {
+                for (int x = 0; x < tw_; ++x)
+                {
+                    tile_job job{x, y, tile_hash(x, y, tilecache), true, {}};
+                    auto h = old_hashes.find(tile_key(x, y));
+                    if (h != old_hashes.end() && h->second.hash == job.hash)
+                    {
+                        auto t = old_tiles.find(tile_key(x, y));
+                        size_t n = (t == old_tiles.end()) ? 0 : t->second.size();
+                        if ((int)n == h->second.count)
+                        {
+                            if (n > 0)
+                                job.blobs = std::move(t->second);
+                            ++stats_.reused;
+                            jobs.push_back(std::move(job));
+                            continue;
+                        }
+                    }
+                    pending.push_back(jobs.size());
+                    jobs.push_back(std::move(job));
+                }
+            }
+            old_tiles.clear();
+
+            int nthreads = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+            nthreads = std::max(1, std::min(nthreads, (int)pending.size()));
+            std::atomic<size_t> next{0};
+            auto worker = [&]()
+            {
+                for (size_t i = next++; i < pending.size(); i = next++)
+                {
+                    tile_job &job = jobs[pending[i]];
+                    if (tile_tris_[(size_t)job.ty * tw_ + job.tx].empty())
+                        continue;
+                    job.ok = tilecache ? build_cache_tile(cfg, job) : build_mesh_tile(cfg, job);
+                }
+            };
+            std::vector<std::thread> pool;
+            for (int i = 1; i < nthreads; ++i)
+                pool.emplace_back(worker);
+            worker();
+            for (auto &t : pool)
+                t.join();
+
+            for (const auto &job : jobs)
+            {
+                if (!job.ok)
+                {
+                    err = "build tile (" + std::to_string(job.tx) + "," + std::to_string(job.ty) + ") failed";
+                    return false;
+                }
+            }
+            stats_.tiles = tw_ * th_;
+            stats_.built = (int)pending.size();
+
+            size_t nblobs = 0;
+            for (const auto &job : jobs)
+                nblobs += job.blobs.size();
+
+            const int expected = std::max((int)nblobs, tw_ * th_ * (tilecache ? EXPECTED_LAYERS_PER_TILE : 1));
+            const int tileBits = std::min((int)dtIlog2(dtNextPow2((unsigned int)expected)), 14);
+            if ((size_t)1 << tileBits < nblobs)
+            {
+                err = "too many tiles, increase tile_size";
+                return false;
+            }
+
+            dtNavMeshParams meshParams;
+            memset(&meshParams, 0, sizeof(meshParams));
+            rcVcopy(meshParams.orig, bmin_);
+            meshParams.tileWidth = cfg.tileSize * cfg.cs;
+            meshParams.tileHeight = cfg.tileSize * cfg.cs;
+            meshParams.maxTiles = 1 << tileBits;
+            meshParams.maxPolys = 1 << (22 - tileBits);
+
+            bool ok = false;
+            if (tilecache)
+            {
+                dtTileCacheParams cacheParams;
+                memset(&cacheParams, 0, sizeof(cacheParams));
+                rcVcopy(cacheParams.orig, bmin_);
+                cacheParams.cs = cfg.cs;
+                cacheParams.ch = cfg.ch;
+                cacheParams.width = cfg.tileSize;
+                cacheParams.height = cfg.tileSize;
+                cacheParams.walkableHeight = config.agent_height;
+                cacheParams.walkableRadius = config.agent_radius;
+                cacheParams.walkableClimb = config.agent_max_climb;
+                cacheParams.maxSimplificationError = config.edge_max_error;
+                cacheParams.maxTiles = expected;
+                cacheParams.maxObstacles = config.max_obstacles;
+                ok = write_tilecache(outfile, meshParams, cacheParams, jobs, err);
+            }
+            else
+            {
+                ok = write_navmesh(outfile, meshParams, jobs, err);
+            }
+
+            if (ok && !write_hashes(outfile + ".hash", jobs))
+            {
+                err = "can not write " + outfile + ".hash";
+                return false;
+            }
+            return ok;
+        }
+
+        std::vector<float> verts_;
+        std::vector<int> tris_;
+        std::vector<std::vector<int>> tile_tris_;
+        float bmin_[3] = {0.0f, 0.0f, 0.0f};
+        float bmax_[3] = {0.0f, 0.0f, 0.0f};
+        int tw_ = 0;
+        int th_ = 0;
+        build_stats stats_;
+    };
+} // namespace pluto
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <DetourCommon.h>
+#include <DetourNavMesh.h>
+#include <DetourNavMeshQuery.h>
+
+namespace pluto
+{
+    // Abstract graph over the tiles of a dtNavMesh (HPA*-style).
+    //
+    // Every tile is split into regions: sets of polygons that are connected
+    // inside the tile and share the same flags and area. Each pair of adjacent
+    // regions is joined by one portal, placed on the shared border. A long
+    // path is found by searching the portals first, and only the first few
+    // tiles of that route are refined with a regular polygon A*. Since a
+    // region is uniform, the query filter decides for the whole of it whether
+    // it can be entered and what walking through it costs.
+    class tile_graph
+    {
+    public:
+        struct portal
+        {
+            int region[2];
+            dtPolyRef poly[2]; // poly on the region[0] side and the region[1] side
+            float pos[3];
+        };
+
+        // One step of an abstract path: the portal crossed and the side of
+        // the portal that is entered.
+        struct step
+        {
+            int portal;
+            int side;
+        };
+
+        bool build(const dtNavMesh *mesh)
+        {
+            const int max_tiles = mesh->getMaxTiles();
+            tile_base_.assign((size_t)max_tiles + 1, 0);
+            for (int i = 0; i < max_tiles; ++i)
+            {
+                const dtMeshTile *tile = mesh->getTile(i);
+                int n = (tile && tile->header) ? tile->header->polyCount : 0;
+                tile_base_[(size_t)i + 1] = tile_base_[i] + n;
+            }
+
+            poly_region_.assign((size_t)tile_base_.back(), -1);
+            regions_.clear();
+            region_flags_.clear();
+            region_area_.clear();
+            portals_.clear();
+            areas_ = 0;
+
+            // Flood fill the polygons of every tile through links that stay in
+            // the tile, between polygons of the same flags and area.
+            std::vector<int> open;
+            for (int i = 0; i < max_tiles; ++i)
+            {
+                const dtMeshTile *tile = mesh->getTile(i);
+                if (!tile || !tile->header)
+                    continue;
+
+                for (int p = 0; p < tile->header->polyCount; ++p)
+                {
+                    int &slot = poly_region_[(size_t)tile_base_[i] + p];
+                    if (slot >= 0)
+                        continue;
+
+                    const dtPoly *seed = &tile->polys[p];
+                    int region = (int)regions_.size();
+                    regions_.emplace_back();
+                    region_flags_.push_back(seed->flags);
+                    region_area_.push_back(seed->getArea());
+                    areas_ |= (uint64_t)1 << seed->getArea();
+                    slot = region;
+                    open.push_back(p);
+                    while (!open.empty())
+                    {
+                        const dtPoly *poly = &tile->polys[open.back()];
+                        open.pop_back();
+                        for (unsigned int k = poly->firstLink; k != DT_NULL_LINK; k = tile->links[k].next)
+                        {
+                            dtPolyRef ref = tile->links[k].ref;
+                            if ((int)mesh->decodePolyIdTile(ref) != i)
+                                continue;
+                            int np = (int)mesh->decodePolyIdPoly(ref);
+                            const dtPoly *npoly = &tile->polys[np];
+                            if (npoly->flags != seed->flags || npoly->getArea() != seed->getArea())
+                                continue;
+                            int &nslot = poly_region_[(size_t)tile_base_[i] + np];
+                            if (nslot < 0)
+                            {
+                                nslot = region;
+                                open.push_back(np);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Collect the border links between each pair of regions, then keep
+            // the one closest to the middle of the shared border as the portal.
+            std::unordered_map<uint64_t, std::vector<portal>> borders;
+            for (int i = 0; i < max_tiles; ++i)
+            {
+                const dtMeshTile *tile = mesh->getTile(i);
+                if (!tile || !tile->header)
+                    continue;
+
+                dtPolyRef base = mesh->getPolyRefBase(tile);
+                for (int p = 0; p < tile->header->polyCount; ++p)
+                {
+                    const dtPoly *poly = &tile->polys[p];
+                    for (unsigned int k = poly->firstLink; k != DT_NULL_LINK; k = tile->links[k].next)
+                    {
+                        const dtLink &link = tile->links[k];
+                        int a = poly_region_[(size_t)tile_base_[i] + p];
+                        int b = region_of(mesh, link.ref);
+                        if (b < 0 || a == b)
+                            continue;
+
+                        portal e;
+                        if (poly->getType() == DT_POLYTYPE_OFFMESH_CONNECTION)
+                        {
+                            // the edge is the end of the connection that is linked
+                            dtVcopy(e.pos, &tile->verts[poly->verts[link.edge & 1] * 3]);
+                        }
+                        else if (link.edge == 0xff)
+                        {
+                            // into an off-mesh connection, use its end nearest to this poly
+                            const dtMeshTile *ot = nullptr;
+                            const dtPoly *op = nullptr;
+                            mesh->getTileAndPolyByRefUnsafe(link.ref, &ot, &op);
+                            const float *v0 = &ot->verts[op->verts[0] * 3];
+                            const float *v1 = &ot->verts[op->verts[1] * 3];
+                            const float *pv = &tile->verts[poly->verts[0] * 3];
+                            dtVcopy(e.pos, dtVdistSqr(pv, v0) <= dtVdistSqr(pv, v1) ? v0 : v1);
+                        }
+                        else
+                        {
+                            const float *va = &tile->verts[poly->verts[link.edge] * 3];
+                            const float *vb = &tile->verts[poly->verts[(link.edge + 1) % poly->vertCount] * 3];
+                            float tmin = 0.0f;
+                            float tmax = 1.0f;
+                            if (link.side != 0xff)
+                            {
+                                tmin = link.bmin / 255.0f;
+                                tmax = link.bmax / 255.0f;
+                            }
+                            dtVlerp(e.pos, va, vb, (tmin + tmax) * 0.5f);
+                        }
+
+                        // a border is usually seen from both sides, file it under
+                        // the lower region; off-mesh links may be one way only
+                        dtPolyRef pa = base | (dtPolyRef)p;
+                        dtPolyRef pb = link.ref;
+                        if (a > b)
+                        {
+                            std::swap(a, b);
+                            std::swap(pa, pb);
+                        }
+                        e.region[0] = a;
+                        e.region[1] = b;
+                        e.poly[0] = pa;
+                        e.poly[1] = pb;
+                        borders[(uint64_t)a << 32 | (uint32_t)b].push_back(e);
+                    }
+                }
+            }
+
+            for (auto &[key, links] : borders)
+            {
+                float center[3] = {0.0f, 0.0f, 0.0f};
+                for (const auto &e : links)
+                    dtVadd(center, center, e.pos);
+                dtVscale(center, center, 1.0f / (float)links.size());
+
+                auto best = std::min_element(
+                    links.begin(),
+                    links.end(),
+                    [&center](const portal &l, const portal &r)
+                    { return dtVdistSqr(l.pos, center) < dtVdistSqr(r.pos, center); });
+
+                int index = (int)portals_.size();
+                portals_.push_back(*best);
+                regions_[best->region[0]].push_back(index);
+                regions_[best->region[1]].push_back(index);
+            }
+            return true;
+        }
+
+        int region_of(const dtNavMesh *mesh, dtPolyRef ref) const
+        {
+            return region_at((int)mesh->decodePolyIdTile(ref), (int)mesh->decodePolyIdPoly(ref));
+        }
+
+        const portal &get_portal(int index) const
+        {
+            return portals_[index];
+        }
+
+        // A* over the portals, from spos in region `start` to epos in region
+        // `goal`. Regions the filter excludes are never entered, and the
+        // distance walked through a region is weighted by its area cost.
+        bool search(
+            const dtQueryFilter &filter,
+            int start,
+            const float *spos,
+            int goal,
+            const float *epos,
+            std::vector<step> &path) const
+        {
+            struct node
+            {
+                float g;
+                int parent;
+                uint32_t stamp;
+                bool closed;
+            };
+
+            thread_local std::vector<node> nodes;
+            thread_local uint32_t stamp = 0;
+
+            path.clear();
+            if (start < 0 || goal < 0 || start == goal)
+                return false;
+
+            // a state is a portal and the side of it we are standing on
+            const int nstate = (int)portals_.size() * 2;
+            const int goal_state = nstate;
+            if (nodes.size() < (size_t)nstate + 1)
+                nodes.resize((size_t)nstate + 1, node{0.0f, -1, 0, false});
+            if (++stamp == 0)
+            {
+                for (auto &n : nodes)
+                    n.stamp = 0;
+                stamp = 1;
+            }
+
+            // the cheapest area keeps the distance heuristic admissible
+            float hscale = 1.0f;
+            for (int a = 0; a < DT_MAX_AREAS; ++a)
+            {
+                if (areas_ & ((uint64_t)1 << a))
+                    hscale = std::min(hscale, filter.getAreaCost(a));
+            }
+            hscale = std::max(hscale, 0.0f);
+
+            auto passable = [&](int region)
+            {
+                unsigned short flags = region_flags_[region];
+                return (flags & filter.getIncludeFlags()) != 0 && (flags & filter.getExcludeFlags()) == 0;
+            };
+
+            using item = std::pair<float, int>;
+            std::priority_queue<item, std::vector<item>, std::greater<item>> open;
+
+            auto relax = [&](int state, const float *pos, float g, int parent)
+            {
+                node &n = nodes[state];
+                if (n.stamp == stamp && (n.closed || n.g <= g))
+                    return;
+                n.stamp = stamp;
+                n.g = g;
+                n.parent = parent;
+                n.closed = false;
+                open.emplace(g + dtVdist(pos, epos) * hscale, state);
+            };
+
+            auto expand = [&](int region, const float *pos, float g, int from, int parent)
+            {
+                const float cost = filter.getAreaCost(region_area_[region]);
+                if (region == goal)
+                    relax(goal_state, epos, g + dtVdist(pos, epos) * cost, parent);
+                for (int q : regions_[region])
+                {
+                    if (q == from)
+                        continue;
+                    const portal &e = portals_[q];
+                    int side = (e.region[0] == region) ? 1 : 0;
+                    if (!passable(e.region[side]))
+                        continue;
+                    relax(q * 2 + side, e.pos, g + dtVdist(pos, e.pos) * cost, parent);
+                }
+            };
+
+            expand(start, spos, 0.0f, -1, -1);
+            while (!open.empty())
+            {
+                int state = open.top().second;
+                open.pop();
+                node &n = nodes[state];
+                if (n.closed)
+                    continue;
+                n.closed = true;
+
+                if (state == goal_state)
+                {
+                    for (int s = n.parent; s >= 0; s = nodes[s].parent)
+                        path.push_back(step{s / 2, s % 2});
+                    std::reverse(path.begin(), path.end());
+                    return true;
+                }
+
+                const portal &e = portals_[state / 2];
+                expand(e.region[state % 2], e.pos, n.g, state / 2, state);
+            }
+            return false;
+        }
+
+    private:
+        int region_at(int tile, int poly) const
+        {
+            if (tile < 0 || (size_t)tile + 1 >= tile_base_.size())
+                return -1;
+            if (poly < 0 || poly >= tile_base_[(size_t)tile + 1] - tile_base_[tile])
+                return -1;
+            return poly_region_[(size_t)tile_base_[tile] + poly];
+        }
+
+        std::vector<int> tile_base_;   // first poly slot of each tile
+        std::vector<int> poly_region_; // region of each poly slot
+        std::vector<std::vector<int>> regions_;      // portals of each region
+        std::vector<unsigned short> region_flags_;  // poly flags shared by a region
+        std::vector<unsigned char> region_area_;    // poly area shared by a region
+        std::vector<portal> portals_;
+        uint64_t areas_ = 0;                        // bit set of the areas in use
+    };
+} // namespace pluto
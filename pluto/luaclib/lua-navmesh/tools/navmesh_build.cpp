@@ -0,0 +1,125 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../navmesh_builder.hpp"
+
+static void usage(const char *name)
+{
+    std::fprintf(stderr,
+                 "usage: %s [options] <input> <output>\n"
+                 "  input is a Wavefront .obj file, or a raw float32 height grid with --heightfield\n"
+                 "options:\n"
+                 "  --tilecache                 write a tilecache ('TSET') for load_dynamic instead of a navmesh ('MSET')\n"
+                 "  --heightfield <w> <d> <cs>  input is a w * d grid of heights with cs spacing\n"
+                 "  --threads <n>               worker threads, default one per core\n"
+                 "  --cell-size <f>             default 0.3\n"
+                 "  --cell-height <f>           default 0.2\n"
+                 "  --agent-height <f>          default 2.0\n"
+                 "  --agent-radius <f>          default 0.6\n"
+                 "  --agent-climb <f>           default 0.9\n"
+                 "  --agent-slope <f>           default 45\n"
+                 "  --tile-size <n>             cells per tile side, default 48\n"
+                 "  --max-obstacles <n>         tilecache obstacle slots, default 128\n",
+                 name);
+}
+
+static const char *next_arg(int &i, int argc, char *argv[])
+{
+    if (i + 1 >= argc)
+    {
+        std::fprintf(stderr, "missing value for %s\n", argv[i]);
+        std::exit(1);
+    }
+    return argv[++i];
+}
+
+int main(int argc, char *argv[])
+{
+    pluto::navmesh_builder builder;
+    bool tilecache = false;
+    int hf_width = 0, hf_depth = 0;
+    float hf_cell = 0.0f;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--tilecache")
+            tilecache = true;
+        else if (arg == "--heightfield")
+        {
+            hf_width = std::atoi(next_arg(i, argc, argv));
+            hf_depth = std::atoi(next_arg(i, argc, argv));
+            hf_cell = (float)std::atof(next_arg(i, argc, argv));
+        }
+        else if (arg == "--threads")
+            builder.threads = std::atoi(next_arg(i, argc, argv));
+        else if (arg == "--cell-size")
+            builder.config.cell_size = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--cell-height")
+            builder.config.cell_height = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--agent-height")
+            builder.config.agent_height = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--agent-radius")
+            builder.config.agent_radius = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--agent-climb")
+            builder.config.agent_max_climb = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--agent-slope")
+            builder.config.agent_max_slope = (float)std::atof(next_arg(i, argc, argv));
+        else if (arg == "--tile-size")
+            builder.config.tile_size = std::atoi(next_arg(i, argc, argv));
+        else if (arg == "--max-obstacles")
+            builder.config.max_obstacles = std::atoi(next_arg(i, argc, argv));
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            files.push_back(arg);
+    }
+
+    if (files.size() != 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string err;
+    if (hf_width > 0)
+    {
+        std::ifstream is(files[0], std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        if (hf_depth < 2 || hf_width < 2 || hf_cell <= 0.0f
+            || content.size() != (size_t)hf_width * hf_depth * sizeof(float))
+        {
+            std::fprintf(stderr, "heightfield %s does not match %d x %d\n", files[0].c_str(), hf_width, hf_depth);
+            return 1;
+        }
+        builder.load_heightfield(hf_width, hf_depth, hf_cell, (const float *)content.data());
+    }
+    else if (!builder.load_obj(files[0], err))
+    {
+        std::fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = tilecache ? builder.build_tilecache(files[1], err) : builder.build_navmesh(files[1], err);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (!ok)
+    {
+        std::fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    const auto &stats = builder.stats();
+    std::printf("%s: %d tiles, %d built, %d reused, %lld ms\n",
+                files[1].c_str(), stats.tiles, stats.built, stats.reused, (long long)ms);
+    return 0;
+}
@@ -20,6 +20,12 @@ PB_NS_BEGIN
 
 #include <stdio.h>
 #include <errno.h>
+#include <float.h>
+#include <math.h>
+
+#include "../lua-yyjson/yyjson.h"
+#include "../luaecs/luaecs.h"
+#include "../luaecs/ecs_internal.h"
 
 
 /* Lua util routines */
@@ -27,11 +33,16 @@ PB_NS_BEGIN
 #define PB_STATE     "pb.State"
 #define PB_BUFFER    "pb.Buffer"
 #define PB_SLICE     "pb.Slice"
+#define PB_LAZY      "pb.Lazy"
+#define PB_ARRAY     "pb.Array"
+#define PB_COMPONENT "pb.Component"
 
 #define check_buffer(L,idx) ((pb_Buffer*)luaL_checkudata(L,idx,PB_BUFFER))
 #define test_buffer(L,idx)  ((pb_Buffer*)luaL_testudata(L,idx,PB_BUFFER))
 #define check_slice(L,idx)  ((pb_Slice*)luaL_checkudata(L,idx,PB_SLICE))
 #define test_slice(L,idx)   ((pb_Slice*)luaL_testudata(L,idx,PB_SLICE))
+#define check_lazy(L,idx)   ((lpb_Lazy*)luaL_checkudata(L,idx,PB_LAZY))
+#define test_lazy(L,idx)    ((lpb_Lazy*)luaL_testudata(L,idx,PB_LAZY))
 #define push_slice(L,s)     lua_pushlstring((L), (s).p, pb_len((s)))
 #define lpb_returnself(L)  { return lua_settop(L, 1), 1; }
 
@@ -42,6 +53,19 @@ static int lpb_relindex(int idx, int offset) {
 static size_t lpb_checkmem(lua_State *L, size_t ret)
 { return ret ? ret : (size_t)luaL_error(L, "out of memory"); }
 
+typedef struct lpb_Shared lpb_Shared;
+typedef struct lpb_State  lpb_State;
+
+typedef struct lpb_Lazy {  /* message decoded on first access */
+    pb_Slice       s;      /* its bytes, anchored by registry[lazy] */
+    const pb_Type *t;
+    lpb_Shared    *shared; /* snapshot t lives in, NULL for a local type */
+    lpb_State     *owner;  /* state a local t lives in, anchored by
+                              registry[&lazy->owner] */
+    unsigned       gen;    /* owner->free_gen when created */
+    int            decoded; /* registry[lazy] holds the table then */
+} lpb_Lazy;
+
 #if LUA_VERSION_NUM < 502
 #include <assert.h>
 
@@ -128,17 +152,74 @@ static int lua53_rawgetp(lua_State *L, int idx, const void *p)
 #define lpbS_state(LS)    ((LS)->state)
 #define lpb_name(LS,s)   pb_name(lpbS_state(LS), (s), &(LS)->cache)
 
-static const pb_State *global_state = NULL;
+/* pb.share_state() publishes a snapshot of the loaded types that every
+ * Lua state in the process picks up, usually one skynet service per
+ * state. A snapshot is never written after it is published: its plans
+ * are built up front and a schema update publishes a new snapshot
+ * instead. Each state holds a reference on the snapshot it decodes
+ * against, so the old one is freed once the last state moves on. The
+ * lock is held only to swap the pointer or to take a reference.
+ *
+ * A snapshot also keeps the descriptors it was built from, one entry per
+ * .proto file. share_state() builds the next snapshot from those of the
+ * current one plus whatever the caller loaded since, a newer file
+ * replacing the older one of the same name, so reloading one changed
+ * file publishes the whole schema again. The caller's local types are
+ * dropped once published: after a share, pb.clear() only discards loads
+ * that were not shared yet, never types the state already decodes with. */
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+# define lpb_atominc(p)  _InterlockedIncrement((volatile long*)(p))
+# define lpb_atomdec(p)  _InterlockedDecrement((volatile long*)(p))
+# define lpb_trylock(p)  (_InterlockedExchange((volatile long*)(p), 1) == 0)
+# define lpb_unlock(p)   _InterlockedExchange((volatile long*)(p), 0)
+#elif defined(__GNUC__)
+# define lpb_atominc(p)  __sync_add_and_fetch((p), 1)
+# define lpb_atomdec(p)  __sync_sub_and_fetch((p), 1)
+# define lpb_trylock(p)  (__sync_lock_test_and_set((p), 1) == 0)
+# define lpb_unlock(p)   __sync_lock_release(p)
+#else /* no threads assumed */
+# define lpb_atominc(p)  (++*(p))
+# define lpb_atomdec(p)  (--*(p))
+# define lpb_trylock(p)  (*(p) = 1)
+# define lpb_unlock(p)   (*(p) = 0)
+#endif
+
+struct lpb_Shared {
+    pb_State state;
+    pb_Buffer descs;   /* FileDescriptorProto bytes, length prefixed */
+    long     refcount;
+    long     version;  /* 1 for the first snapshot published */
+};
+
+static lpb_Shared *lpb_shared = NULL;
+static volatile long lpb_sharedlock = 0;
+static long lpb_sharedver = 0; /* under lpb_sharedlock */
+static volatile unsigned lpb_plangen = 0; /* bumped whenever type plans are dropped */
 static const char state_name[] = PB_STATE;
 
 enum lpb_Int64Mode { LPB_NUMBER, LPB_STRING, LPB_HEXSTRING };
 enum lpb_EncodeMode   { LPB_DEFDEF, LPB_COPYDEF, LPB_METADEF, LPB_NODEF };
 
-typedef struct lpb_State {
+#define LPB_KEYCACHE_SIZE 256 /* power of 2 */
+
+typedef struct lpb_PlanField lpb_PlanField;
+
+typedef struct lpb_KeySlot {
+    const char          *key;  /* Lua string last seen for this field */
+    const pb_Type       *type;
+    const lpb_PlanField *pf;
+} lpb_KeySlot;
+
+struct lpb_State {
     const pb_State *state;
+    lpb_Shared *shared; /* snapshot state points into, if any */
     pb_State  local;
     pb_Cache  cache;
     pb_Buffer buffer;
+    pb_Buffer sizes;    /* uint32 scratch stack of the presize pass */
+    pb_Buffer descs;    /* files loaded into local, as in lpb_Shared */
     pb_Type   array_type;
     pb_Type   map_type;
     int defs_index;
@@ -153,7 +234,12 @@ typedef struct lpb_State {
     unsigned decode_default_array   : 1;
     unsigned decode_default_message : 1;
     unsigned encode_order  : 1;
-} lpb_State;
+    unsigned encode_presize : 1;
+    unsigned decode_packed_array : 1;
+    unsigned plan_gen;  /* lpb_plangen the key cache was filled under */
+    unsigned free_gen;  /* bumped whenever local types are freed or moved */
+    lpb_KeySlot keys[LPB_KEYCACHE_SIZE];
+};
 
 static int lpb_reftable(lua_State *L, int ref) {
     if (ref != LUA_NOREF) {
@@ -175,15 +261,77 @@ static void lpb_pushenchooktable(lua_State *L, lpb_State *LS)
 static void lpb_pushdechooktable(lua_State *L, lpb_State *LS)
 { LS->dec_hooks_index = lpb_reftable(L, LS->dec_hooks_index); }
 
+static lpb_Shared *lpb_acquireshared(void) {
+    lpb_Shared *sh;
+    while (!lpb_trylock(&lpb_sharedlock)) ;
+    if ((sh = lpb_shared) != NULL) lpb_atominc(&sh->refcount);
+    lpb_unlock(&lpb_sharedlock);
+    return sh;
+}
+
+static void lpb_releaseshared(lpb_Shared *sh) {
+    if (sh != NULL && lpb_atomdec(&sh->refcount) == 0) {
+        pb_free(&sh->state);
+        pb_resetbuffer(&sh->descs);
+        free(sh);
+    }
+}
+
+static void lpb_publishshared(lpb_Shared *sh) {
+    lpb_Shared *old;
+    while (!lpb_trylock(&lpb_sharedlock)) ;
+    old = lpb_shared, lpb_shared = sh;
+    sh->version = ++lpb_sharedver;
+    lpb_unlock(&lpb_sharedlock);
+    lpb_releaseshared(old);
+}
+
+/* hooks are keyed by type, carry them over to the types of the same
+ * name in the new state; the old types must still be alive here */
+static void lpb_rekeyhooks(lua_State *L, lpb_State *LS, int ref) {
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {
+        const pb_Type *t = (const pb_Type*)lua_touserdata(L, -2);
+        const pb_Type *nt = NULL;
+        if (t != NULL) nt = pb_type(LS->state, pb_name(LS->state,
+                    pb_slice((const char*)t->name), &LS->cache));
+        if (nt != NULL) {
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, -4, nt);
+        }
+        lua_pop(L, 1);
+    }
+    lua_rawseti(L, LUA_REGISTRYINDEX, ref);
+    lua_pop(L, 1);
+}
+
+/* switch LS over to snapshot sh, taking over the caller's reference */
+static void lpb_useshared(lua_State *L, lpb_State *LS, lpb_Shared *sh) {
+    lpb_Shared *old = LS->shared;
+    LS->shared = sh;
+    LS->state = &sh->state;
+    memset(LS->keys, 0, sizeof(LS->keys));
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
+    LS->defs_index = LUA_NOREF;
+    lpb_rekeyhooks(L, LS, LS->enc_hooks_index);
+    lpb_rekeyhooks(L, LS, LS->dec_hooks_index);
+    lpb_releaseshared(old);
+}
+
 static int Lpb_delete(lua_State *L) {
     lpb_State *LS = (lpb_State*)luaL_testudata(L, 1, PB_STATE);
     if (LS != NULL) {
-        const pb_State *GS = global_state;
         pb_free(&LS->local);
-        if (&LS->local == GS)
-            global_state = NULL;
+        lpb_atominc(&lpb_plangen);
+        lpb_releaseshared(LS->shared);
+        LS->shared = NULL;
         LS->state = NULL;
         pb_resetbuffer(&LS->buffer);
+        pb_resetbuffer(&LS->sizes);
+        pb_resetbuffer(&LS->descs);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->dec_hooks_index);
@@ -204,9 +352,12 @@ LUALIB_API lpb_State *lpb_lstate(lua_State *L) {
         LS->defs_index = LUA_NOREF;
         LS->enc_hooks_index = LUA_NOREF;
         LS->dec_hooks_index = LUA_NOREF;
-        LS->state = (NULL != global_state ? global_state : &LS->local);
+        LS->shared = lpb_acquireshared();
+        LS->state = LS->shared ? &LS->shared->state : &LS->local;
         pb_init(&LS->local);
         pb_initbuffer(&LS->buffer);
+        pb_initbuffer(&LS->sizes);
+        pb_initbuffer(&LS->descs);
         luaL_setmetatable(L, PB_STATE);
         lua_rawsetp(L, LUA_REGISTRYINDEX, state_name);
     }
@@ -276,10 +427,13 @@ static pb_Slice lpb_toslice(lua_State *L, int idx) {
     } else if (type == LUA_TUSERDATA) {
         pb_Buffer *buffer;
         pb_Slice *s;
+        lpb_Lazy *lz;
         if ((buffer = test_buffer(L, idx)) != NULL)
             return pb_result(buffer);
         else if ((s = test_slice(L, idx)) != NULL)
             return *s;
+        else if ((lz = test_lazy(L, idx)) != NULL && !lz->decoded)
+            return lz->s;
     }
     return pb_slice(NULL);
 }
@@ -483,47 +637,121 @@ static size_t lpb_addtype(lua_State *L, pb_Buffer *b, int idx, int type, int *pe
     return ret ? lpb_checkmem(L, len) : 0;
 }
 
-static void lpb_readtype(lua_State *L, lpb_State *LS, int type, pb_Slice *s) {
+static size_t lpb_varintsize(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) v >>= 7, ++n;
+    return n;
+}
+
+/* bytes lpb_addtype() would write, without writing them */
+static size_t lpb_typesize(lua_State *L, int idx, int type, int *pexist) {
+    int ret = 0, has_data = 1;
     lpb_Value v;
+    size_t len = 0;
     switch (type) {
+    case PB_Tbool:
+        len = 1, ret = 1;
+        if (!lua_toboolean(L, idx)) has_data = 0;
+        break;
+    case PB_Tdouble: case PB_Tfloat:
+        v.lnum = lua_tonumberx(L, idx, &ret);
+        len = type == PB_Tdouble ? 8 : 4;
+        if (v.lnum == 0.0) has_data = 0;
+        break;
+    case PB_Tfixed32: case PB_Tsfixed32:
+    case PB_Tfixed64: case PB_Tsfixed64:
+        v.u64 = lpb_tointegerx(L, idx, &ret);
+        len = type == PB_Tfixed32 || type == PB_Tsfixed32 ? 4 : 8;
+        if (v.u64 == 0) has_data = 0;
+        break;
+    case PB_Tint32:  case PB_Tuint32: case PB_Tsint32:
+    case PB_Tint64:  case PB_Tuint64: case PB_Tsint64:
+        v.u64 = lpb_tointegerx(L, idx, &ret);
+        switch (type) {
+        case PB_Tint32:  len = lpb_varintsize(pb_expandsig((uint32_t)v.u64)); break;
+        case PB_Tuint32: len = lpb_varintsize(v.u32); break;
+        case PB_Tsint32: len = lpb_varintsize(pb_encode_sint32(v.u32)); break;
+        case PB_Tsint64: len = lpb_varintsize(pb_encode_sint64(v.u64)); break;
+        default:         len = lpb_varintsize(v.u64); break;
+        }
+        if (v.u64 == 0) has_data = 0;
+        break;
+    case PB_Tbytes: case PB_Tstring:
+        *v.s = lpb_toslice(L, idx);
+        if ((ret = (v.s->p != NULL)))
+            len = lpb_varintsize(pb_len(*v.s)) + pb_len(*v.s);
+        if (pb_len(*v.s) == 0) has_data = 0;
+        break;
+    default:
+        lua_pushfstring(L, "unknown type %s", pb_typename(type, "<unknown>"));
+        if (idx > 0) luaL_argerror(L, idx, lua_tostring(L, -1));
+        lua_error(L);
+    }
+    if (pexist) *pexist = (ret && has_data);
+    return ret ? len : 0;
+}
+
 #define pushinteger(n,u) lpb_pushinteger((L), (n), (u), LS->int64_mode)
+
+/* pushes a scalar as read from the wire, fixed32 ones zero extended */
+static void lpb_pushwire(lua_State *L, lpb_State *LS, int type, uint64_t u64) {
+    switch (type) {
+    case PB_Tbool:   lua_pushboolean(L, u64 != 0); break;
+     /*case PB_Tenum:   pushinteger(u64); break; [> NOT REACHED <]*/
+    case PB_Tint32:  pushinteger((int32_t)u64, 0); break;
+    case PB_Tuint32: pushinteger((uint32_t)u64, 1); break;
+    case PB_Tsint32: pushinteger(pb_decode_sint32((uint32_t)u64), 0); break;
+    case PB_Tint64:  pushinteger((int64_t)u64, 0); break;
+    case PB_Tuint64: pushinteger((uint64_t)u64, 1); break;
+    case PB_Tsint64: pushinteger(pb_decode_sint64(u64), 0); break;
+    case PB_Tfloat:    lua_pushnumber(L, pb_decode_float((uint32_t)u64)); break;
+    case PB_Tfixed32:  pushinteger((uint32_t)u64, 1); break;
+    case PB_Tsfixed32: pushinteger((int32_t)(uint32_t)u64, 0); break;
+    case PB_Tdouble:   lua_pushnumber(L, pb_decode_double(u64)); break;
+    case PB_Tfixed64:  pushinteger(u64, 1); break;
+    case PB_Tsfixed64: pushinteger((int64_t)u64, 0); break;
+    }
+}
+
+/* reads up to n values of wire type wtype, as a packed field holds them */
+static size_t lpb_readwire(pb_Slice *s, int wtype, uint64_t *pv, size_t n) {
+    size_t i;
+    uint32_t u32;
+    if (wtype == PB_TVARINT) return pb_readvarints(s, pv, n);
+    for (i = 0; i < n; ++i) {
+        if (wtype == PB_T32BIT) {
+            if (pb_readfixed32(s, &u32) == 0) break;
+            pv[i] = u32;
+        } else if (pb_readfixed64(s, &pv[i]) == 0)
+            break;
+    }
+    return i;
+}
+
+static void lpb_readtype(lua_State *L, lpb_State *LS, int type, pb_Slice *s) {
+    lpb_Value v;
+    memset(&v, 0, sizeof(v));
+    switch (type) {
     case PB_Tbool:  case PB_Tenum:
     case PB_Tint32: case PB_Tuint32: case PB_Tsint32:
     case PB_Tint64: case PB_Tuint64: case PB_Tsint64:
         if (pb_readvarint64(s, &v.u64) == 0)
             luaL_error(L, "invalid varint value at offset %d", pb_pos(*s)+1);
-        switch (type) {
-        case PB_Tbool:   lua_pushboolean(L, v.u64 != 0); break;
-         /*case PB_Tenum:   pushinteger(v.u64); break; [> NOT REACHED <]*/
-        case PB_Tint32:  pushinteger((int32_t)v.u64, 0); break;
-        case PB_Tuint32: pushinteger((uint32_t)v.u64, 1); break;
-        case PB_Tsint32: pushinteger(pb_decode_sint32((uint32_t)v.u64), 0); break;
-        case PB_Tint64:  pushinteger((int64_t)v.u64, 0); break;
-        case PB_Tuint64: pushinteger((uint64_t)v.u64, 1); break;
-        case PB_Tsint64: pushinteger(pb_decode_sint64(v.u64), 0); break;
-        }
+        lpb_pushwire(L, LS, type, v.u64);
         break;
     case PB_Tfloat:
     case PB_Tfixed32:
     case PB_Tsfixed32:
         if (pb_readfixed32(s, &v.u32) == 0)
             luaL_error(L, "invalid fixed32 value at offset %d", pb_pos(*s)+1);
-        switch (type) {
-        case PB_Tfloat:    lua_pushnumber(L, pb_decode_float(v.u32)); break;
-        case PB_Tfixed32:  pushinteger(v.u32, 1); break;
-        case PB_Tsfixed32: pushinteger((int32_t)v.u32, 0); break;
-        }
+        lpb_pushwire(L, LS, type, v.u32);
         break;
     case PB_Tdouble:
     case PB_Tfixed64:
     case PB_Tsfixed64:
         if (pb_readfixed64(s, &v.u64) == 0)
             luaL_error(L, "invalid fixed64 value at offset %d", pb_pos(*s)+1);
-        switch (type) {
-        case PB_Tdouble:   lua_pushnumber(L, pb_decode_double(v.u64)); break;
-        case PB_Tfixed64:  pushinteger(v.u64, 1); break;
-        case PB_Tsfixed64: pushinteger((int64_t)v.u64, 0); break;
-        }
+        lpb_pushwire(L, LS, type, v.u64);
         break;
     case PB_Tbytes:
     case PB_Tstring:
@@ -537,6 +765,232 @@ static void lpb_readtype(lua_State *L, lpb_State *LS, int type, pb_Slice *s) {
 }
 
 
+/* packed arrays */
+
+/* With the decode_packed_array option, repeated numeric fields decode
+ * into a pb.Array instead of a table: the values stored as a C array of
+ * int32_t, uint32_t, int64_t, uint64_t, float, double or (bool) uint8_t,
+ * so native code (math3d, luaecs, ...) can take them from
+ * arr:pointer() in one go. pb.encode accepts a pb.Array wherever a
+ * repeated field takes a table. */
+
+typedef struct lpb_Array {
+    void  *data;   /* from the Lua allocator */
+    size_t count;
+    size_t cap;
+    int    type;   /* pb_FieldType of the elements */
+    int    esize;
+} lpb_Array;
+
+#define check_array(L,idx)  ((lpb_Array*)luaL_checkudata(L,idx,PB_ARRAY))
+#define test_array(L,idx)   ((lpb_Array*)luaL_testudata(L,idx,PB_ARRAY))
+
+static int lpb_arrayesize(int type) {
+    switch (type) {
+    case PB_Tbool:
+        return 1;
+    case PB_Tint32: case PB_Tuint32: case PB_Tsint32:
+    case PB_Tfixed32: case PB_Tsfixed32: case PB_Tfloat:
+        return 4;
+    case PB_Tint64: case PB_Tuint64: case PB_Tsint64:
+    case PB_Tfixed64: case PB_Tsfixed64: case PB_Tdouble:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static lpb_Array *lpb_testarray(lua_State *L, int idx)
+{ return lua_type(L, idx) == LUA_TUSERDATA ? test_array(L, idx) : NULL; }
+
+static lpb_Array *lpb_newarray(lua_State *L, int type) {
+    lpb_Array *a = (lpb_Array*)lua_newuserdata(L, sizeof(lpb_Array));
+    a->data = NULL, a->count = a->cap = 0;
+    a->type = type, a->esize = lpb_arrayesize(type);
+    luaL_setmetatable(L, PB_ARRAY);
+    return a;
+}
+
+/* room for n more elements, returns where they go */
+static char *lpb_arrayreserve(lua_State *L, lpb_Array *a, size_t n) {
+    if (n > a->cap - a->count) {
+        void *ud, *data;
+        lua_Alloc allocf = lua_getallocf(L, &ud);
+        size_t cap = a->cap < 8 ? 8 : a->cap;
+        while (cap - a->count < n) {
+            if (cap > PB_MAX_SIZET/2/(size_t)a->esize)
+                luaL_error(L, "array too big");
+            cap *= 2;
+        }
+        data = allocf(ud, a->data, a->cap*a->esize, cap*a->esize);
+        if (data == NULL) luaL_error(L, "out of memory");
+        a->data = data, a->cap = cap;
+    }
+    return (char*)a->data + a->count*a->esize;
+}
+
+/* stores v as read from the wire */
+static void lpb_arrayput(lpb_Array *a, size_t i, uint64_t v) {
+    char *p = (char*)a->data + i*a->esize;
+    switch (a->type) {
+    case PB_Tbool:     *(uint8_t*)p  = (v != 0); break;
+    case PB_Tint32:    *(int32_t*)p  = (int32_t)v; break;
+    case PB_Tsint32:   *(int32_t*)p  = pb_decode_sint32((uint32_t)v); break;
+    case PB_Tsfixed32: *(int32_t*)p  = (int32_t)(uint32_t)v; break;
+    case PB_Tuint32:
+    case PB_Tfixed32:  *(uint32_t*)p = (uint32_t)v; break;
+    case PB_Tfloat:    *(float*)p    = pb_decode_float((uint32_t)v); break;
+    case PB_Tsint64:   *(int64_t*)p  = pb_decode_sint64(v); break;
+    case PB_Tint64:
+    case PB_Tsfixed64: *(int64_t*)p  = (int64_t)v; break;
+    case PB_Tuint64:
+    case PB_Tfixed64:  *(uint64_t*)p = v; break;
+    case PB_Tdouble:   *(double*)p   = pb_decode_double(v); break;
+    }
+}
+
+/* the value of element i as it goes on the wire */
+static uint64_t lpb_arraywire(const lpb_Array *a, size_t i) {
+    const char *p = (const char*)a->data + i*a->esize;
+    switch (a->type) {
+    case PB_Tbool:     return *(const uint8_t*)p;
+    case PB_Tint32:    return pb_expandsig((uint32_t)*(const int32_t*)p);
+    case PB_Tsint32:   return pb_encode_sint32(*(const int32_t*)p);
+    case PB_Tsfixed32: return (uint32_t)*(const int32_t*)p;
+    case PB_Tuint32:
+    case PB_Tfixed32:  return *(const uint32_t*)p;
+    case PB_Tfloat:    return pb_encode_float(*(const float*)p);
+    case PB_Tsint64:   return pb_encode_sint64(*(const int64_t*)p);
+    case PB_Tint64:
+    case PB_Tsfixed64: return (uint64_t)*(const int64_t*)p;
+    case PB_Tuint64:
+    case PB_Tfixed64:  return *(const uint64_t*)p;
+    case PB_Tdouble:   return pb_encode_double(*(const double*)p);
+    }
+    return 0;
+}
+
+static void lpb_pusharrayitem(lua_State *L, lpb_State *LS, const lpb_Array *a, size_t i) {
+    const char *p = (const char*)a->data + i*a->esize;
+    switch (a->type) {
+    case PB_Tbool:     lua_pushboolean(L, *(const uint8_t*)p); break;
+    case PB_Tint32: case PB_Tsint32: case PB_Tsfixed32:
+        pushinteger(*(const int32_t*)p, 0); break;
+    case PB_Tuint32: case PB_Tfixed32:
+        pushinteger(*(const uint32_t*)p, 1); break;
+    case PB_Tint64: case PB_Tsint64: case PB_Tsfixed64:
+        pushinteger(*(const int64_t*)p, 0); break;
+    case PB_Tuint64: case PB_Tfixed64:
+        pushinteger((int64_t)*(const uint64_t*)p, 1); break;
+    case PB_Tfloat:    lua_pushnumber(L, *(const float*)p); break;
+    case PB_Tdouble:   lua_pushnumber(L, *(const double*)p); break;
+    }
+}
+
+static void lpb_arrayset(lua_State *L, lpb_Array *a, size_t i, int idx) {
+    char *p = (char*)a->data + i*a->esize;
+    switch (a->type) {
+    case PB_Tbool:   *(uint8_t*)p = (uint8_t)lua_toboolean(L, idx); break;
+    case PB_Tfloat:  *(float*)p = (float)luaL_checknumber(L, idx); break;
+    case PB_Tdouble: *(double*)p = (double)luaL_checknumber(L, idx); break;
+    default:
+        if (a->esize == 4)
+            *(uint32_t*)p = (uint32_t)lpb_checkinteger(L, idx);
+        else
+            *(uint64_t*)p = lpb_checkinteger(L, idx);
+    }
+}
+
+static int Lpb_array(lua_State *L) {
+    int type = pb_typebyname(luaL_checkstring(L, 1), PB_TNONE);
+    lpb_Array *a;
+    size_t i, n;
+    argcheck(L, lpb_arrayesize(type) != 0,
+            1, "numeric type expected, got '%s'", lua_tostring(L, 1));
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    a = lpb_newarray(L, type);
+    if (lua_isnil(L, 2)) return 1;
+    n = (size_t)lua_rawlen(L, 2);
+    lpb_arrayreserve(L, a, n);
+    for (i = 0; i < n; ++i) {
+        lua53_rawgeti(L, 2, (lua_Integer)i + 1);
+        lpb_arrayset(L, a, i, -1);
+        lua_pop(L, 1);
+        ++a->count;
+    }
+    return 1;
+}
+
+static int Larray_len(lua_State *L)
+{ return lua_pushinteger(L, (lua_Integer)check_array(L, 1)->count), 1; }
+
+static int Larray_index(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    lua_Integer i;
+    if (lua_type(L, 2) != LUA_TNUMBER) {
+        luaL_getmetatable(L, PB_ARRAY);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
+    }
+    i = luaL_checkinteger(L, 2);
+    if (i < 1 || (size_t)i > a->count) return 0;
+    lpb_pusharrayitem(L, lpb_lstate(L), a, (size_t)i - 1);
+    return 1;
+}
+
+static int Larray_newindex(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    argcheck(L, i >= 1 && (size_t)i <= a->count + 1,
+            2, "index %d out of range", (int)i);
+    if ((size_t)i > a->count) lpb_arrayreserve(L, a, 1);
+    lpb_arrayset(L, a, (size_t)i - 1, 3);
+    if ((size_t)i > a->count) ++a->count;
+    return 0;
+}
+
+static int Larray_pointer(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    lua_pushlightuserdata(L, a->data);
+    lua_pushinteger(L, (lua_Integer)a->count);
+    lua_pushinteger(L, (lua_Integer)a->esize);
+    return 3;
+}
+
+static int Larray_type(lua_State *L)
+{ return lua_pushstring(L, pb_typename(check_array(L, 1)->type, NULL)), 1; }
+
+static int Larray_totable(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    lpb_State *LS = lpb_lstate(L);
+    size_t i;
+    lua_createtable(L, (int)a->count, 0);
+    for (i = 0; i < a->count; ++i) {
+        lpb_pusharrayitem(L, LS, a, i);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    return 1;
+}
+
+static int Larray_tostring(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    lua_pushfstring(L, "pb.Array: %s[%d]: %p",
+            pb_typename(a->type, NULL), (int)a->count, a);
+    return 1;
+}
+
+static int Larray_gc(lua_State *L) {
+    lpb_Array *a = check_array(L, 1);
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    allocf(ud, a->data, a->cap*a->esize, 0);
+    a->data = NULL, a->count = a->cap = 0;
+    return 0;
+}
+
+
 /* io routines */
 
 #ifdef _WIN32
@@ -1231,10 +1685,209 @@ static const pb_Field *lpb_field(lua_State *L, int idx, const pb_Type *t) {
     return pb_fname(t, lpb_name(LS, lpb_checkslice(L, idx)));
 }
 
+/* compiled type plans */
+
+/* A message type gets its plan when it is first encoded or decoded, and
+ * pb.load builds them all up front: the fields sorted by number with the
+ * key of each already varint encoded, plus a number -> field index when
+ * the numbers are dense. Plans hang off the pb_Type, so a shared state
+ * shares them too. Any change to the types drops every plan and bumps
+ * lpb_plangen, which also flushes the per state key cache. */
+
+enum lpb_PlanKind { LPB_PFIELD, LPB_PREPEATED, LPB_PMAP, LPB_PDEAD };
+
+#define LPB_PLAN_SLACK 16 /* index holes allowed on top of one per field */
+
+struct lpb_PlanField {
+    const pb_Field *field;
+    const char     *name;
+    const char     *oneof;      /* oneof name, NULL if none */
+    unsigned        namelen;
+    unsigned        oneoflen;
+    unsigned char   kind;       /* lpb_PlanKind */
+    unsigned char   wtype;      /* wire type in key */
+    unsigned char   ignorezero; /* proto3 scalar, skipped when zero */
+    unsigned char   keylen;
+    char            key[5];     /* pb_pair(number, wtype) as varint */
+};
+
+struct pb_Plan {
+    lpb_PlanField *fields; /* sorted by number */
+    unsigned      *index;  /* number -> position in fields + 1 */
+    unsigned       count;
+    unsigned       dense;  /* index covers numbers below this */
+};
+
+static pb_Plan *lpb_newplan(pb_Type *t) {
+    pb_Field **list = pb_sortfield(t);
+    unsigned i, n = t->field_count, dense = 0;
+    pb_Plan *p;
+    if (n && list[n-1]->number >= 0
+            && (unsigned)list[n-1]->number <= n*2 + LPB_PLAN_SLACK)
+        dense = (unsigned)list[n-1]->number + 1;
+    p = (pb_Plan*)malloc(sizeof(pb_Plan)
+            + n*sizeof(lpb_PlanField) + dense*sizeof(unsigned));
+    if (p == NULL) return NULL;
+    p->fields = (lpb_PlanField*)(p + 1);
+    p->index = (unsigned*)(p->fields + n);
+    p->count = n, p->dense = dense;
+    if (dense) memset(p->index, 0, dense*sizeof(unsigned));
+    for (i = 0; i < n; ++i) {
+        const pb_Field *f = list[i];
+        const pb_Name *oneof = f->oneof_idx ?
+            pb_oneofname(t, f->oneof_idx) : NULL;
+        lpb_PlanField *pf = &p->fields[i];
+        uint32_t key;
+        pf->field = f;
+        pf->name = (const char*)f->name;
+        pf->namelen = (unsigned)strlen(pf->name);
+        pf->oneof = (const char*)oneof;
+        pf->oneoflen = oneof ? (unsigned)strlen(pf->oneof) : 0;
+        if (f->type && f->type->is_map)  pf->kind = LPB_PMAP;
+        else if (f->repeated)            pf->kind = LPB_PREPEATED;
+        else if (f->type && f->type->is_dead) pf->kind = LPB_PDEAD;
+        else                             pf->kind = LPB_PFIELD;
+        pf->wtype = (unsigned char)(pf->kind == LPB_PMAP
+                || (pf->kind == LPB_PREPEATED && f->packed) ?
+                PB_TBYTES : pb_wtypebytype(f->type_id));
+        pf->ignorezero = t->is_proto3 && !f->oneof_idx
+            && f->type_id != PB_Tmessage;
+        key = pb_pair(f->number, pf->wtype);
+        for (pf->keylen = 0; key >= 0x80; key >>= 7)
+            pf->key[pf->keylen++] = (char)((key & 0x7F) | 0x80);
+        pf->key[pf->keylen++] = (char)key;
+        if (dense) p->index[f->number] = i + 1;
+    }
+    return p;
+}
+
+static const pb_Plan *lpb_plan(lua_State *L, const pb_Type *t) {
+    if (t->plan == NULL
+            && (((pb_Type*)t)->plan = lpb_newplan((pb_Type*)t)) == NULL)
+        luaL_error(L, "out of memory");
+    return t->plan;
+}
+
+static void lpb_resetplans(lua_State *L, const pb_State *S, int rebuild) {
+    const pb_Type *t = NULL;
+    lpb_atominc(&lpb_plangen);
+    while (pb_nexttype(S, &t)) {
+        pb_delsort((pb_Type*)t);
+        if (rebuild) lpb_plan(L, t);
+    }
+}
+
+static const lpb_PlanField *lpb_planfield(const pb_Plan *p, uint32_t number) {
+    unsigned lo = 0, hi = p->count;
+    if (p->dense) {
+        if (number >= p->dense || p->index[number] == 0) return NULL;
+        return &p->fields[p->index[number] - 1];
+    }
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        uint32_t n = (uint32_t)p->fields[mid].field->number;
+        if (n == number) return &p->fields[mid];
+        if (n < number) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+/* Lua interns short strings, so the same key string keeps coming back
+ * at the same address: remember the field last found for it and skip
+ * the name hashing. The address alone may be reused by another string
+ * after a collection, hence the name compare on a hit. */
+static const lpb_PlanField *lpb_planbykey(lpb_State *LS, const pb_Type *t, const pb_Plan *p, pb_Slice key) {
+    size_t h = ((size_t)key.p ^ ((size_t)t >> 4)) * 2654435761u;
+    lpb_KeySlot *slot = &LS->keys[(h >> 8) & (LPB_KEYCACHE_SIZE-1)];
+    const pb_Field *f;
+    if (LS->plan_gen != lpb_plangen) {
+        memset(LS->keys, 0, sizeof(LS->keys));
+        LS->plan_gen = lpb_plangen;
+    }
+    if (slot->key == key.p && slot->type == t
+            && slot->pf->namelen == pb_len(key)
+            && memcmp(slot->pf->name, key.p, pb_len(key)) == 0)
+        return slot->pf;
+    if ((f = pb_fname(t, lpb_name(LS, key))) == NULL)
+        return NULL;
+    slot->key = key.p, slot->type = t;
+    return slot->pf = &p->fields[f->sort_index - 1];
+}
+
+/* name of the .proto file a FileDescriptorProto describes */
+static pb_Slice lpb_descname(pb_Slice file) {
+    pb_Slice name = pb_lslice(NULL, 0);
+    uint32_t tag;
+    while (pb_readvarint32(&file, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES)) {
+            pb_readbytes(&file, &name);
+            break;
+        }
+        if (pb_skipvalue(&file, tag) == 0) break;
+    }
+    return name;
+}
+
+static int lpb_samedesc(pb_Slice a, pb_Slice b) {
+    pb_Slice na = lpb_descname(a), nb = lpb_descname(b);
+    return pb_len(na) == pb_len(nb) && memcmp(na.p, nb.p, pb_len(na)) == 0;
+}
+
+/* is a file of the same name as file among the entries in list? */
+static int lpb_hasdesc(pb_Slice list, pb_Slice file) {
+    pb_Slice e;
+    while (pb_readbytes(&list, &e))
+        if (lpb_samedesc(e, file)) return 1;
+    return 0;
+}
+
+/* appends the files of descriptor set s to b, one entry each */
+static void lpb_adddescs(lua_State *L, pb_Buffer *b, pb_Slice s) {
+    pb_Slice file;
+    uint32_t tag;
+    while (pb_readvarint32(&s, &tag)) {
+        if (tag != pb_pair(1, PB_TBYTES)) {
+            if (pb_skipvalue(&s, tag) == 0) break;
+            continue;
+        }
+        if (pb_readbytes(&s, &file) == 0) break;
+        lpb_checkmem(L, pb_addbytes(b, file));
+    }
+}
+
+/* entries of base then of add into b; a later file of the same name wins */
+static void lpb_mergedescs(lua_State *L, pb_Buffer *b, pb_Slice base, pb_Slice add) {
+    pb_Slice e;
+    while (pb_readbytes(&base, &e))
+        if (!lpb_hasdesc(add, e)) lpb_checkmem(L, pb_addbytes(b, e));
+    while (pb_readbytes(&add, &e)) /* add now holds the later entries */
+        if (!lpb_hasdesc(add, e)) lpb_checkmem(L, pb_addbytes(b, e));
+}
+
+/* loads every entry of list into S */
+static int lpb_loaddescs(lua_State *L, pb_State *S, pb_Slice list) {
+    pb_Buffer b;
+    pb_Slice e, set;
+    int r = PB_OK;
+    pb_initbuffer(&b);
+    while (r == PB_OK && pb_readbytes(&list, &e)) {
+        pb_bufflen(&b) = 0;
+        if (pb_addvarint32(&b, pb_pair(1, PB_TBYTES)) == 0
+                || pb_addbytes(&b, e) == 0)
+            return pb_resetbuffer(&b), luaL_error(L, "out of memory");
+        set = pb_result(&b);
+        r = pb_load(S, &set);
+    }
+    pb_resetbuffer(&b);
+    return r;
+}
+
 static int Lpb_load(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
-    pb_Slice s = lpb_checkslice(L, 1);
+    pb_Slice s = lpb_checkslice(L, 1), data = s;
     int r = pb_load(&LS->local, &s);
+    if (r == PB_OK) lpb_adddescs(L, &LS->descs, data);
+    lpb_resetplans(L, &LS->local, 1);
     lua_pushboolean(L, r == PB_OK);
     lua_pushinteger(L, pb_pos(s)+1);
     return 2;
@@ -1260,7 +1913,9 @@ static int Lpb_loadfile(lua_State *L) {
     fclose(fp);
     s = pb_result(&b);
     ret = pb_load(&LS->local, &s);
+    if (ret == PB_OK) lpb_adddescs(L, &LS->descs, pb_result(&b));
     pb_resetbuffer(&b);
+    lpb_resetplans(L, &LS->local, 1);
     lua_pushboolean(L, ret == PB_OK);
     lua_pushinteger(L, pb_pos(s)+1);
     return 2;
@@ -1521,6 +2176,9 @@ static int Lpb_clear(lua_State *L) {
     pb_Type *t;
     if (lua_isnoneornil(L, 1)) {
         pb_free(&LS->local), pb_init(&LS->local);
+        pb_resetbuffer(&LS->descs);
+        lpb_atominc(&lpb_plangen);
+        ++LS->free_gen;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         LS->defs_index = LUA_NOREF;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
@@ -1533,6 +2191,7 @@ static int Lpb_clear(lua_State *L) {
     t = (pb_Type*)lpb_type(L, LS, lpb_checkslice(L, 1));
     if (lua_isnoneornil(L, 2)) pb_deltype(&LS->local, t);
     else pb_delfield(&LS->local, t, (pb_Field*)lpb_field(L, 2, t));
+    lpb_resetplans(L, &LS->local, 0);
     LS->state = S;
     lpb_cleardefmeta(L, LS, t);
     return 0;
@@ -1574,9 +2233,17 @@ typedef struct lpb_Env {
     lpb_State *LS;
     pb_Buffer *b;
     pb_Slice *s;
+    pb_Buffer *sizes;  /* lengths from lpbE_presize(), NULL if none */
+    unsigned sizepos;
+    int anchor; /* stack index of the bytes lazy messages point into */
+    lpb_Shared *shared; /* snapshot the types come from, for lazy messages */
 } lpb_Env;
 
 static void lpbE_encode (lpb_Env *e, const pb_Type *t, int idx);
+static void lpb_pushlazytable(lua_State *L, lpb_Lazy *lz);
+
+static lpb_Lazy *lpb_testlazy(lua_State *L, int idx)
+{ return lua_type(L, idx) == LUA_TUSERDATA ? test_lazy(L, idx) : NULL; }
 
 static void lpb_checktable(lua_State *L, const pb_Field *f, int idx) {
     argcheck(L, lua_istable(L, idx),
@@ -1597,6 +2264,34 @@ static void lpb_useenchooks(lua_State *L, lpb_State *LS, const pb_Type *t) {
     lua_pop(L, 2);
 }
 
+static unsigned lpbE_getsize(lpb_Env *e, unsigned slot) {
+    unsigned len;
+    memcpy(&len, pb_buffer(e->sizes) + slot*sizeof(unsigned), sizeof(len));
+    return len;
+}
+
+/* Starts a length delimited value and returns where its body begins.
+ * Without a presize pass a one byte placeholder goes in and
+ * lpbE_closelen() moves the body when the length needs more. */
+static size_t lpbE_openlen(lpb_Env *e, unsigned *slot) {
+    if (e->sizes == NULL)
+        lpb_checkmem(e->L, pb_addvarint32(e->b, 0));
+    else {
+        *slot = e->sizepos++;
+        lpb_checkmem(e->L, pb_addvarint32(e->b, lpbE_getsize(e, *slot)));
+    }
+    return pb_bufflen(e->b);
+}
+
+static size_t lpbE_closelen(lpb_Env *e, size_t len, unsigned slot) {
+    size_t body;
+    if (e->sizes == NULL) return lpb_addlength(e->L, e->b, len, 1);
+    body = pb_bufflen(e->b) - len;
+    if (body != lpbE_getsize(e, slot))
+        luaL_error(e->L, "message changed while encoding");
+    return lpb_varintsize(body) + body;
+}
+
 static size_t lpbE_enum(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
@@ -1628,6 +2323,8 @@ static size_t lpbE_enum(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
 static size_t lpbE_field(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
+    lpb_Lazy *lz;
+    unsigned slot = 0;
     size_t len;
     switch (f->type_id) {
     case PB_Tenum:
@@ -1636,12 +2333,21 @@ static size_t lpbE_field(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
 
     case PB_Tmessage:
         if (e->LS->use_enc_hooks) lpb_useenchooks(L, e->LS, f->type);
+        if ((lz = lpb_testlazy(L, idx)) != NULL) {
+            if (!lz->decoded && lz->t == f->type) { /* untouched, copy */
+                if (pexist) *pexist = (pb_len(lz->s) > 0);
+                return lpb_checkmem(L, pb_addbytes(b, lz->s));
+            }
+            lpb_pushlazytable(L, lz);
+            idx = -1;
+        }
         lpb_checktable(L, f, idx);
-        lpb_checkmem(L, pb_addvarint32(b, 0));
-        len = pb_bufflen(b);
+        len = lpbE_openlen(e, &slot);
         lpbE_encode(e, f->type, idx);
         if (pexist) *pexist = (len < pb_bufflen(b));
-        return lpb_addlength(L, b, len, 1);
+        len = lpbE_closelen(e, len, slot);
+        if (lz != NULL) lua_pop(L, 1);
+        return len;
 
     default:
         len = lpb_addtype(L, b, idx, f->type_id, pexist);
@@ -1653,45 +2359,98 @@ static size_t lpbE_field(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
     }
 }
 
-static void lpbE_tagfield(lpb_Env *e, const pb_Field *f, int ignorezero, int idx) {
-    size_t hlen = lpb_checkmem(e->L, pb_addvarint32(e->b,
-            pb_pair(f->number, pb_wtypebytype(f->type_id))));
+static size_t lpbE_addkey(lpb_Env *e, const lpb_PlanField *pf)
+{ return lpb_checkmem(e->L, pb_addslice(e->b, pb_lslice(pf->key, pf->keylen))); }
+
+static void lpbE_keyfield(lpb_Env *e, const lpb_PlanField *pf, int ignorezero, int idx) {
+    size_t hlen = lpbE_addkey(e, pf);
     int exist;
-    size_t ignoredlen = lpbE_field(e, f, &exist, idx);
+    size_t ignoredlen = lpbE_field(e, pf->field, &exist, idx);
     if (!e->LS->encode_default_values && !exist && ignorezero)
         e->b->size -= (unsigned)(ignoredlen + hlen);
 }
 
-static void lpbE_map(lpb_Env *e, const pb_Field *f, int idx) {
+static void lpbE_map(lpb_Env *e, const lpb_PlanField *pf, int idx) {
     lua_State *L = e->L;
-    const pb_Field *kf = pb_field(f->type, 1);
-    const pb_Field *vf = pb_field(f->type, 2);
+    const pb_Plan *p = lpb_plan(L, pf->field->type);
+    const lpb_PlanField *kf = lpb_planfield(p, 1);
+    const lpb_PlanField *vf = lpb_planfield(p, 2);
     if (kf == NULL || vf == NULL) return;
-    lpb_checktable(L, f, idx);
+    lpb_checktable(L, pf->field, idx);
     lua_pushnil(L);
     while (lua_next(L, lpb_relindex(idx, 1))) {
+        unsigned slot = 0;
         size_t len;
-        lpb_checkmem(L, pb_addvarint32(e->b, pb_pair(f->number, PB_TBYTES)));
-        lpb_checkmem(L, pb_addvarint32(e->b, 0));
-        len = pb_bufflen(e->b);
-        lpbE_tagfield(e, kf, 1, -2);
-        lpbE_tagfield(e, vf, 1, -1);
-        lpb_addlength(L, e->b, len, 1);
+        lpbE_addkey(e, pf);
+        len = lpbE_openlen(e, &slot);
+        lpbE_keyfield(e, kf, 1, -2);
+        lpbE_keyfield(e, vf, 1, -1);
+        lpbE_closelen(e, len, slot);
         lua_pop(L, 1);
     }
 }
 
-static void lpbE_repeated(lpb_Env *e, const pb_Field *f, int idx) {
+static void lpbE_addwire(lpb_Env *e, int wtype, uint64_t v) {
+    switch (wtype) {
+    case PB_TVARINT: lpb_checkmem(e->L, pb_addvarint64(e->b, v)); break;
+    case PB_T32BIT:  lpb_checkmem(e->L, pb_addfixed32(e->b, (uint32_t)v)); break;
+    default:         lpb_checkmem(e->L, pb_addfixed64(e->b, v)); break;
+    }
+}
+
+/* a pb.Array goes out without a trip through Lua values, unless it holds
+ * another type than the field */
+static void lpbE_array(lpb_Env *e, const lpb_PlanField *pf, const lpb_Array *a) {
+    lua_State *L = e->L;
+    const pb_Field *f = pf->field;
+    int wtype = pb_wtypebytype(f->type_id);
+    uint64_t v[64];
+    size_t i, j, n, len = 0;
+    unsigned slot = 0;
+    if (f->packed) {
+        if (a->count == 0 && !e->LS->encode_default_values) return;
+        lpbE_addkey(e, pf);
+        len = lpbE_openlen(e, &slot);
+    }
+    for (i = 0; i < a->count; i += n) {
+        n = a->count - i < 64 ? a->count - i : 64;
+        if (a->type != f->type_id) {
+            for (j = i; j < i + n; ++j) {
+                lpb_pusharrayitem(L, e->LS, a, j);
+                if (f->packed) lpbE_field(e, f, NULL, -1);
+                else lpbE_keyfield(e, pf, 0, -1);
+                lua_pop(L, 1);
+            }
+            continue;
+        }
+        for (j = 0; j < n; ++j)
+            v[j] = lpb_arraywire(a, i + j);
+        if (f->packed && wtype == PB_TVARINT)
+            lpb_checkmem(L, pb_addvarints(e->b, v, n));
+        else for (j = 0; j < n; ++j) {
+            if (!f->packed) lpbE_addkey(e, pf);
+            lpbE_addwire(e, wtype, v[j]);
+        }
+    }
+    if (f->packed) lpbE_closelen(e, len, slot);
+}
+
+static void lpbE_repeated(lpb_Env *e, const lpb_PlanField *pf, int idx) {
     lua_State *L = e->L;
+    const pb_Field *f = pf->field;
     pb_Buffer *b = e->b;
+    lpb_Array *a = lpb_testarray(L, idx);
     int i;
+    if (a != NULL) {
+        lpbE_array(e, pf, a);
+        return;
+    }
     lpb_checktable(L, f, idx);
 
     if (f->packed) {
-        unsigned len, bufflen = pb_bufflen(b);
-        lpb_checkmem(L, pb_addvarint32(b, pb_pair(f->number, PB_TBYTES)));
-        lpb_checkmem(L, pb_addvarint32(b, 0));
-        len = pb_bufflen(b);
+        unsigned len, slot = 0, bufflen = pb_bufflen(b);
+        lpbE_addkey(e, pf);
+        len = (unsigned)lpbE_openlen(e, &slot);
         for (i = 1; lua53_rawgeti(L, idx, i) != LUA_TNIL; ++i) {
             lpbE_field(e, f, NULL, -1);
             lua_pop(L, 1);
@@ -1699,87 +2458,369 @@ static void lpbE_repeated(lpb_Env *e, const pb_Field *f, int idx) {
         if (i == 1 && !e->LS->encode_default_values)
             pb_bufflen(b) = bufflen;
         else
-            lpb_addlength(L, b, len, 1);
+            lpbE_closelen(e, len, slot);
     } else {
         for (i = 1; lua53_rawgeti(L, idx, i) != LUA_TNIL; ++i) {
-            lpbE_tagfield(e, f, 0, -1);
+            lpbE_keyfield(e, pf, 0, -1);
             lua_pop(L, 1);
         }
     }
     lua_pop(L, 1);
 }
 
+static void lpbE_planfield(lpb_Env *e, const lpb_PlanField *pf, int idx) {
+    switch (pf->kind) {
+    case LPB_PMAP:      lpbE_map(e, pf, idx); break;
+    case LPB_PREPEATED: lpbE_repeated(e, pf, idx); break;
+    case LPB_PFIELD:    lpbE_keyfield(e, pf, pf->ignorezero, idx); break;
+    default:            break; /* message type cleared */
+    }
+}
+
 static void lpb_encode_onefield(lpb_Env *e, const pb_Type *t, const pb_Field *f, int idx) {
-    if (f->type && f->type->is_map)
-        lpbE_map(e, f, idx);
-    else if (f->repeated)
-        lpbE_repeated(e, f, idx);
-    else if (!f->type || !f->type->is_dead)
-        lpbE_tagfield(e, f, t->is_proto3 && !f->oneof_idx && f->type_id != PB_Tmessage, idx);
+    const pb_Plan *p = lpb_plan(e->L, t);
+    lpbE_planfield(e, &p->fields[f->sort_index - 1], idx);
 }
 
 static void lpbE_encode(lpb_Env *e, const pb_Type *t, int idx) {
     lua_State *L = e->L;
+    const pb_Plan *p = lpb_plan(L, t);
     luaL_checkstack(L, 5, "message too many levels");
     if (e->LS->encode_order) {
-        const pb_Field *f = NULL;
-        while (pb_nextfield(t, &f)) {
-            if (lua53_getfield(L, idx, (const char*)f->name) != LUA_TNIL)
-                lpb_encode_onefield(e, t, f, -1);
+        unsigned i;
+        for (i = 0; i < p->count; ++i) {
+            if (lua53_getfield(L, idx, p->fields[i].name) != LUA_TNIL)
+                lpbE_planfield(e, &p->fields[i], -1);
             lua_pop(L, 1);
         }
     } else {
         lua_pushnil(L);
         while (lua_next(L, lpb_relindex(idx, 1))) {
             if (lua_type(L, -2) == LUA_TSTRING) {
-                const pb_Field *f =
-                    pb_fname(t, lpb_name(e->LS, lpb_toslice(L, -2)));
-                if (f != NULL) lpb_encode_onefield(e, t, f, -1);
+                const lpb_PlanField *pf =
+                    lpb_planbykey(e->LS, t, p, lpb_toslice(L, -2));
+                if (pf != NULL) lpbE_planfield(e, pf, -1);
             }
             lua_pop(L, 1);
         }
     }
 }
 
-static int Lpb_encode(lua_State *L) {
-    lpb_State *LS = lpb_lstate(L);
-    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
-    lpb_Env e;
-    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
-    luaL_checktype(L, 2, LUA_TTABLE);
-    e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
-    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
-    lua_pushvalue(L, 2);
-    if (e.LS->use_enc_hooks) lpb_useenchooks(L, e.LS, t);
-    lpbE_encode(&e, t, -1);
-    if (e.b != &LS->buffer)
-        lua_settop(L, 3);
-    else {
-        lua_pushlstring(L, pb_buffer(e.b), pb_bufflen(e.b));
-        pb_resetbuffer(e.b);
-    }
-    return 1;
+/* presize pass: walks the table the way the writer will and records
+ * the length of every length delimited value, in the order the writer
+ * opens them, so each length is written once and never moved. Values the
+ * writer rejects are sized as empty; the write pass raises the error. */
+
+#define LPB_PRESIZE_SLACK 16 /* proto3 zero field written, then dropped */
+
+static size_t lpbE_encodesize(lpb_Env *e, const pb_Type *t, int idx);
+
+static unsigned lpbE_pushsize(lpb_Env *e) {
+    unsigned slot = pb_bufflen(e->sizes) / sizeof(unsigned);
+    lpb_checkmem(e->L, pb_prepbuffsize(e->sizes, sizeof(unsigned)) != NULL);
+    pb_addsize(e->sizes, sizeof(unsigned));
+    return slot;
 }
 
-static int lpbE_pack(lpb_Env* e, const pb_Type* t, int idx) {
-    unsigned i;
-    lua_State* L = e->L;
-    pb_Field** f = pb_sortfield((pb_Type*)t);
-    for (i = 0; i < t->field_count; i++) {
-        int index = idx + i;
-        if (!lua_isnoneornil(L, index)) {
-            lpb_encode_onefield(e, t, f[i], index);
-        }
-    }
-    return 0;
+static size_t lpbE_setsize(lpb_Env *e, unsigned slot, size_t len) {
+    unsigned v = (unsigned)len;
+    memcpy(pb_buffer(e->sizes) + slot*sizeof(unsigned), &v, sizeof(v));
+    return lpb_varintsize(len) + len;
 }
 
-static int Lpb_pack(lua_State* L) {
-    lpb_State* LS = lpb_lstate(L);
+static size_t lpbE_enumsize(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
+    lua_State *L = e->L;
+    const pb_Field *ev;
+    int type = lua_type(L, idx);
+    uint64_t v = 0;
+    if (type == LUA_TNUMBER)
+        v = (uint64_t)lua_tonumber(L, idx);
+    else if ((ev = pb_fname(f->type,
+                    lpb_name(e->LS, lpb_toslice(L, idx)))) != NULL)
+        v = (uint32_t)ev->number;
+    else if (type == LUA_TSTRING)
+        v = lpb_tointegerx(L, idx, &type);
+    if (pexist) *pexist = (v != 0);
+    return lpb_varintsize(v);
+}
+
+static size_t lpbE_fieldsize(lpb_Env *e, const pb_Field *f, int *pexist, int idx) {
+    lpb_Lazy *lz;
+    unsigned slot;
+    size_t len;
+    switch (f->type_id) {
+    case PB_Tenum:
+        return lpbE_enumsize(e, f, pexist, idx);
+    case PB_Tmessage:
+        if ((lz = lpb_testlazy(e->L, idx)) != NULL
+                && !lz->decoded && lz->t == f->type) {
+            if (pexist) *pexist = (pb_len(lz->s) > 0);
+            return lpb_varintsize(pb_len(lz->s)) + pb_len(lz->s);
+        }
+        slot = lpbE_pushsize(e);
+        if (lz != NULL) {
+            lpb_pushlazytable(e->L, lz);
+            len = lpbE_encodesize(e, f->type, -1);
+            lua_pop(e->L, 1);
+        } else if (lua_istable(e->L, idx))
+            len = lpbE_encodesize(e, f->type, idx);
+        else
+            len = 0;
+        if (pexist) *pexist = (len != 0);
+        return lpbE_setsize(e, slot, len);
+    default:
+        return lpb_typesize(e->L, idx, f->type_id, pexist);
+    }
+}
+
+static size_t lpbE_keyfieldsize(lpb_Env *e, const lpb_PlanField *pf, int ignorezero, int idx) {
+    int exist;
+    size_t len = lpbE_fieldsize(e, pf->field, &exist, idx);
+    if (!e->LS->encode_default_values && !exist && ignorezero)
+        return 0;
+    return pf->keylen + len;
+}
+
+static size_t lpbE_mapsize(lpb_Env *e, const lpb_PlanField *pf, int idx) {
+    lua_State *L = e->L;
+    const pb_Plan *p = lpb_plan(L, pf->field->type);
+    const lpb_PlanField *kf = lpb_planfield(p, 1);
+    const lpb_PlanField *vf = lpb_planfield(p, 2);
+    size_t size = 0;
+    if (kf == NULL || vf == NULL || !lua_istable(L, idx)) return 0;
+    lua_pushnil(L);
+    while (lua_next(L, lpb_relindex(idx, 1))) {
+        unsigned slot = lpbE_pushsize(e);
+        size_t len = lpbE_keyfieldsize(e, kf, 1, -2);
+        len += lpbE_keyfieldsize(e, vf, 1, -1);
+        size += pf->keylen + lpbE_setsize(e, slot, len);
+        lua_pop(L, 1);
+    }
+    return size;
+}
+
+static size_t lpbE_arraysize(lpb_Env *e, const lpb_PlanField *pf, const lpb_Array *a) {
+    lua_State *L = e->L;
+    const pb_Field *f = pf->field;
+    int wtype = pb_wtypebytype(f->type_id);
+    size_t i, size = 0;
+    unsigned slot = 0;
+    if (f->packed) {
+        if (a->count == 0 && !e->LS->encode_default_values) return 0;
+        slot = lpbE_pushsize(e);
+    }
+    for (i = 0; i < a->count; ++i) {
+        if (a->type != f->type_id) {
+            lpb_pusharrayitem(L, e->LS, a, i);
+            size += f->packed ? lpbE_fieldsize(e, f, NULL, -1)
+                : lpbE_keyfieldsize(e, pf, 0, -1);
+            lua_pop(L, 1);
+            continue;
+        }
+        size += wtype == PB_TVARINT ? lpb_varintsize(lpb_arraywire(a, i))
+            : wtype == PB_T32BIT ? 4 : 8;
+        if (!f->packed) size += pf->keylen;
+    }
+    if (f->packed) size = lpbE_setsize(e, slot, size) + pf->keylen;
+    return size;
+}
+
+static size_t lpbE_repeatedsize(lpb_Env *e, const lpb_PlanField *pf, int idx) {
+    lua_State *L = e->L;
+    const pb_Field *f = pf->field;
+    size_t size = 0;
+    lpb_Array *a = lpb_testarray(L, idx);
+    int i;
+    if (a != NULL) return lpbE_arraysize(e, pf, a);
+    if (!lua_istable(L, idx)) return 0;
+    if (f->packed) {
+        unsigned slot = lpbE_pushsize(e);
+        for (i = 1; lua53_rawgeti(L, idx, i) != LUA_TNIL; ++i) {
+            size += lpbE_fieldsize(e, f, NULL, -1);
+            lua_pop(L, 1);
+        }
+        size = lpbE_setsize(e, slot, size);
+        if (i == 1 && !e->LS->encode_default_values)
+            size = 0;
+        else
+            size += pf->keylen;
+    } else {
+        for (i = 1; lua53_rawgeti(L, idx, i) != LUA_TNIL; ++i) {
+            size += lpbE_keyfieldsize(e, pf, 0, -1);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    return size;
+}
+
+static size_t lpbE_planfieldsize(lpb_Env *e, const lpb_PlanField *pf, int idx) {
+    switch (pf->kind) {
+    case LPB_PMAP:      return lpbE_mapsize(e, pf, idx);
+    case LPB_PREPEATED: return lpbE_repeatedsize(e, pf, idx);
+    case LPB_PFIELD:    return lpbE_keyfieldsize(e, pf, pf->ignorezero, idx);
+    default:            return 0;
+    }
+}
+
+static size_t lpbE_encodesize(lpb_Env *e, const pb_Type *t, int idx) {
+    lua_State *L = e->L;
+    const pb_Plan *p = lpb_plan(L, t);
+    size_t size = 0;
+    luaL_checkstack(L, 5, "message too many levels");
+    if (e->LS->encode_order) {
+        unsigned i;
+        for (i = 0; i < p->count; ++i) {
+            if (lua53_getfield(L, idx, p->fields[i].name) != LUA_TNIL)
+                size += lpbE_planfieldsize(e, &p->fields[i], -1);
+            lua_pop(L, 1);
+        }
+    } else {
+        lua_pushnil(L);
+        while (lua_next(L, lpb_relindex(idx, 1))) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                const lpb_PlanField *pf =
+                    lpb_planbykey(e->LS, t, p, lpb_toslice(L, -2));
+                if (pf != NULL) size += lpbE_planfieldsize(e, pf, -1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    return size;
+}
+
+static size_t lpbE_presize(lpb_Env *e, const pb_Type *t, int idx) {
+    e->sizes = &e->LS->sizes, e->sizepos = 0;
+    pb_bufflen(e->sizes) = 0;
+    return lpbE_encodesize(e, t, idx);
+}
+
+static int Lpb_encode(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Env e;
+    lpb_Lazy *lz = lpb_testlazy(L, 2);
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    e.L = L, e.LS = LS, e.b = test_buffer(L, 3), e.sizes = NULL;
+    if (lz != NULL && !lz->decoded && lz->t == t && !LS->use_enc_hooks) {
+        if (e.b == NULL) return push_slice(L, lz->s), 1;
+        lpb_checkmem(L, pb_addslice(e.b, lz->s));
+        return lua_settop(L, 3), 1;
+    }
+    if (lz != NULL) lpb_pushlazytable(L, lz), lua_replace(L, 2);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    lua_pushvalue(L, 2);
+    if (e.LS->use_enc_hooks)
+        lpb_useenchooks(L, e.LS, t); /* hooks may not run twice */
+    else if (e.LS->encode_presize) {
+        size_t size = lpbE_presize(&e, t, -1) + LPB_PRESIZE_SLACK;
+        lpb_checkmem(L, pb_prepbuffsize(e.b, size) != NULL);
+    }
+    lpbE_encode(&e, t, -1);
+    if (e.b != &LS->buffer)
+        lua_settop(L, 3);
+    else {
+        lua_pushlstring(L, pb_buffer(e.b), pb_bufflen(e.b));
+        pb_resetbuffer(e.b);
+    }
+    return 1;
+}
+
+static int Lpb_encode_size(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Env e;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    e.L = L, e.LS = LS, e.b = &LS->buffer, e.sizes = NULL;
+    lua_pushvalue(L, 2);
+    if (LS->use_enc_hooks) { /* hooks may change the values, really encode */
+        pb_resetbuffer(e.b);
+        lpb_useenchooks(L, LS, t);
+        lpbE_encode(&e, t, -1);
+        lua_pushinteger(L, (lua_Integer)pb_bufflen(e.b));
+        pb_resetbuffer(e.b);
+    } else
+        lua_pushinteger(L, (lua_Integer)lpbE_presize(&e, t, -1));
+    return 1;
+}
+
+/* messages each behind their varint length, as writeDelimitedTo() */
+static void lpbE_delimited(lpb_Env *e, const pb_Type *t) {
+    lua_State *L = e->L;
+    lpb_Lazy *lz = lpb_testlazy(L, -1);
+    size_t len;
+    unsigned slot = 0;
+    if (lz != NULL) {
+        if (!lz->decoded && lz->t == t) {
+            lpb_checkmem(L, pb_addbytes(e->b, lz->s));
+            return;
+        }
+        lpb_pushlazytable(L, lz), lua_replace(L, -2);
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pushfstring(L, "table expected in list, got %s",
+                luaL_typename(L, -1));
+        luaL_argerror(L, 2, lua_tostring(L, -1));
+    }
+    if (e->LS->encode_presize && !e->LS->use_enc_hooks) {
+        len = lpbE_presize(e, t, -1);
+        lpb_checkmem(L, pb_prepbuffsize(e->b,
+                    len + LPB_PRESIZE_SLACK + 10) != NULL);
+        lpb_checkmem(L, pb_addvarint64(e->b, len));
+        lpbE_encode(e, t, -1);
+        e->sizes = NULL;
+        return;
+    }
+    len = lpbE_openlen(e, &slot);
+    lpbE_encode(e, t, -1);
+    lpbE_closelen(e, len, slot);
+}
+
+static int Lpb_encode_stream(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Env e;
+    lua_Integer i, n;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    e.L = L, e.LS = LS, e.b = test_buffer(L, 3), e.sizes = NULL;
+    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    lua_settop(L, 3);
+    n = (lua_Integer)lua_rawlen(L, 2);
+    for (i = 1; i <= n; ++i) {
+        lua53_rawgeti(L, 2, i);
+        if (LS->use_enc_hooks) lpb_useenchooks(L, LS, t);
+        lpbE_delimited(&e, t);
+        lua_pop(L, 1);
+    }
+    if (e.b != &LS->buffer)
+        return 1;
+    lua_pushlstring(L, pb_buffer(e.b), pb_bufflen(e.b));
+    pb_resetbuffer(e.b);
+    return 1;
+}
+
+static int lpbE_pack(lpb_Env* e, const pb_Type* t, int idx) {
+    unsigned i;
+    lua_State* L = e->L;
+    pb_Field** f = pb_sortfield((pb_Type*)t);
+    for (i = 0; i < t->field_count; i++) {
+        int index = idx + i;
+        if (!lua_isnoneornil(L, index)) {
+            lpb_encode_onefield(e, t, f[i], index);
+        }
+    }
+    return 0;
+}
+
+static int Lpb_pack(lua_State* L) {
+    lpb_State* LS = lpb_lstate(L);
     const pb_Type* t = lpb_type(L, LS, lpb_checkslice(L, 1));
     lpb_Env e;
     int idx = 3;
-    e.L = L, e.LS = LS, e.b = test_buffer(L, 2);
+    e.L = L, e.LS = LS, e.b = test_buffer(L, 2), e.sizes = NULL;
     if (e.b == NULL) {
         idx = 2;
         pb_resetbuffer(e.b = &LS->buffer);
@@ -1834,6 +2875,94 @@ static void lpb_pushtypetable(lua_State *L, lpb_State *LS, const pb_Type *t) {
     }
 }
 
+/* lazy messages */
+
+static void lpb_pushlazy(lpb_Env *e, const pb_Type *t, pb_Slice s) {
+    lua_State *L = e->L;
+    lpb_Lazy *lz = (lpb_Lazy*)lua_newuserdata(L, sizeof(lpb_Lazy));
+    lz->s = s, lz->t = t, lz->decoded = 0;
+    lz->owner = e->LS, lz->gen = e->LS->free_gen;
+    if ((lz->shared = e->shared) != NULL) /* keep t alive */
+        lpb_atominc(&lz->shared->refcount);
+    else { /* keep the state t lives in alive */
+        lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &lz->owner);
+    }
+    luaL_setmetatable(L, PB_LAZY);
+    lua_pushvalue(L, e->anchor);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lz);
+}
+
+/* pushes the table of a lazy message, decoding it on first use; its own
+ * nested messages stay lazy and keep the bytes alive by themselves */
+static void lpb_pushlazytable(lua_State *L, lpb_Lazy *lz) {
+    lpb_Env e;
+    pb_Slice s = lz->s;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, lz);
+    if (lz->decoded) return;
+    if (lz->shared == NULL && lz->gen != lz->owner->free_gen)
+        luaL_error(L, "type of lazy message was cleared");
+    e.L = L, e.s = &s, e.anchor = lua_gettop(L);
+    e.LS = lz->shared ? lpb_lstate(L) : lz->owner;
+    e.shared = lz->shared;
+    lpb_pushtypetable(L, e.LS, lz->t);
+    lpbD_message(&e, lz->t);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lz);
+    lua_remove(L, -2);
+    lz->decoded = 1;
+}
+
+static int Llazy_index(lua_State *L) {
+    lpb_pushlazytable(L, check_lazy(L, 1));
+    lua_pushvalue(L, 2);
+    lua_gettable(L, -2);
+    return 1;
+}
+
+static int Llazy_newindex(lua_State *L) {
+    lpb_pushlazytable(L, check_lazy(L, 1));
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_settable(L, -3);
+    return 0;
+}
+
+static int Llazy_next(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) return 2;
+    lua_pushnil(L);
+    return 1;
+}
+
+static int Llazy_pairs(lua_State *L) {
+    lpb_pushlazytable(L, check_lazy(L, 1));
+    lua_pushcfunction(L, Llazy_next);
+    lua_insert(L, -2);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int Llazy_tostring(lua_State *L) {
+    lpb_Lazy *lz = check_lazy(L, 1);
+    lua_pushfstring(L, "pb.Lazy: %p%s", lz, lz->decoded ? " (decoded)" : "");
+    return 1;
+}
+
+static int Llazy_gc(lua_State *L) {
+    lpb_Lazy *lz = check_lazy(L, 1);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lz);
+    if (lz->shared == NULL) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &lz->owner);
+    }
+    lpb_releaseshared(lz->shared);
+    lz->shared = NULL;
+    return 0;
+}
+
 static void lpbD_rawfield(lpb_Env *e, const pb_Field *f) {
     lua_State *L = e->L;
     pb_Slice sv, *s = e->s;
@@ -1854,6 +2983,8 @@ static void lpbD_rawfield(lpb_Env *e, const pb_Field *f) {
         lpb_readbytes(L, s, &sv);
         if (f->type == NULL || f->type->is_dead)
             lua_pushnil(L);
+        else if (e->anchor)
+            lpb_pushlazy(e, f->type, sv);
         else {
             lpb_pushtypetable(L, e->LS, f->type);
             lpb_withinput(e, &sv, lpbD_message(e, f->type));
@@ -1913,6 +3044,20 @@ static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag) {
             || (!f->packed && pb_wtypebytype(f->type_id) == PB_TBYTES)) {
         lpbD_field(e, f, tag);
         lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+    } else if (f->type_id != PB_Tenum && lpb_arrayesize(f->type_id)) {
+        int len = (int)lua_rawlen(L, -1), wtype = pb_wtypebytype(f->type_id);
+        pb_Slice p, *s = e->s;
+        uint64_t v[64];
+        size_t i, n;
+        lpb_readbytes(L, s, &p);
+        while ((n = lpb_readwire(&p, wtype, v, 64)) != 0)
+            for (i = 0; i < n; ++i) {
+                lpb_pushwire(L, e->LS, f->type_id, v[i]);
+                lua_rawseti(L, -2, ++len);
+            }
+        if (p.p < p.end)
+            luaL_error(L, "invalid %s value at offset %d",
+                    pb_wtypename(wtype, NULL), pb_pos(p)+1);
     } else {
         int len = (int)lua_rawlen(L, -1);
         pb_Slice p, *s = e->s;
@@ -1924,32 +3069,84 @@ static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag) {
     }
 }
 
+static lpb_Array *lpb_fetcharray(lua_State *L, const pb_Field *f) {
+    lpb_Array *a;
+    lua53_getfield(L, -1, (const char*)f->name);
+    if ((a = lpb_testarray(L, -1)) != NULL && a->type == f->type_id)
+        return a;
+    lua_pop(L, 1);
+    a = lpb_newarray(L, f->type_id);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, (const char*)f->name);
+    return a;
+}
+
+/* a repeated numeric field into a pb.Array, packed or not */
+static void lpbD_array(lpb_Env *e, const pb_Field *f, uint32_t tag) {
+    lua_State *L = e->L;
+    lpb_Array *a = lpb_fetcharray(L, f);
+    int wtype = pb_wtypebytype(f->type_id);
+    pb_Slice p, *s = e->s;
+    uint64_t v[64];
+    size_t i, n;
+    if (pb_gettype(tag) != PB_TBYTES) {
+        lpbD_checktype(e, f, tag);
+        if (lpb_readwire(s, wtype, v, 1) == 0)
+            luaL_error(L, "invalid %s value at offset %d",
+                    pb_wtypename(wtype, NULL), pb_pos(*s)+1);
+        lpb_arrayreserve(L, a, 1);
+        lpb_arrayput(a, a->count++, v[0]);
+    } else {
+        lpb_readbytes(L, s, &p);
+        if (wtype != PB_TVARINT)
+            lpb_arrayreserve(L, a, pb_len(p) / (wtype == PB_T32BIT ? 4 : 8));
+        while ((n = lpb_readwire(&p, wtype, v, 64)) != 0) {
+            lpb_arrayreserve(L, a, n);
+            for (i = 0; i < n; ++i)
+                lpb_arrayput(a, a->count + i, v[i]);
+            a->count += n;
+        }
+        if (p.p < p.end)
+            luaL_error(L, "invalid %s value at offset %d",
+                    pb_wtypename(wtype, NULL), pb_pos(p)+1);
+    }
+    lua_pop(L, 1);
+}
+
 static int lpbD_message(lpb_Env *e, const pb_Type *t) {
     lua_State *L = e->L;
     pb_Slice *s = e->s;
+    const pb_Plan *p = lpb_plan(L, t);
     uint32_t tag;
     luaL_checkstack(L, 5, "not enough stack space for fields");
     while (pb_readvarint32(s, &tag)) {
-        const pb_Field *f = pb_field(t, pb_gettag(tag));
-        if (f == NULL)
+        const lpb_PlanField *pf = lpb_planfield(p, pb_gettag(tag));
+        if (pf == NULL)
             pb_skipvalue(s, tag);
-        else if (f->type && f->type->is_map) {
-            lpb_fetchtable(L, e->LS, f, &e->LS->map_type);
-            lpbD_checktype(e, f, tag);
-            lpbD_map(e, f);
-            lua_pop(L, 1);
-        } else if (f->repeated) {
-            lpb_fetchtable(L, e->LS, f, &e->LS->array_type);
-            lpbD_repeated(e, f, tag);
+        else if (pf->kind == LPB_PMAP) {
+            lpb_fetchtable(L, e->LS, pf->field, &e->LS->map_type);
+            lpbD_checktype(e, pf->field, tag);
+            lpbD_map(e, pf->field);
             lua_pop(L, 1);
+        } else if (pf->kind == LPB_PREPEATED) {
+            if (e->LS->decode_packed_array && pf->field->type_id != PB_Tenum
+                    && lpb_arrayesize(pf->field->type_id))
+                lpbD_array(e, pf->field, tag);
+            else {
+                lpb_fetchtable(L, e->LS, pf->field, &e->LS->array_type);
+                lpbD_repeated(e, pf->field, tag);
+                lua_pop(L, 1);
+            }
         } else {
-            lua_pushstring(L, (const char*)f->name);
-            if (f->oneof_idx) {
-                lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+            lua_pushlstring(L, pf->name, pf->namelen);
+            if (pf->oneof != NULL) {
+                lua_pushlstring(L, pf->oneof, pf->oneoflen);
                 lua_pushvalue(L, -2);
                 lua_rawset(L, -4);
             }
-            lpbD_field(e, f, tag);
+            if (pb_gettype(tag) != pf->wtype)
+                lpbD_checktype(e, pf->field, tag);
+            lpbD_rawfield(e, pf->field);
             lua_rawset(L, -3);
         }
     }
@@ -1967,7 +3164,24 @@ static int lpbD_decode(lua_State *L, pb_Slice s, int start) {
         lua_pop(L, 1);
         lpb_pushtypetable(L, LS, t);
     }
-    e.L = L, e.LS = LS, e.s = &s;
+    e.L = L, e.LS = LS, e.s = &s, e.anchor = 0;
+    return lpbD_message(&e, t);
+}
+
+static int Lpb_decode_lazy(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice s = lua_isnoneornil(L, 2) ? pb_lslice("", 0) : lpb_checkslice(L, 2);
+    lpb_Env e;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    if (lua_type(L, 2) != LUA_TSTRING) { /* buffers and slices may change */
+        lua_pushlstring(L, s.p, pb_len(s));
+        lua_replace(L, 2);
+        s = lpb_toslice(L, 2);
+    }
+    lua_settop(L, 2);
+    lpb_pushtypetable(L, LS, t);
+    e.L = L, e.LS = LS, e.s = &s, e.anchor = 2, e.shared = LS->shared;
     return lpbD_message(&e, t);
 }
 
@@ -1977,13 +3191,69 @@ static int Lpb_decode(lua_State *L) {
             lpb_checkslice(L, 2), 3);
 }
 
-static int Lpb_share_state(lua_State* L) {
-    if (NULL != global_state) {
-        return luaL_error(L, "already share pb state");
+static int Lpb_decode_stream(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice s = lpb_checkslice(L, 2), sv;
+    lpb_Env e;
+    int n;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    lua_settop(L, 3);
+    if (lua_isnil(L, 3)) lua_newtable(L), lua_replace(L, 3);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 3);
+    e.L = L, e.LS = LS, e.anchor = 0;
+    while (s.p < s.end) {
+        lpb_readbytes(L, &s, &sv);
+        lpb_pushtypetable(L, LS, t);
+        e.s = &sv;
+        lpbD_message(&e, t);
+        lua_rawseti(L, 3, ++n);
     }
-    lpb_State* LS = lpb_lstate(L);
-    global_state = &LS->local;
-    return 0;
+    return 1;
+}
+
+static int Lpb_share_state(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Shared *sh, tmp;
+    int r;
+    /* build in tmp first, nothing to undo if a Lua error is raised */
+    pb_init(&tmp.state), pb_initbuffer(&tmp.descs);
+    lpb_mergedescs(L, &tmp.descs,
+            LS->shared ? pb_result(&LS->shared->descs) : pb_lslice(NULL, 0),
+            pb_result(&LS->descs));
+    r = lpb_loaddescs(L, &tmp.state, pb_result(&tmp.descs));
+    sh = r == PB_OK ? (lpb_Shared*)malloc(sizeof(lpb_Shared)) : NULL;
+    if (sh == NULL) {
+        pb_free(&tmp.state), pb_resetbuffer(&tmp.descs);
+        return luaL_error(L, r == PB_OK ? "out of memory" :
+                "can't load the schema to share");
+    }
+    *sh = tmp;
+    sh->refcount = 2;      /* published and used by LS */
+    lpb_resetplans(L, &sh->state, 1); /* readers must never write */
+    lpb_publishshared(sh);
+    lpb_useshared(L, LS, sh);
+    /* hooks were rekeyed above, local types can go now */
+    pb_free(&LS->local), pb_init(&LS->local);
+    pb_resetbuffer(&LS->descs);
+    ++LS->free_gen;
+    lua_pushinteger(L, (lua_Integer)sh->version);
+    return 1;
+}
+
+static int Lpb_sync_state(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Shared *sh = lpb_acquireshared();
+    if (sh == NULL || sh == LS->shared) {
+        lpb_releaseshared(sh);
+        lua_pushboolean(L, 0);
+    } else {
+        lpb_useshared(L, LS, sh);
+        lua_pushboolean(L, 1);
+    }
+    lua_pushinteger(L, LS->shared ? (lua_Integer)LS->shared->version : 0);
+    return 2;
 }
 
 void lpb_pushunpackdef(lua_State* L, lpb_State* LS, const pb_Type* t, pb_Field** l, int top) {
@@ -2051,11 +3321,848 @@ static int Lpb_unpack(lua_State* L) {
     const pb_Type* t = lpb_type(L, LS, lpb_checkslice(L, 1));
     pb_Slice s = lpb_checkslice(L, 2);
     lpb_Env e;
-    e.L = L, e.LS = LS, e.s = &s;
+    e.L = L, e.LS = LS, e.s = &s, e.anchor = 0;
     argcheck(L, t != NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
     return lpbD_unpack(&e, t);
 }
 
+/* luaecs components
+ *
+ * pb.component(type, layout) matches the scalar fields of a message by
+ * name with the fields of a C component of luaecs, as ecs.lua lays it
+ * out: world:component_layout(name) gives the component id, its size and
+ * a {typeid, name, offset} per field, which is what the group_field of
+ * ecs_internal.h is built from. pb.decode_component() then writes a
+ * message straight into the component of one entity, field by field,
+ * and pb.encode_component() encodes the component back, with no Lua
+ * table in between. Both go through world:context(), the C API luaecs
+ * offers to other modules. */
+
+typedef struct lpb_CompField {
+    const pb_Field *field;
+    int offset;  /* in the component */
+    int type;    /* TYPE_* of luaecs */
+} lpb_CompField;
+
+typedef struct lpb_Component {
+    const pb_Type *t;
+    lpb_Shared    *shared; /* snapshot t lives in, NULL for a local type */
+    lpb_State     *owner;  /* state a local t lives in, anchored by
+                              registry[&component->owner] */
+    unsigned       gen;    /* owner->free_gen when compiled */
+    int            cid;
+    int            size;
+    int            count;
+    lpb_CompField  fields[1]; /* sorted by number */
+} lpb_Component;
+
+#define check_component(L,idx) ((lpb_Component*)luaL_checkudata(L,idx,PB_COMPONENT))
+
+static int lpb_compfloat(int type)
+{ return type == PB_Tfloat || type == PB_Tdouble; }
+
+/* can pb type go into luaecs type? floats only go with floats, so values
+ * never have to be cut down to an integer */
+static int lpb_compmatch(int type, int ctype) {
+    if (lpb_arrayesize(type) == 0 && type != PB_Tenum) return 0;
+    switch (ctype) {
+    case TYPE_FLOAT: case TYPE_DOUBLE:
+        return lpb_compfloat(type);
+    case TYPE_INT: case TYPE_BOOL: case TYPE_INT64:
+    case TYPE_DWORD: case TYPE_WORD: case TYPE_BYTE:
+        return !lpb_compfloat(type);
+    default:
+        return 0;
+    }
+}
+
+/* bytes a luaecs field of type ctype takes */
+static int lpb_compwidth(int ctype) {
+    switch (ctype) {
+    case TYPE_BOOL: case TYPE_BYTE:     return 1;
+    case TYPE_WORD:                     return 2;
+    case TYPE_INT64: case TYPE_DOUBLE:  return 8;
+    default:                            return 4;
+    }
+}
+
+static const lpb_CompField *lpb_compfield(const lpb_Component *c, uint32_t number) {
+    int lo = 0, hi = c->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        uint32_t n = (uint32_t)c->fields[mid].field->number;
+        if (n == number) return &c->fields[mid];
+        if (n < number) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+/* stores v as read from the wire */
+static void lpb_compput(const lpb_CompField *cf, char *data, uint64_t v) {
+    char *p = data + cf->offset;
+    int64_t i = (int64_t)v;
+    double d = 0.0;
+    switch (cf->field->type_id) {
+    case PB_Tfloat:    d = pb_decode_float((uint32_t)v); break;
+    case PB_Tdouble:   d = pb_decode_double(v); break;
+    case PB_Tbool:     i = v != 0; break;
+    case PB_Tenum:
+    case PB_Tint32:    i = (int32_t)v; break;
+    case PB_Tsint32:   i = pb_decode_sint32((uint32_t)v); break;
+    case PB_Tsfixed32: i = (int32_t)(uint32_t)v; break;
+    case PB_Tuint32:
+    case PB_Tfixed32:  i = (uint32_t)v; break;
+    case PB_Tsint64:   i = pb_decode_sint64(v); break;
+    }
+    switch (cf->type) {
+    case TYPE_INT:    *(int32_t*)p  = (int32_t)i; break;
+    case TYPE_FLOAT:  *(float*)p    = (float)d; break;
+    case TYPE_BOOL:   *(uint8_t*)p  = (i != 0); break;
+    case TYPE_INT64:  *(int64_t*)p  = i; break;
+    case TYPE_DWORD:  *(uint32_t*)p = (uint32_t)i; break;
+    case TYPE_WORD:   *(uint16_t*)p = (uint16_t)i; break;
+    case TYPE_BYTE:   *(uint8_t*)p  = (uint8_t)i; break;
+    case TYPE_DOUBLE: *(double*)p   = d; break;
+    }
+}
+
+/* the value of the field as it goes on the wire */
+static uint64_t lpb_compwire(const lpb_CompField *cf, const char *data) {
+    const char *p = data + cf->offset;
+    int64_t i = 0;
+    double d = 0.0;
+    switch (cf->type) {
+    case TYPE_INT:    i = *(const int32_t*)p; break;
+    case TYPE_FLOAT:  d = *(const float*)p; break;
+    case TYPE_BOOL:
+    case TYPE_BYTE:   i = *(const uint8_t*)p; break;
+    case TYPE_INT64:  i = *(const int64_t*)p; break;
+    case TYPE_DWORD:  i = *(const uint32_t*)p; break;
+    case TYPE_WORD:   i = *(const uint16_t*)p; break;
+    case TYPE_DOUBLE: d = *(const double*)p; break;
+    }
+    switch (cf->field->type_id) {
+    case PB_Tfloat:    return pb_encode_float((float)d);
+    case PB_Tdouble:   return pb_encode_double(d);
+    case PB_Tbool:     return i != 0;
+    case PB_Tenum:
+    case PB_Tint32:    return pb_expandsig((uint32_t)(int32_t)i);
+    case PB_Tsint32:   return pb_encode_sint32((int32_t)i);
+    case PB_Tsfixed32:
+    case PB_Tuint32:
+    case PB_Tfixed32:  return (uint32_t)i;
+    case PB_Tsint64:   return pb_encode_sint64(i);
+    default:           return (uint64_t)i;
+    }
+}
+
+static const pb_Type *lpb_comptype(lua_State *L, const lpb_Component *c) {
+    if (c->shared == NULL && c->gen != c->owner->free_gen)
+        luaL_error(L, "type of component was cleared");
+    return c->t;
+}
+
+/* the component of entity eid, added zeroed if the entity has none yet */
+static char *lpb_compdata(lua_State *L, const lpb_Component *c, int add) {
+    struct ecs_context *ctx = (struct ecs_context*)luaL_testudata(L, 2,
+            ECS_CONTEXT_METANAME);
+    struct ecs_token token;
+    lua_Integer eid = luaL_checkinteger(L, 3);
+    char *data;
+    int stride;
+    argcheck(L, ctx != NULL, 2, "ecs context expected, use world:context()");
+    stride = ctx->world->c[c->cid].stride;
+    if (stride != c->size)
+        luaL_error(L, "component %d has %d bytes in the world, %d in the layout",
+                c->cid, stride, c->size);
+    if (entity_index(ctx, (void*)(uintptr_t)eid, &token) < 0)
+        luaL_error(L, "entity %s not found", lua_tostring(L, 3));
+    data = (char*)entity_component(ctx, token, c->cid);
+    if (data == NULL && add) {
+        data = (char*)entity_component_add(ctx, token, c->cid, NULL);
+        if (data == NULL) luaL_error(L, "can't add component %d", c->cid);
+        memset(data, 0, (size_t)stride);
+    }
+    return data;
+}
+
+static int Lpb_component(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Component *c;
+    int i, n, cid, size;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua53_getfield(L, 2, "id");
+    lua53_getfield(L, 2, "size");
+    cid = (int)lua_tointeger(L, 3), size = (int)lua_tointeger(L, 4);
+    argcheck(L, lua_isnumber(L, 3) && cid >= 0 && cid < MAX_COMPONENT
+            && size > 0, 2, "C component expected");
+    lua_pop(L, 2);
+    n = (int)lua_rawlen(L, 2);
+    c = (lpb_Component*)lua_newuserdata(L, sizeof(lpb_Component)
+            + (n > 0 ? n-1 : 0)*sizeof(lpb_CompField));
+    c->t = t, c->shared = NULL, c->owner = LS, c->gen = LS->free_gen;
+    c->cid = cid, c->size = size, c->count = 0;
+    luaL_setmetatable(L, PB_COMPONENT);
+    for (i = 1; i <= n; ++i) {
+        lpb_CompField cf;
+        int j;
+        lua53_rawgeti(L, 2, i);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        lua53_rawgeti(L, -1, 1);
+        lua53_rawgeti(L, -2, 2);
+        lua53_rawgeti(L, -3, 3);
+        cf.field = pb_fname(t, lpb_name(LS, lpb_toslice(L, -2)));
+        cf.type = (int)lua_tointeger(L, -3);
+        cf.offset = (int)lua_tointeger(L, -1);
+        lua_pop(L, 4);
+        if (cf.field == NULL) continue; /* not in the message */
+        if (cf.field->repeated || !lpb_compmatch(cf.field->type_id, cf.type))
+            luaL_error(L, "field '%s' (%s) can't go into a component field of type %d",
+                    (const char*)cf.field->name,
+                    pb_typename(cf.field->type_id, NULL), cf.type);
+        argcheck(L, cf.offset >= 0
+                && cf.offset <= size - lpb_compwidth(cf.type), 2,
+                "offset %d of field '%s' out of component",
+                cf.offset, (const char*)cf.field->name);
+        for (j = c->count; j > 0
+                && c->fields[j-1].field->number > cf.field->number; --j)
+            c->fields[j] = c->fields[j-1];
+        c->fields[j] = cf;
+        ++c->count;
+    }
+    if ((c->shared = LS->shared) != NULL) /* keep t alive */
+        lpb_atominc(&c->shared->refcount);
+    else { /* keep the state t lives in alive */
+        lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &c->owner);
+    }
+    return 1;
+}
+
+static int Lpb_decode_component(lua_State *L) {
+    lpb_Component *c = check_component(L, 1);
+    pb_Slice s = lpb_checkslice(L, 4);
+    char *data;
+    uint32_t tag;
+    lpb_comptype(L, c);
+    data = lpb_compdata(L, c, 1);
+    while (pb_readvarint32(&s, &tag)) {
+        const lpb_CompField *cf = lpb_compfield(c, pb_gettag(tag));
+        uint64_t u64 = 0;
+        uint32_t u32 = 0;
+        size_t r;
+        if (cf == NULL) {
+            pb_skipvalue(&s, tag);
+            continue;
+        }
+        if ((int)pb_gettype(tag) != pb_wtypebytype(cf->field->type_id))
+            luaL_error(L, "type mismatch for field '%s' at offset %d",
+                    (const char*)cf->field->name, pb_pos(s)+1);
+        switch (pb_gettype(tag)) {
+        case PB_TVARINT: r = pb_readvarint64(&s, &u64); break;
+        case PB_T32BIT:  r = pb_readfixed32(&s, &u32), u64 = u32; break;
+        default:         r = pb_readfixed64(&s, &u64); break;
+        }
+        if (r == 0)
+            luaL_error(L, "invalid %s value at offset %d",
+                    pb_typename(cf->field->type_id, NULL), pb_pos(s)+1);
+        lpb_compput(cf, data, u64);
+    }
+    return 0;
+}
+
+static int Lpb_encode_component(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Component *c = check_component(L, 1);
+    pb_Buffer *b = test_buffer(L, 4);
+    int i, proto3 = lpb_comptype(L, c)->is_proto3;
+    const char *data = lpb_compdata(L, c, 0);
+    if (data == NULL) return 0;
+    if (b == NULL) pb_resetbuffer(b = &LS->buffer);
+    for (i = 0; i < c->count; ++i) {
+        const lpb_CompField *cf = &c->fields[i];
+        int wtype = pb_wtypebytype(cf->field->type_id);
+        uint64_t v = lpb_compwire(cf, data);
+        if (v == 0 && proto3 && !cf->field->oneof_idx
+                && !LS->encode_default_values)
+            continue;
+        lpb_checkmem(L, pb_addvarint32(b, pb_pair(cf->field->number, wtype)));
+        switch (wtype) {
+        case PB_TVARINT: lpb_checkmem(L, pb_addvarint64(b, v)); break;
+        case PB_T32BIT:  lpb_checkmem(L, pb_addfixed32(b, (uint32_t)v)); break;
+        default:         lpb_checkmem(L, pb_addfixed64(b, v)); break;
+        }
+    }
+    if (b != &LS->buffer)
+        lua_settop(L, 4);
+    else {
+        lua_pushlstring(L, pb_buffer(b), pb_bufflen(b));
+        pb_resetbuffer(b);
+    }
+    return 1;
+}
+
+static int Lcomp_tostring(lua_State *L) {
+    lpb_Component *c = check_component(L, 1);
+    lua_pushfstring(L, "pb.Component: %s -> %d (%d fields): %p",
+            (const char*)c->t->name, c->cid, c->count, c);
+    return 1;
+}
+
+static int Lcomp_gc(lua_State *L) {
+    lpb_Component *c = check_component(L, 1);
+    if (c->shared == NULL) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &c->owner);
+    }
+    lpb_releaseshared(c->shared);
+    c->shared = NULL;
+    return 0;
+}
+
+/* protobuf <-> JSON
+ *
+ * pb.fromjson(type, json [, buffer]) and pb.tojson(type, data) transcode
+ * between JSON text and wire format through yyjson, without building Lua
+ * tables. Field names are the .proto names, as with pb.encode/pb.decode;
+ * bytes fields are base64 and non-finite floats are "NaN"/"Infinity", as in
+ * the proto3 JSON mapping. 64-bit integers are written as JSON numbers and
+ * may be read from numbers or strings. */
+
+#define LPBJ_MAXDEPTH 100
+
+static const char lpbJ_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t lpbJ_b64encode(const unsigned char *s, size_t len, char *out) {
+    char *p = out;
+    size_t i;
+    for (i = 0; i + 2 < len; i += 3) {
+        unsigned v = (unsigned)s[i] << 16 | (unsigned)s[i+1] << 8 | s[i+2];
+        *p++ = lpbJ_b64[v >> 18], *p++ = lpbJ_b64[(v >> 12) & 63];
+        *p++ = lpbJ_b64[(v >> 6) & 63], *p++ = lpbJ_b64[v & 63];
+    }
+    if (i < len) {
+        unsigned v = (unsigned)s[i] << 16 | (i + 1 < len ? (unsigned)s[i+1] << 8 : 0);
+        *p++ = lpbJ_b64[v >> 18], *p++ = lpbJ_b64[(v >> 12) & 63];
+        *p++ = i + 1 < len ? lpbJ_b64[(v >> 6) & 63] : '=';
+        *p++ = '=';
+    }
+    return (size_t)(p - out);
+}
+
+static int lpbJ_b64value(int c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+' || c == '-') return 62;
+    if (c == '/' || c == '_') return 63;
+    return -1;
+}
+
+/* decodes standard or URL-safe base64, padded or not; out needs len*3/4
+ * bytes. returns the decoded size, or (size_t)-1 on bad input */
+static size_t lpbJ_b64decode(const char *s, size_t len, char *out) {
+    unsigned v = 0, bits = 0;
+    size_t i, n = 0;
+    while (len > 0 && s[len-1] == '=') --len;
+    for (i = 0; i < len; ++i) {
+        int c = lpbJ_b64value((unsigned char)s[i]);
+        if (c < 0) return (size_t)-1;
+        v = v << 6 | (unsigned)c, bits += 6;
+        if (bits >= 8) bits -= 8, out[n++] = (char)(v >> bits);
+    }
+    return n;
+}
+
+typedef struct lpbJ_Env {
+    lua_State *L;
+    lpb_State *LS;
+    pb_Buffer *b;
+} lpbJ_Env;
+
+static void lpbJ_message(lpbJ_Env *e, const pb_Type *t, yyjson_val *obj, int depth);
+
+/* integer from a JSON number or numeric string */
+static int lpbJ_integer(yyjson_val *v, uint64_t *pu) {
+    if (yyjson_is_uint(v)) *pu = yyjson_get_uint(v);
+    else if (yyjson_is_sint(v)) *pu = (uint64_t)yyjson_get_sint(v);
+    else if (yyjson_is_real(v)) {
+        double d = yyjson_get_real(v);
+        if (d != d || d < -9.2233720368547758e18 || d >= 1.8446744073709552e19
+                || (d != (double)(int64_t)d && d != (double)(uint64_t)d))
+            return 0;
+        *pu = d < 0 ? (uint64_t)(int64_t)d : (uint64_t)d;
+    } else if (yyjson_is_str(v)) {
+        const char *s = yyjson_get_str(v), *end = s + yyjson_get_len(v);
+        char *p;
+        if (s == end) return 0;
+        errno = 0;
+        if (*s == '-') *pu = (uint64_t)strtoll(s, &p, 10);
+        else           *pu = (uint64_t)strtoull(s, &p, 10);
+        if (p != end || errno == ERANGE) return 0;
+    } else
+        return 0;
+    return 1;
+}
+
+static int lpbJ_number(yyjson_val *v, double *pd) {
+    if (yyjson_is_num(v)) *pd = yyjson_get_num(v);
+    else if (yyjson_is_str(v)) {
+        const char *s = yyjson_get_str(v);
+        if      (strcmp(s, "NaN") == 0)       *pd = (double)NAN;
+        else if (strcmp(s, "Infinity") == 0)  *pd = (double)HUGE_VAL;
+        else if (strcmp(s, "-Infinity") == 0) *pd = -(double)HUGE_VAL;
+        else {
+            char *p;
+            *pd = strtod(s, &p);
+            if (p == s || p != s + yyjson_get_len(v)) return 0;
+        }
+    } else
+        return 0;
+    return 1;
+}
+
+static size_t lpbJ_scalar(lpbJ_Env *e, const pb_Field *f, yyjson_val *v, int *pexist, int depth) {
+    lua_State *L = e->L;
+    pb_Buffer *b = e->b;
+    uint64_t u = 0;
+    double d = 0;
+    int ok = 1;
+    size_t len = 0;
+    switch (f->type_id) {
+    case PB_Tbool:
+        if (yyjson_is_bool(v)) u = yyjson_get_bool(v);
+        else if (yyjson_is_str(v) && strcmp(yyjson_get_str(v), "true") == 0) u = 1;
+        else if (!(yyjson_is_str(v) && strcmp(yyjson_get_str(v), "false") == 0)) ok = 0;
+        if (ok) len = pb_addvarint32(b, (uint32_t)u);
+        *pexist = (u != 0);
+        break;
+    case PB_Tdouble: case PB_Tfloat:
+        if ((ok = lpbJ_number(v, &d)))
+            len = f->type_id == PB_Tdouble ?
+                pb_addfixed64(b, pb_encode_double(d)) :
+                pb_addfixed32(b, pb_encode_float((float)d));
+        *pexist = (d != 0.0);
+        break;
+    case PB_Tenum:
+        if (yyjson_is_str(v)) {
+            const pb_Field *ev = pb_fname(f->type, lpb_name(e->LS,
+                        pb_lslice(yyjson_get_str(v), yyjson_get_len(v))));
+            if (ev) u = (uint64_t)(int64_t)ev->number;
+            else if (!(ok = lpbJ_integer(v, &u)))
+                luaL_error(L, "can not encode unknown enum '%s' at field '%s'",
+                        yyjson_get_str(v), (const char*)f->name);
+        } else ok = lpbJ_integer(v, &u);
+        if (ok) len = pb_addvarint64(b, u);
+        *pexist = (u != 0);
+        break;
+    case PB_Tstring:
+        if ((ok = yyjson_is_str(v)))
+            len = pb_addbytes(b, pb_lslice(yyjson_get_str(v), yyjson_get_len(v)));
+        *pexist = ok && yyjson_get_len(v) != 0;
+        break;
+    case PB_Tbytes:
+        if ((ok = yyjson_is_str(v))) {
+            const char *str = yyjson_get_str(v);
+            size_t slen = yyjson_get_len(v), n;
+            char *p;
+            while (slen > 0 && str[slen-1] == '=') --slen;
+            n = slen * 6 / 8; /* exact for valid base64 */
+            len = lpb_checkmem(L, pb_addvarint64(b, (uint64_t)n));
+            if ((p = pb_prepbuffsize(b, n)) == NULL)
+                luaL_error(L, "out of memory");
+            if (slen % 4 == 1 || lpbJ_b64decode(str, slen, p) != n)
+                luaL_error(L, "invalid base64 at field '%s'", (const char*)f->name);
+            pb_addsize(b, n);
+            len += n;
+            *pexist = (n != 0);
+        } else *pexist = 0;
+        break;
+    case PB_Tmessage:
+        if ((ok = yyjson_is_obj(v))) {
+            size_t mlen;
+            lpb_checkmem(L, pb_addvarint32(b, 0));
+            mlen = pb_bufflen(b);
+            lpbJ_message(e, f->type, v, depth + 1);
+            *pexist = (mlen < pb_bufflen(b));
+            return lpb_addlength(L, b, mlen, 1);
+        }
+        *pexist = 0;
+        break;
+    default:
+        if ((ok = lpbJ_integer(v, &u))) {
+            switch (f->type_id) {
+            case PB_Tint32:    len = pb_addvarint64(b, pb_expandsig((uint32_t)u)); break;
+            case PB_Tuint32:   len = pb_addvarint32(b, (uint32_t)u); break;
+            case PB_Tsint32:   len = pb_addvarint32(b, pb_encode_sint32((int32_t)u)); break;
+            case PB_Tfixed32: case PB_Tsfixed32:
+                               len = pb_addfixed32(b, (uint32_t)u); break;
+            case PB_Tfixed64: case PB_Tsfixed64:
+                               len = pb_addfixed64(b, u); break;
+            case PB_Tsint64:   len = pb_addvarint64(b, pb_encode_sint64((int64_t)u)); break;
+            default:           len = pb_addvarint64(b, u); break;
+            }
+        }
+        *pexist = (u != 0);
+    }
+    if (!ok)
+        luaL_error(L, "%s expected for field '%s', got %s",
+                lpb_expected(f->type_id), (const char*)f->name,
+                yyjson_get_type_desc(v));
+    return lpb_checkmem(L, len);
+}
+
+static void lpbJ_tagfield(lpbJ_Env *e, const pb_Field *f, yyjson_val *v, int ignorezero, int depth) {
+    size_t hlen = lpb_checkmem(e->L, pb_addvarint32(e->b,
+            pb_pair(f->number, pb_wtypebytype(f->type_id))));
+    int exist;
+    size_t ignoredlen = lpbJ_scalar(e, f, v, &exist, depth);
+    if (!e->LS->encode_default_values && !exist && ignorezero)
+        e->b->size -= (unsigned)(ignoredlen + hlen);
+}
+
+static void lpbJ_map(lpbJ_Env *e, const pb_Field *f, yyjson_val *obj, int depth) {
+    const pb_Field *kf = pb_field(f->type, 1);
+    const pb_Field *vf = pb_field(f->type, 2);
+    yyjson_obj_iter it;
+    yyjson_val *k;
+    if (kf == NULL || vf == NULL) return;
+    if (!yyjson_is_obj(obj))
+        luaL_error(e->L, "object expected at field '%s', got %s",
+                (const char*)f->name, yyjson_get_type_desc(obj));
+    yyjson_obj_iter_init(obj, &it);
+    while ((k = yyjson_obj_iter_next(&it)) != NULL) {
+        size_t len;
+        lpb_checkmem(e->L, pb_addvarint32(e->b, pb_pair(f->number, PB_TBYTES)));
+        lpb_checkmem(e->L, pb_addvarint32(e->b, 0));
+        len = pb_bufflen(e->b);
+        lpbJ_tagfield(e, kf, k, 1, depth);
+        lpbJ_tagfield(e, vf, yyjson_obj_iter_get_val(k), 1, depth);
+        lpb_addlength(e->L, e->b, len, 1);
+    }
+}
+
+static void lpbJ_repeated(lpbJ_Env *e, const pb_Field *f, yyjson_val *arr, int depth) {
+    pb_Buffer *b = e->b;
+    yyjson_arr_iter it;
+    yyjson_val *v;
+    if (!yyjson_is_arr(arr))
+        luaL_error(e->L, "array expected at field '%s', got %s",
+                (const char*)f->name, yyjson_get_type_desc(arr));
+    yyjson_arr_iter_init(arr, &it);
+    if (f->packed) {
+        unsigned len, bufflen = pb_bufflen(b);
+        int exist;
+        lpb_checkmem(e->L, pb_addvarint32(b, pb_pair(f->number, PB_TBYTES)));
+        lpb_checkmem(e->L, pb_addvarint32(b, 0));
+        len = pb_bufflen(b);
+        while ((v = yyjson_arr_iter_next(&it)) != NULL)
+            lpbJ_scalar(e, f, v, &exist, depth);
+        if (yyjson_arr_size(arr) == 0 && !e->LS->encode_default_values)
+            pb_bufflen(b) = bufflen;
+        else
+            lpb_addlength(e->L, b, len, 1);
+    } else {
+        while ((v = yyjson_arr_iter_next(&it)) != NULL)
+            lpbJ_tagfield(e, f, v, 0, depth);
+    }
+}
+
+static void lpbJ_message(lpbJ_Env *e, const pb_Type *t, yyjson_val *obj, int depth) {
+    yyjson_obj_iter it;
+    yyjson_val *k;
+    if (depth > LPBJ_MAXDEPTH) luaL_error(e->L, "message too many levels");
+    yyjson_obj_iter_init(obj, &it);
+    while ((k = yyjson_obj_iter_next(&it)) != NULL) {
+        yyjson_val *v = yyjson_obj_iter_get_val(k);
+        const pb_Field *f = pb_fname(t, lpb_name(e->LS,
+                    pb_lslice(yyjson_get_str(k), yyjson_get_len(k))));
+        if (f == NULL || yyjson_is_null(v)) continue;
+        if (f->type && f->type->is_map)
+            lpbJ_map(e, f, v, depth);
+        else if (f->repeated)
+            lpbJ_repeated(e, f, v, depth);
+        else if (!f->type || !f->type->is_dead)
+            lpbJ_tagfield(e, f, v,
+                    t->is_proto3 && !f->oneof_idx && f->type_id != PB_Tmessage, depth);
+    }
+}
+
+static int Lpb_fromjson(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice json = lpb_checkslice(L, 2);
+    size_t size = yyjson_read_max_memory_usage(pb_len(json), 0);
+    yyjson_alc alc;
+    yyjson_read_err err;
+    yyjson_doc *doc;
+    lpbJ_Env e;
+    void *mem;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
+    /* the document lives in a userdata, so errors raised while encoding
+     * can not leak it */
+    mem = lua_newuserdata(L, size);
+    yyjson_alc_pool_init(&alc, mem, size);
+    doc = yyjson_read_opts((char*)json.p, pb_len(json), 0, &alc, &err);
+    if (doc == NULL)
+        return luaL_error(L, "json decode error: %s at position %d",
+                err.msg, (int)err.pos);
+    argcheck(L, yyjson_is_obj(yyjson_doc_get_root(doc)), 2, "json object expected");
+    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    lpbJ_message(&e, t, yyjson_doc_get_root(doc), 0);
+    if (e.b != &LS->buffer)
+        lua_settop(L, 3);
+    else {
+        lua_pushlstring(L, pb_buffer(e.b), pb_bufflen(e.b));
+        pb_resetbuffer(e.b);
+    }
+    return 1;
+}
+
+typedef struct lpbJ_Writer {
+    lpb_State *LS;
+    yyjson_mut_doc *doc;
+    pb_Buffer tmp;
+    const char *err;
+    const char *at;  /* input position of the failure */
+} lpbJ_Writer;
+
+static int lpbJ_readmessage(lpbJ_Writer *w, const pb_Type *t, pb_Slice *s, yyjson_mut_val *obj, int depth);
+
+#define lpbJ_fail(w,s,msg) ((w)->err = (msg), (w)->at = (s)->p, (yyjson_mut_val*)NULL)
+
+static yyjson_mut_val *lpbJ_real(lpbJ_Writer *w, double d) {
+    if (d != d) return yyjson_mut_str(w->doc, "NaN");
+    if (d > DBL_MAX) return yyjson_mut_str(w->doc, "Infinity");
+    if (d < -DBL_MAX) return yyjson_mut_str(w->doc, "-Infinity");
+    return yyjson_mut_real(w->doc, d);
+}
+
+static yyjson_mut_val *lpbJ_readvalue(lpbJ_Writer *w, const pb_Field *f, pb_Slice *s, int depth) {
+    yyjson_mut_doc *doc = w->doc;
+    uint64_t u64;
+    uint32_t u32;
+    pb_Slice sv;
+    switch (f->type_id) {
+    case PB_Tbool:  case PB_Tenum:
+    case PB_Tint32: case PB_Tuint32: case PB_Tsint32:
+    case PB_Tint64: case PB_Tuint64: case PB_Tsint64:
+        if (pb_readvarint64(s, &u64) == 0)
+            return lpbJ_fail(w, s, "invalid varint value");
+        switch (f->type_id) {
+        case PB_Tbool:   return yyjson_mut_bool(doc, u64 != 0);
+        case PB_Tenum: {
+            const pb_Field *ev = w->LS->enum_as_value ? NULL :
+                pb_field(f->type, (int32_t)u64);
+            return ev ? yyjson_mut_str(doc, (const char*)ev->name) :
+                yyjson_mut_sint(doc, (int32_t)u64);
+        }
+        case PB_Tint32:  return yyjson_mut_sint(doc, (int32_t)u64);
+        case PB_Tuint32: return yyjson_mut_uint(doc, (uint32_t)u64);
+        case PB_Tsint32: return yyjson_mut_sint(doc, pb_decode_sint32((uint32_t)u64));
+        case PB_Tint64:  return yyjson_mut_sint(doc, (int64_t)u64);
+        case PB_Tuint64: return yyjson_mut_uint(doc, u64);
+        default:         return yyjson_mut_sint(doc, pb_decode_sint64(u64));
+        }
+    case PB_Tfloat: case PB_Tfixed32: case PB_Tsfixed32:
+        if (pb_readfixed32(s, &u32) == 0)
+            return lpbJ_fail(w, s, "invalid fixed32 value");
+        switch (f->type_id) {
+        case PB_Tfloat:   return lpbJ_real(w, pb_decode_float(u32));
+        case PB_Tfixed32: return yyjson_mut_uint(doc, u32);
+        default:          return yyjson_mut_sint(doc, (int32_t)u32);
+        }
+    case PB_Tdouble: case PB_Tfixed64: case PB_Tsfixed64:
+        if (pb_readfixed64(s, &u64) == 0)
+            return lpbJ_fail(w, s, "invalid fixed64 value");
+        switch (f->type_id) {
+        case PB_Tdouble:  return lpbJ_real(w, pb_decode_double(u64));
+        case PB_Tfixed64: return yyjson_mut_uint(doc, u64);
+        default:          return yyjson_mut_sint(doc, (int64_t)u64);
+        }
+    case PB_Tstring: case PB_Tbytes: case PB_Tmessage:
+        if (pb_readbytes(s, &sv) == 0)
+            return lpbJ_fail(w, s, "invalid bytes value");
+        if (f->type_id == PB_Tstring) /* input outlives the document */
+            return yyjson_mut_strn(doc, sv.p, pb_len(sv));
+        if (f->type_id == PB_Tbytes) {
+            size_t n = (pb_len(sv) + 2) / 3 * 4;
+            char *p = pb_prepbuffsize(&w->tmp, n);
+            if (p == NULL) return lpbJ_fail(w, s, "out of memory");
+            n = lpbJ_b64encode((const unsigned char*)sv.p, pb_len(sv), p);
+            return yyjson_mut_strncpy(doc, p, n);
+        } else {
+            yyjson_mut_val *obj = yyjson_mut_obj(doc);
+            if (obj && !lpbJ_readmessage(w, f->type, &sv, obj, depth + 1))
+                return NULL;
+            return obj;
+        }
+    default:
+        return lpbJ_fail(w, s, "unknown field type");
+    }
+}
+
+/* the array or object stored under f's name, created on first use */
+static yyjson_mut_val *lpbJ_container(lpbJ_Writer *w, yyjson_mut_val *obj, const pb_Field *f, int is_obj) {
+    const char *name = (const char*)f->name;
+    yyjson_mut_val *c = yyjson_mut_obj_get(obj, name);
+    if (c != NULL) return c;
+    c = is_obj ? yyjson_mut_obj(w->doc) : yyjson_mut_arr(w->doc);
+    if (c && !yyjson_mut_obj_add(obj, yyjson_mut_str(w->doc, name), c))
+        return NULL;
+    return c;
+}
+
+static yyjson_mut_val *lpbJ_mapkey(lpbJ_Writer *w, yyjson_mut_val *k) {
+    char buff[32];
+    if (k == NULL || yyjson_mut_is_str(k)) return k;
+    if (yyjson_mut_is_bool(k))
+        return yyjson_mut_str(w->doc, yyjson_mut_get_bool(k) ? "true" : "false");
+    if (yyjson_mut_is_uint(k))
+        sprintf(buff, "%llu", (unsigned long long)yyjson_mut_get_uint(k));
+    else
+        sprintf(buff, "%lld", (long long)yyjson_mut_get_sint(k));
+    return yyjson_mut_strcpy(w->doc, buff);
+}
+
+/* zero value of f, for map entries missing their key or value */
+static yyjson_mut_val *lpbJ_default(lpbJ_Writer *w, const pb_Field *f) {
+    yyjson_mut_doc *doc = w->doc;
+    if (f == NULL) return yyjson_mut_sint(doc, 0);
+    switch (f->type_id) {
+    case PB_Tbool:   return yyjson_mut_bool(doc, 0);
+    case PB_Tenum: {
+        const pb_Field *ev = w->LS->enum_as_value ? NULL : pb_field(f->type, 0);
+        return ev ? yyjson_mut_str(doc, (const char*)ev->name) :
+            yyjson_mut_sint(doc, 0);
+    }
+    case PB_Tfloat: case PB_Tdouble:
+        return yyjson_mut_real(doc, 0.0);
+    case PB_Tuint32: case PB_Tuint64: case PB_Tfixed32: case PB_Tfixed64:
+        return yyjson_mut_uint(doc, 0);
+    case PB_Tstring: case PB_Tbytes:
+        return yyjson_mut_str(doc, "");
+    case PB_Tmessage:
+        return yyjson_mut_obj(doc);
+    default:
+        return yyjson_mut_sint(doc, 0);
+    }
+}
+
+static int lpbJ_readmap(lpbJ_Writer *w, const pb_Field *f, pb_Slice *s, yyjson_mut_val *obj, int depth) {
+    yyjson_mut_val *map, *k = NULL, *v = NULL;
+    pb_Slice p;
+    uint32_t tag;
+    if (pb_readbytes(s, &p) == 0)
+        return lpbJ_fail(w, s, "invalid bytes value"), 0;
+    if ((map = lpbJ_container(w, obj, f, 1)) == NULL)
+        return lpbJ_fail(w, s, "out of memory"), 0;
+    while (pb_readvarint32(&p, &tag)) {
+        int n = pb_gettag(tag);
+        const pb_Field *ef = pb_field(f->type, n);
+        if (ef == NULL || (n != 1 && n != 2)) {
+            if (pb_skipvalue(&p, tag) == 0)
+                return lpbJ_fail(w, &p, "invalid map entry"), 0;
+            continue;
+        }
+        if (pb_wtypebytype(ef->type_id) != (int)pb_gettype(tag))
+            return lpbJ_fail(w, &p, "type mismatch in map entry"), 0;
+        if ((*(n == 1 ? &k : &v) = lpbJ_readvalue(w, ef, &p, depth)) == NULL)
+            return w->err ? 0 : (lpbJ_fail(w, &p, "out of memory"), 0);
+    }
+    if (k == NULL) k = lpbJ_default(w, pb_field(f->type, 1));
+    if (v == NULL) v = lpbJ_default(w, pb_field(f->type, 2));
+    if (v == NULL || (k = lpbJ_mapkey(w, k)) == NULL
+            || !yyjson_mut_obj_put(map, k, v))
+        return lpbJ_fail(w, s, "out of memory"), 0;
+    return 1;
+}
+
+static int lpbJ_readmessage(lpbJ_Writer *w, const pb_Type *t, pb_Slice *s, yyjson_mut_val *obj, int depth) {
+    uint32_t tag;
+    if (depth > LPBJ_MAXDEPTH)
+        return lpbJ_fail(w, s, "message too many levels"), 0;
+    while (pb_readvarint32(s, &tag)) {
+        const pb_Field *f = pb_field(t, pb_gettag(tag));
+        yyjson_mut_val *v;
+        if (f == NULL || (f->type && f->type->is_dead)) {
+            if (pb_skipvalue(s, tag) == 0)
+                return lpbJ_fail(w, s, "invalid value"), 0;
+            continue;
+        }
+        if (f->type && f->type->is_map) {
+            if (pb_gettype(tag) != PB_TBYTES)
+                return lpbJ_fail(w, s, "type mismatch for map field"), 0;
+            if (!lpbJ_readmap(w, f, s, obj, depth)) return 0;
+        } else if (f->repeated) {
+            yyjson_mut_val *arr = lpbJ_container(w, obj, f, 0);
+            if (arr == NULL) return lpbJ_fail(w, s, "out of memory"), 0;
+            if (pb_gettype(tag) == PB_TBYTES
+                    && pb_wtypebytype(f->type_id) != PB_TBYTES) {
+                pb_Slice p;
+                if (pb_readbytes(s, &p) == 0)
+                    return lpbJ_fail(w, s, "invalid bytes value"), 0;
+                while (p.p < p.end) {
+                    if ((v = lpbJ_readvalue(w, f, &p, depth)) == NULL
+                            || !yyjson_mut_arr_append(arr, v))
+                        return w->err ? 0 : (lpbJ_fail(w, &p, "out of memory"), 0);
+                }
+            } else if (pb_wtypebytype(f->type_id) != (int)pb_gettype(tag)) {
+                return lpbJ_fail(w, s, "type mismatch for repeated field"), 0;
+            } else if ((v = lpbJ_readvalue(w, f, s, depth)) == NULL
+                    || !yyjson_mut_arr_append(arr, v))
+                return w->err ? 0 : (lpbJ_fail(w, s, "out of memory"), 0);
+        } else {
+            if (pb_wtypebytype(f->type_id) != (int)pb_gettype(tag))
+                return lpbJ_fail(w, s, "type mismatch for field"), 0;
+            if ((v = lpbJ_readvalue(w, f, s, depth)) == NULL
+                    || !yyjson_mut_obj_put(obj, yyjson_mut_str(w->doc, (const char*)f->name), v))
+                return w->err ? 0 : (lpbJ_fail(w, s, "out of memory"), 0);
+        }
+    }
+    return 1;
+}
+
+static int Lpb_tojson(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice s = lua_isnoneornil(L, 2) ? pb_lslice(NULL, 0) : lpb_checkslice(L, 2);
+    const char *start = s.p;
+    yyjson_write_err werr;
+    yyjson_mut_val *root;
+    lpbJ_Writer w;
+    char *json = NULL;
+    size_t len = 0;
+    int ok;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    /* nothing below raises Lua errors until the document is freed */
+    w.LS = LS, w.err = NULL, w.at = NULL;
+    w.doc = yyjson_mut_doc_new(NULL);
+    pb_initbuffer(&w.tmp);
+    root = w.doc ? yyjson_mut_obj(w.doc) : NULL;
+    ok = root != NULL;
+    if (ok) {
+        yyjson_mut_doc_set_root(w.doc, root);
+        ok = lpbJ_readmessage(&w, t, &s, root, 0);
+    }
+    if (ok) json = yyjson_mut_write_opts(w.doc, 0, NULL, &len, &werr);
+    pb_resetbuffer(&w.tmp);
+    yyjson_mut_doc_free(w.doc);
+    if (!ok)
+        return luaL_error(L, "%s at offset %d", w.err ? w.err : "out of memory",
+                w.at ? (int)(w.at - start) + 1 : 0);
+    if (json == NULL)
+        return luaL_error(L, "json encode error: %s", werr.msg);
+    lua_pushlstring(L, json, len);
+    free(json);
+    return 1;
+}
+
 /* pb module interface */
 
 static int Lpb_option(lua_State *L) {
@@ -2081,6 +4188,10 @@ static int Lpb_option(lua_State *L) {
     X(18, disable_hooks,        LS->use_dec_hooks = 0)               \
     X(19, enable_enchooks,      LS->use_enc_hooks = 1)               \
     X(20, disable_enchooks,     LS->use_enc_hooks = 0)               \
+    X(21, encode_presize,       LS->encode_presize = 1)              \
+    X(22, no_encode_presize,    LS->encode_presize = 0)              \
+    X(23, decode_packed_array,  LS->decode_packed_array = 1)         \
+    X(24, no_decode_packed_array, LS->decode_packed_array = 0)       \
 
     static const char *opts[] = {
 #define X(ID,NAME,CODE) #NAME,
@@ -2106,6 +4217,11 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         ENTRY(loadfile),
         ENTRY(encode),
         ENTRY(decode),
+        ENTRY(decode_lazy),
+        ENTRY(array),
+        ENTRY(component),
+        ENTRY(decode_component),
+        ENTRY(encode_component),
         ENTRY(types),
         ENTRY(fields),
         ENTRY(type),
@@ -2115,14 +4231,20 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         ENTRY(defaults),
         ENTRY(hook),
         ENTRY(encode_hook),
+        ENTRY(encode_size),
+        ENTRY(encode_stream),
+        ENTRY(decode_stream),
         ENTRY(tohex),
         ENTRY(fromhex),
         ENTRY(result),
         ENTRY(option),
         ENTRY(state),
         ENTRY(share_state),
+        ENTRY(sync_state),
         ENTRY(pack),
         ENTRY(unpack),
+        ENTRY(fromjson),
+        ENTRY(tojson),
 #undef  ENTRY
         { NULL, NULL }
     };
@@ -2131,11 +4253,41 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         { "setdefault", Lpb_state },
         { NULL, NULL }
     };
+    luaL_Reg lazy[] = {
+        { "__index",    Llazy_index    },
+        { "__newindex", Llazy_newindex },
+        { "__pairs",    Llazy_pairs    },
+        { "__tostring", Llazy_tostring },
+        { "__gc",       Llazy_gc       },
+        { NULL, NULL }
+    };
+    luaL_Reg array[] = {
+        { "__len",      Larray_len      },
+        { "__index",    Larray_index    },
+        { "__newindex", Larray_newindex },
+        { "__tostring", Larray_tostring },
+        { "__gc",       Larray_gc       },
+        { "pointer",    Larray_pointer  },
+        { "type",       Larray_type     },
+        { "totable",    Larray_totable  },
+        { NULL, NULL }
+    };
+    luaL_Reg component[] = {
+        { "__tostring", Lcomp_tostring },
+        { "__gc",       Lcomp_gc       },
+        { NULL, NULL }
+    };
     if (luaL_newmetatable(L, PB_STATE)) {
         luaL_setfuncs(L, meta, 0);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
     }
+    if (luaL_newmetatable(L, PB_LAZY))
+        luaL_setfuncs(L, lazy, 0);
+    if (luaL_newmetatable(L, PB_ARRAY))
+        luaL_setfuncs(L, array, 0);
+    if (luaL_newmetatable(L, PB_COMPONENT))
+        luaL_setfuncs(L, component, 0);
     luaL_newlib(L, libs);
     return 1;
 }
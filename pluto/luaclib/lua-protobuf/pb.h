@@ -141,6 +141,8 @@ PB_API size_t pb_readvarint64 (pb_Slice *s, uint64_t *pv);
 PB_API size_t pb_readfixed32  (pb_Slice *s, uint32_t *pv);
 PB_API size_t pb_readfixed64  (pb_Slice *s, uint64_t *pv);
 
+PB_API size_t pb_readvarints  (pb_Slice *s, uint64_t *pv, size_t n);
+
 PB_API size_t pb_readslice (pb_Slice *s, size_t len, pb_Slice *pv);
 PB_API size_t pb_readbytes (pb_Slice *s, pb_Slice *pv);
 PB_API size_t pb_readgroup (pb_Slice *s, uint32_t tag, pb_Slice *pv);
@@ -192,6 +194,8 @@ PB_API size_t pb_addvarint64 (pb_Buffer *b, uint64_t v);
 PB_API size_t pb_addfixed32  (pb_Buffer *b, uint32_t v);
 PB_API size_t pb_addfixed64  (pb_Buffer *b, uint64_t v);
 
+PB_API size_t pb_addvarints  (pb_Buffer *b, const uint64_t *pv, size_t n);
+
 PB_API size_t pb_addslice  (pb_Buffer *b, pb_Slice s);
 PB_API size_t pb_addbytes  (pb_Buffer *b, pb_Slice s);
 PB_API size_t pb_addlength (pb_Buffer *b, size_t len, size_t prealloc);
@@ -217,6 +221,7 @@ PB_API const pb_Name *pb_name (const pb_State *S, pb_Slice s, pb_Cache *cache);
 
 typedef struct pb_Type  pb_Type;
 typedef struct pb_Field pb_Field;
+typedef struct pb_Plan  pb_Plan; /* compiled per type by lua-protobuf */
 
 #define PB_OK     0
 #define PB_ERROR  1
@@ -336,6 +341,7 @@ struct pb_Type {
     pb_Name    *name;
     const char *basename;
     pb_Field **field_sort;
+    pb_Plan   *plan;
     pb_Table field_tags;
     pb_Table field_names;
     pb_Table oneof_index;
@@ -367,6 +373,11 @@ PB_NS_END
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+# include <emmintrin.h>
+# define PB_SSE2
+#endif
+
 PB_NS_BEGIN
 
 
@@ -492,6 +503,45 @@ PB_API size_t pb_readvarint64(pb_Slice *s, uint64_t *pv) {
     return pb_readvarint_slow(s, pv);
 }
 
+/* count of one byte varints at the start of p, at most 16 */
+static unsigned pb_shortrun(const uint8_t *p, const uint8_t *end) {
+    unsigned k = 0;
+#ifdef PB_SSE2
+    if (end - p >= 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(
+                _mm_loadu_si128((const __m128i*)p));
+        if (m == 0) return 16;
+        while (!(m & 1)) m >>= 1, ++k;
+        return k;
+    }
+#endif
+    while (k < 16 && p + k < end && !(p[k] & 0x80)) ++k;
+    return k;
+}
+
+/* Reads up to n varints, as a packed field holds them. Runs of small
+ * values are found 16 bytes at a time and copied without the varint
+ * loop. Stops early at a bad varint and leaves s->p before it. */
+PB_API size_t pb_readvarints(pb_Slice *s, uint64_t *pv, size_t n) {
+    const uint8_t *p = (const uint8_t*)s->p, *end = (const uint8_t*)s->end;
+    size_t i = 0;
+    while (i < n && p < end) {
+        unsigned k = pb_shortrun(p, end);
+        if (k > n - i) k = (unsigned)(n - i);
+        if (k != 0) {
+            unsigned j;
+            for (j = 0; j < k; ++j) pv[i+j] = p[j];
+            i += k, p += k;
+        } else {
+            s->p = (const char*)p;
+            if (pb_readvarint64(s, &pv[i]) == 0) return i;
+            p = (const uint8_t*)s->p, ++i;
+        }
+    }
+    s->p = (const char*)p;
+    return i;
+}
+
 PB_API size_t pb_readfixed32(pb_Slice *s, uint32_t *pv) {
     int i;
     uint32_t n = 0;
@@ -784,6 +834,18 @@ PB_API size_t pb_addvarint64(pb_Buffer *b, uint64_t n) {
     return l;
 }
 
+PB_API size_t pb_addvarints(pb_Buffer *b, const uint64_t *pv, size_t n) {
+    char *buff = pb_prepbuffsize(b, n*10), *p = buff;
+    size_t i;
+    if (buff == NULL) return 0;
+    for (i = 0; i < n; ++i) {
+        if (pv[i] < 0x80) *p++ = (char)pv[i];
+        else p += pb_write64(p, pv[i]);
+    }
+    pb_addsize(b, p - buff);
+    return p - buff;
+}
+
 PB_API size_t pb_addfixed32(pb_Buffer *b, uint32_t n) {
     char *ch = pb_prepbuffsize(b, 4);
     if (ch == NULL) return 0;
@@ -1276,6 +1338,10 @@ PB_API void pb_delsort(pb_Type *t) {
         free(t->field_sort);
         t->field_sort = NULL;
     }
+    if (t->plan) {
+        free(t->plan);
+        t->plan = NULL;
+    }
 }
 
 PB_API void pb_deltype(pb_State *S, pb_Type *t) {
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+
+#include "buffer.hpp"
+
+namespace pluto {
+// Process-wide pool of heap buffers, split into power-of-two size classes.
+// Each class is a fixed array of slots: acquire() takes a buffer out of a
+// slot with an atomic exchange, release() puts one back with a CAS into an
+// empty slot. That is lock-free and free of ABA problems, unlike a linked
+// free list. Pooled buffers are plain `new buffer`, so a consumer that still
+// deletes them instead of calling release() stays correct.
+//
+// Buffers handed out are also recorded in a small sharded set, outside the
+// buffers themselves, so release() can refuse a pointer the pool did not
+// hand out and a buffer that was already given back. A buffer deleted by
+// its consumer just leaves a stale entry behind, dropped again once the
+// allocator reuses the address for a new buffer of the pool.
+class buffer_pool {
+public:
+    static constexpr size_t MIN_CLASS_SIZE = 512;
+    static constexpr size_t CLASS_COUNT = 8; // 512 bytes .. 64 KiB
+    static constexpr size_t MAX_CLASS_SIZE = MIN_CLASS_SIZE << (CLASS_COUNT - 1);
+    static constexpr size_t SLOT_COUNT = 64;
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct stats_type {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t released = 0;
+        uint64_t dropped = 0;
+    };
+
+    static buffer_pool& instance() {
+        static buffer_pool pool;
+        return pool;
+    }
+
+    buffer_pool() = default;
+
+    buffer_pool(const buffer_pool&) = delete;
+
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    ~buffer_pool() {
+        for (auto& slots: classes_) {
+            for (auto& slot: slots)
+                delete slot.exchange(nullptr, std::memory_order_acquire);
+        }
+    }
+
+    // An empty buffer with at least `capacity` bytes.
+    buffer* acquire(size_t capacity) {
+        size_t c = class_at_least(capacity);
+        if (c < CLASS_COUNT) {
+            auto& slots = classes_[c];
+            size_t start = thread_hint();
+            for (size_t i = 0; i < SLOT_COUNT; ++i) {
+                auto& slot = slots[(start + i) % SLOT_COUNT];
+                if (slot.load(std::memory_order_relaxed) == nullptr)
+                    continue;
+                if (buffer* buf = slot.exchange(nullptr, std::memory_order_acquire)) {
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    buf->clear();
+                    track(buf);
+                    return buf;
+                }
+            }
+            capacity = MIN_CLASS_SIZE << c;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        buffer* buf = new buffer { capacity };
+        track(buf);
+        return buf;
+    }
+
+    // Give a buffer back; it is deleted if it is too large or its class is
+    // full. Returns false, leaving the pointer alone, if it is not a buffer
+    // currently handed out by acquire() (foreign, or already released).
+    bool release(buffer* buf) {
+        if (nullptr == buf)
+            return true;
+        if (!untrack(buf))
+            return false;
+        size_t c = class_at_most(buf->capacity());
+        if (c < CLASS_COUNT) {
+            auto& slots = classes_[c];
+            size_t start = thread_hint();
+            for (size_t i = 0; i < SLOT_COUNT; ++i) {
+                auto& slot = slots[(start + i) % SLOT_COUNT];
+                buffer* expected = nullptr;
+                if (slot.load(std::memory_order_relaxed) == nullptr
+                    && slot.compare_exchange_strong(expected, buf, std::memory_order_release)) {
+                    released_.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        delete buf;
+        return true;
+    }
+
+    stats_type stats() const {
+        stats_type s;
+        s.hits = hits_.load(std::memory_order_relaxed);
+        s.misses = misses_.load(std::memory_order_relaxed);
+        s.released = released_.load(std::memory_order_relaxed);
+        s.dropped = dropped_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    struct owned_shard {
+        std::mutex lock;
+        std::unordered_set<const buffer*> set;
+    };
+
+    owned_shard& shard_of(const buffer* buf) {
+        return owned_[(reinterpret_cast<uintptr_t>(buf) >> 4) % SHARD_COUNT];
+    }
+
+    void track(const buffer* buf) {
+        owned_shard& shard = shard_of(buf);
+        std::lock_guard<std::mutex> guard { shard.lock };
+        shard.set.insert(buf);
+    }
+
+    bool untrack(const buffer* buf) {
+        owned_shard& shard = shard_of(buf);
+        std::lock_guard<std::mutex> guard { shard.lock };
+        return shard.set.erase(buf) > 0;
+    }
+
+    // smallest class that holds `size` bytes, CLASS_COUNT if none
+    static size_t class_at_least(size_t size) {
+        size_t c = 0;
+        while (c < CLASS_COUNT && (MIN_CLASS_SIZE << c) < size)
+            ++c;
+        return c;
+    }
+
+    // largest class not above `size`, CLASS_COUNT if none
+    static size_t class_at_most(size_t size) {
+        if (size < MIN_CLASS_SIZE || size > MAX_CLASS_SIZE)
+            return CLASS_COUNT;
+        size_t c = 0;
+        while (c + 1 < CLASS_COUNT && (MIN_CLASS_SIZE << (c + 1)) <= size)
+            ++c;
+        return c;
+    }
+
+    // spreads threads over the slots so they rarely touch the same ones
+    static size_t thread_hint() {
+        static std::atomic<size_t> next { 0 };
+        thread_local size_t hint = next.fetch_add(7, std::memory_order_relaxed);
+        return hint;
+    }
+
+    std::array<std::array<std::atomic<buffer*>, SLOT_COUNT>, CLASS_COUNT> classes_ {};
+    std::atomic<uint64_t> hits_ { 0 };
+    std::atomic<uint64_t> misses_ { 0 };
+    std::atomic<uint64_t> released_ { 0 };
+    std::atomic<uint64_t> dropped_ { 0 };
+    std::array<owned_shard, SHARD_COUNT> owned_;
+};
+} // namespace pluto
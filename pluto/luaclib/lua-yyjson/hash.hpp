@@ -134,4 +134,27 @@ inline uint64_t chash_string(const std::string& s, uint64_t seed = 0) {
 inline constexpr uint64_t operator""_csh(const char* string, size_t len) {
     return chash_string(string, len);
 }
+
+// CRC16-CCITT (XMODEM), the checksum Redis Cluster uses for key slots.
+inline uint16_t crc16_xmodem(const char* data, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= static_cast<uint16_t>(static_cast<uint8_t>(data[i]) << 8);
+        for (int k = 0; k < 8; ++k)
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                                 : static_cast<uint16_t>(crc << 1);
+    }
+    return crc;
+}
+
+// Redis Cluster slot of a key (0..16383), honouring {hash tags}.
+inline uint16_t redis_cluster_slot(std::string_view key) {
+    size_t open = key.find('{');
+    if (open != std::string_view::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string_view::npos && close > open + 1)
+            key = key.substr(open + 1, close - open - 1);
+    }
+    return crc16_xmodem(key.data(), key.size()) & 16383;
+}
 } // namespace pluto
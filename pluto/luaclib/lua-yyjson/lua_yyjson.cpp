@@ -1,10 +1,25 @@
+#include <algorithm>
 #include <charconv>
 #include <codecvt>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <string>
 #include <string_view>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include <lua.hpp>
 #include "buffer.hpp"
+#include "buffer_pool.hpp"
 #include "hash.hpp"
 #include "string.hpp"
 #include "yyjson.h"
@@ -33,6 +48,7 @@ static constexpr std::string_view json_false = "false"sv;
 static constexpr int MAX_DEPTH = 64;
 
 static constexpr size_t DEFAULT_CONCAT_BUFFER_SIZE = 512;
+static constexpr size_t DEFAULT_DECODE_ARENA_LIMIT = 1024 * 1024;
 
 static const char char2escape[256] = {
     'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f',  'r', 'u', 'u',
@@ -65,6 +81,102 @@ static const char char2escape[256] = {
 static const char hex_digits[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
                                      '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
 
+static inline size_t count_trailing_zeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return (size_t)__builtin_ctz(mask);
+#endif
+}
+
+// Length of the leading run of str that can be copied as is: no '"', '\\'
+// or control byte. Clean runs are scanned 32 (AVX2) or 16 (SSE2) bytes at a
+// time, otherwise 8 bytes at a time as a 64-bit word.
+static size_t escape_free_prefix(const char* str, size_t len) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8((char)0xE0);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_cmpeq_epi8(_mm256_and_si256(v, control), zero)
+        );
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + count_trailing_zeros(mask);
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128i quote16 = _mm_set1_epi8('"');
+    const __m128i backslash16 = _mm_set1_epi8('\\');
+    const __m128i control16 = _mm_set1_epi8((char)0xE0);
+    const __m128i zero16 = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, backslash16)),
+            _mm_cmpeq_epi8(_mm_and_si128(v, control16), zero16)
+        );
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + count_trailing_zeros(mask);
+    }
+#else
+    constexpr uint64_t ones = 0x0101010101010101ull;
+    constexpr uint64_t highs = 0x8080808080808080ull;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, str + i, sizeof(v));
+        uint64_t q = v ^ (ones * '"');
+        uint64_t b = v ^ (ones * '\\');
+        // a byte of x is zero (or below n) => its high bit is set here
+        uint64_t hit = ((q - ones) & ~q) | ((b - ones) & ~b) | ((v - ones * 0x20) & ~v);
+        if ((hit & highs) != 0)
+            break;
+    }
+#endif
+    for (; i < len; ++i) {
+        if (char2escape[(unsigned char)str[i]])
+            break;
+    }
+    return i;
+}
+
+// Write str as a quoted JSON string. Only the escapes themselves need
+// extra room, so nothing is reserved up front for the worst case.
+static void write_escaped(buffer* writer, const char* str, size_t len) {
+    writer->prepare(len + 2);
+    writer->unsafe_write_back('\"');
+    for (;;) {
+        size_t n = escape_free_prefix(str, len);
+        writer->write_back(str, n);
+        str += n;
+        len -= n;
+        if (len == 0)
+            break;
+
+        unsigned char ch = (unsigned char)*str++;
+        --len;
+        char esc = char2escape[ch];
+        writer->prepare(6);
+        writer->unsafe_write_back('\\');
+        writer->unsafe_write_back(esc);
+        if (esc == 'u') {
+            writer->unsafe_write_back('0');
+            writer->unsafe_write_back('0');
+            writer->unsafe_write_back(hex_digits[ch >> 4]);
+            writer->unsafe_write_back(hex_digits[ch & 0xF]);
+        }
+    }
+    writer->write_back('\"');
+}
+
 static buffer* get_thread_encode_buffer() {
     static thread_local buffer thread_encode_buffer { DEFAULT_CONCAT_BUFFER_SIZE };
     thread_encode_buffer.clear();
@@ -76,8 +188,114 @@ struct json_config {
     bool enable_number_key = true;
     bool enable_sparse_array = false;
     size_t concat_buffer_size = DEFAULT_CONCAT_BUFFER_SIZE;
+    bool shape_cache = false;
+    size_t decode_arena_limit = DEFAULT_DECODE_ARENA_LIMIT;
+};
+
+// Per-thread arena for documents that only live for one decode call. It
+// grows to the largest document seen (up to the configured limit) and is
+// reused by later decodes, so small messages cost no malloc/free at all.
+// Larger documents, and decodes that start while the arena is still in use
+// (a __gc running decode in the middle of another one), go to the heap.
+struct decode_arena {
+    char* data = nullptr;
+    size_t capacity = 0;
+    size_t high_water = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    bool busy = false;
+
+    ~decode_arena() {
+        std::free(data);
+    }
 };
 
+static decode_arena& get_thread_decode_arena() {
+    static thread_local decode_arena arena;
+    return arena;
+}
+
+static yyjson_doc* arena_read(const char* str, size_t len, size_t limit, yyjson_read_err* err) {
+    decode_arena& arena = get_thread_decode_arena();
+    size_t need = yyjson_read_max_memory_usage(len, 0);
+    if (arena.busy || need == 0 || need > limit) {
+        ++arena.misses;
+        return yyjson_read_opts((char*)str, len, 0, &allocator, err);
+    }
+    if (need > arena.capacity) {
+        size_t capacity = std::min(std::max(need, arena.capacity * 2), limit);
+        char* data = (char*)std::realloc(arena.data, capacity);
+        if (nullptr == data) {
+            ++arena.misses;
+            return yyjson_read_opts((char*)str, len, 0, &allocator, err);
+        }
+        arena.data = data;
+        arena.capacity = capacity;
+    }
+    arena.high_water = std::max(arena.high_water, need);
+    ++arena.hits;
+
+    yyjson_alc alc;
+    yyjson_alc_pool_init(&alc, arena.data, arena.capacity);
+    yyjson_doc* doc = yyjson_read_opts((char*)str, len, 0, &alc, err);
+    arena.busy = (nullptr != doc);
+    return doc;
+}
+
+static bool arena_owns(yyjson_doc* doc) {
+    decode_arena& arena = get_thread_decode_arena();
+    char* p = (char*)doc;
+    return arena.data && p >= arena.data && p < arena.data + arena.capacity;
+}
+
+// Counterpart of arena_read.
+static void arena_free(yyjson_doc* doc) {
+    if (arena_owns(doc))
+        get_thread_decode_arena().busy = false;
+    else
+        yyjson_doc_free(doc);
+}
+
+// Decoding into Lua can raise (stack overflow on deep documents, out of
+// memory), which would skip arena_free and leave the arena busy for good.
+// While an arena document is being decoded a shared to-be-closed guard sits
+// on the stack and releases the arena on the error path.
+static const int arena_guard_key = 0;
+
+static int arena_guard_close(lua_State*) {
+    get_thread_decode_arena().busy = false;
+    return 0;
+}
+
+static void arena_guard_create(lua_State* L) {
+    lua_newuserdatauv(L, 0, 0);
+    lua_newtable(L);
+    lua_pushcfunction(L, arena_guard_close);
+    lua_setfield(L, -2, "__close");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &arena_guard_key);
+}
+
+// Returns the guard slot, or 0 for heap documents that need no guard.
+static int arena_guard(lua_State* L, yyjson_doc* doc) {
+    if (!arena_owns(doc))
+        return 0;
+    luaL_checkstack(L, 1, nullptr);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &arena_guard_key);
+    int slot = lua_gettop(L);
+    lua_toclose(L, slot);
+    return slot;
+}
+
+// arena_free plus dropping the guard pushed by arena_guard.
+static void arena_release(lua_State* L, yyjson_doc* doc, int guard) {
+    arena_free(doc);
+    if (guard) {
+        lua_closeslot(L, guard);
+        lua_remove(L, guard);
+    }
+}
+
 static int json_destroy_config(lua_State* L) {
     json_config* cfg = (json_config*)lua_touserdata(L, 1);
     if (cfg)
@@ -125,12 +343,51 @@ static int json_options(lua_State* L) {
             lua_pushboolean(L, v ? 1 : 0);
             break;
         }
+        case "encode_shape_cache"_csh: {
+            bool v = cfg->shape_cache;
+            cfg->shape_cache = static_cast<bool>(lua_toboolean(L, 2));
+            lua_pushboolean(L, v ? 1 : 0);
+            break;
+        }
         case "concat_buffer_size"_csh: {
             auto concat_buffer_size = cfg->concat_buffer_size;
             cfg->concat_buffer_size = static_cast<uint32_t>(luaL_checkinteger(L, 2));
             lua_pushinteger(L, static_cast<lua_Integer>(concat_buffer_size));
             break;
         }
+        case "decode_arena_limit"_csh: {
+            auto decode_arena_limit = cfg->decode_arena_limit;
+            cfg->decode_arena_limit = static_cast<size_t>(luaL_checkinteger(L, 2));
+            lua_pushinteger(L, static_cast<lua_Integer>(decode_arena_limit));
+            break;
+        }
+        case "decode_arena_stats"_csh: {
+            // stats of the calling thread's arena
+            const decode_arena& arena = get_thread_decode_arena();
+            lua_createtable(L, 0, 4);
+            lua_pushinteger(L, static_cast<lua_Integer>(arena.capacity));
+            lua_setfield(L, -2, "capacity");
+            lua_pushinteger(L, static_cast<lua_Integer>(arena.high_water));
+            lua_setfield(L, -2, "high_water");
+            lua_pushinteger(L, static_cast<lua_Integer>(arena.hits));
+            lua_setfield(L, -2, "hits");
+            lua_pushinteger(L, static_cast<lua_Integer>(arena.misses));
+            lua_setfield(L, -2, "misses");
+            break;
+        }
+        case "buffer_pool_stats"_csh: {
+            auto stats = buffer_pool::instance().stats();
+            lua_createtable(L, 0, 4);
+            lua_pushinteger(L, static_cast<lua_Integer>(stats.hits));
+            lua_setfield(L, -2, "hits");
+            lua_pushinteger(L, static_cast<lua_Integer>(stats.misses));
+            lua_setfield(L, -2, "misses");
+            lua_pushinteger(L, static_cast<lua_Integer>(stats.released));
+            lua_setfield(L, -2, "released");
+            lua_pushinteger(L, static_cast<lua_Integer>(stats.dropped));
+            lua_setfield(L, -2, "dropped");
+            break;
+        }
         default:
             return luaL_error(L, "Invalid json.options '%s'", name);
     }
@@ -158,6 +415,8 @@ static void format_space(buffer* writer, int n) {
 template<bool format>
 static void encode_table(lua_State* L, buffer* writer, int idx, int depth);
 
+static bool encode_lazy(lua_State* L, buffer* writer, int idx);
+
 template<bool format>
 static void encode_one(lua_State* L, buffer* writer, int idx, int depth, json_config* cfg) {
     int t = lua_type(L, idx);
@@ -179,25 +438,7 @@ static void encode_one(lua_State* L, buffer* writer, int idx, int depth, json_co
         case LUA_TSTRING: {
             size_t len = 0;
             const char* str = lua_tolstring(L, idx, &len);
-            writer->prepare(len * 6 + 2);
-            writer->unsafe_write_back('\"');
-            for (size_t i = 0; i < len; ++i) {
-                unsigned char ch = (unsigned char)str[i];
-                char esc = char2escape[ch];
-                if (!esc) {
-                    writer->unsafe_write_back((char)ch);
-                } else {
-                    writer->unsafe_write_back('\\');
-                    writer->unsafe_write_back(esc);
-                    if (esc == 'u') {
-                        writer->unsafe_write_back('0');
-                        writer->unsafe_write_back('0');
-                        writer->unsafe_write_back(hex_digits[(unsigned char)esc >> 4]);
-                        writer->unsafe_write_back(hex_digits[(unsigned char)esc & 0xF]);
-                    }
-                }
-            }
-            writer->unsafe_write_back('\"');
+            write_escaped(writer, str, len);
             return;
         }
         case LUA_TTABLE: {
@@ -215,6 +456,11 @@ static void encode_one(lua_State* L, buffer* writer, int idx, int depth, json_co
             }
             break;
         }
+        case LUA_TUSERDATA: {
+            if (encode_lazy(L, writer, idx))
+                return;
+            break;
+        }
     }
     throw std::logic_error { std::string("json encode: unsupport value type :")
                              + lua_typename(L, t) };
@@ -267,9 +513,168 @@ static inline size_t array_size(lua_State* L, int index) {
     return len;
 }
 
+// Shape mode (encode_shape_cache): object keys are written sorted by their
+// JSON text, so the output is deterministic. The sorted, escaped keys of the
+// last object seen at each depth are kept as its "shape". Arrays of records
+// with the same key set reuse it: one counting lua_next pass, then lua_rawget
+// over the cached keys, with no per-key sorting or escaping.
+struct table_shape {
+    struct key {
+        bool integer = false;
+        lua_Integer ivalue = 0;
+        std::string_view name; // points into names
+        size_t offset = 0;     // escaped `"key"` in bytes
+        size_t len = 0;
+    };
+    std::vector<key> keys;
+    std::string names;
+    std::string bytes;
+};
+
+static bool build_table_shape(lua_State* L, int idx, json_config* cfg, table_shape& shape) {
+    thread_local buffer escaped { DEFAULT_CONCAT_BUFFER_SIZE };
+    escaped.clear();
+    shape.keys.clear();
+    shape.names.clear();
+    std::vector<size_t> name_offsets;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        table_shape::key k;
+        k.offset = escaped.size();
+        int key_type = lua_type(L, -2);
+        if (key_type == LUA_TSTRING) {
+            size_t len = 0;
+            const char* name = lua_tolstring(L, -2, &len);
+            name_offsets.push_back(shape.names.size());
+            shape.names.append(name, len);
+            k.name = { nullptr, len };
+            write_escaped(&escaped, name, len);
+        } else if (key_type == LUA_TNUMBER) {
+            if (!lua_isinteger(L, -2) || !cfg->enable_number_key) {
+                shape.keys.clear();
+                throw std::logic_error { "json encode: unsupport number key type." };
+            }
+            name_offsets.push_back(0);
+            k.integer = true;
+            k.ivalue = lua_tointeger(L, -2);
+            escaped.write_back('\"');
+            escaped.write_chars(k.ivalue);
+            escaped.write_back('\"');
+        } else {
+            shape.keys.clear();
+            throw std::logic_error { std::string("json encode: unsupport key type : ")
+                                     + lua_typename(L, key_type) };
+        }
+        k.len = escaped.size() - k.offset;
+        shape.keys.push_back(k);
+        lua_pop(L, 1);
+    }
+
+    for (size_t i = 0; i < shape.keys.size(); ++i) {
+        table_shape::key& k = shape.keys[i];
+        if (!k.integer)
+            k.name = { shape.names.data() + name_offsets[i], k.name.size() };
+    }
+    shape.bytes.assign(escaped.data(), escaped.size());
+    const char* bytes = shape.bytes.data();
+    std::sort(
+        shape.keys.begin(),
+        shape.keys.end(),
+        [bytes](const table_shape::key& a, const table_shape::key& b) {
+            return std::string_view { bytes + a.offset, a.len }
+            < std::string_view { bytes + b.offset, b.len };
+        }
+    );
+    return !shape.keys.empty();
+}
+
+// Number of keys in the table, counting no further than limit.
+static size_t count_table_keys(lua_State* L, int idx, size_t limit) {
+    size_t n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        if (++n >= limit) {
+            lua_pop(L, 1);
+            break;
+        }
+    }
+    return n;
+}
+
+// Write the table through shape; false (with nothing written) if one of the
+// shape's keys is missing.
+template<bool format>
+static bool encode_table_shape(
+    lua_State* L,
+    buffer* writer,
+    int idx,
+    int depth,
+    json_config* cfg,
+    const table_shape& shape
+) {
+    size_t bsize = writer->size();
+    writer->write_back('{');
+    for (size_t i = 0; i < shape.keys.size(); ++i) {
+        const table_shape::key& k = shape.keys[i];
+        if (k.integer && !cfg->enable_number_key) {
+            writer->revert(writer->size() - bsize);
+            return false;
+        }
+        if (i > 0)
+            writer->write_back(',');
+        format_new_line<format>(writer);
+        if (k.integer)
+            lua_pushinteger(L, k.ivalue);
+        else
+            lua_pushlstring(L, k.name.data(), k.name.size());
+        if (lua_rawget(L, idx) == LUA_TNIL) {
+            lua_pop(L, 1);
+            writer->revert(writer->size() - bsize);
+            return false;
+        }
+        format_space<format>(writer, depth);
+        writer->write_back(shape.bytes.data() + k.offset, k.len);
+        writer->write_back(':');
+        if constexpr (format)
+            writer->write_back(' ');
+        encode_one<format>(L, writer, -1, depth, cfg);
+        lua_pop(L, 1);
+    }
+    format_new_line<format>(writer);
+    format_space<format>(writer, depth - 1);
+    writer->write_back('}');
+    return true;
+}
+
+template<bool format>
+static void
+encode_table_shaped(lua_State* L, buffer* writer, int idx, int depth, json_config* cfg) {
+    thread_local std::vector<table_shape> shapes(MAX_DEPTH + 1);
+    table_shape& shape = shapes[depth];
+    size_t n = shape.keys.size();
+    if (n > 0 && count_table_keys(L, idx, n + 1) == n
+        && encode_table_shape<format>(L, writer, idx, depth, cfg, shape))
+        return;
+
+    if (build_table_shape(L, idx, cfg, shape)) {
+        encode_table_shape<format>(L, writer, idx, depth, cfg, shape);
+    } else if (cfg->empty_as_array) {
+        writer->write_back('[');
+        writer->write_back(']');
+    } else {
+        writer->write_back('{');
+        writer->write_back('}');
+    }
+}
+
 template<bool format>
 static void
 encode_table_object(lua_State* L, buffer* writer, int idx, int depth, json_config* cfg) {
+    if (cfg->shape_cache)
+        return encode_table_shaped<format>(L, writer, idx, depth, cfg);
+
     size_t i = 0;
     writer->write_back('{');
     lua_pushnil(L); // [table, nil]
@@ -283,9 +688,7 @@ encode_table_object(lua_State* L, buffer* writer, int idx, int depth, json_confi
                 format_space<format>(writer, depth);
                 size_t len = 0;
                 const char* key = lua_tolstring(L, -2, &len);
-                writer->write_back('\"');
-                writer->write_back(key, len);
-                writer->write_back('\"');
+                write_escaped(writer, key, len);
                 writer->write_back(':');
                 if constexpr (format)
                     writer->write_back(' ');
@@ -503,7 +906,7 @@ static int decode(lua_State* L) {
     lua_settop(L, 1);
 
     yyjson_read_err err;
-    yyjson_doc* doc = yyjson_read_opts((char*)str, len, 0, &allocator, &err);
+    yyjson_doc* doc = arena_read(str, len, cfg->decode_arena_limit, &err);
     if (nullptr == doc) {
         return luaL_error(
             L,
@@ -513,16 +916,552 @@ static int decode(lua_State* L) {
             (int)err.pos
         );
     }
+    int guard = arena_guard(L, doc);
     decode_one(L, yyjson_doc_get_root(doc), cfg);
-    yyjson_doc_free(doc);
+    arena_release(L, doc, guard);
+    return 1;
+}
+
+// Turn "$.a.b[0]" into the JSON pointer "/a/b/0"; pointers pass through.
+static bool json_path_to_pointer(std::string_view path, std::string& out) {
+    out.clear();
+    if (path.empty() || path[0] == '/') {
+        out.append(path);
+        return true;
+    }
+    if (path[0] != '$')
+        return false;
+    size_t i = 1;
+    while (i < path.size()) {
+        char c = path[i];
+        size_t end = 0;
+        if (c == '.') {
+            ++i;
+            end = path.find_first_of(".[", i);
+        } else if (c == '[') {
+            ++i;
+            end = path.find(']', i);
+            if (end == std::string_view::npos)
+                return false;
+        } else {
+            return false;
+        }
+        if (end == std::string_view::npos)
+            end = path.size();
+        out.push_back('/');
+        for (size_t k = i; k < end; ++k) {
+            if (path[k] == '~')
+                out.append("~0");
+            else if (path[k] == '/')
+                out.append("~1");
+            else
+                out.push_back(path[k]);
+        }
+        i = (end < path.size() && path[end] == ']') ? end + 1 : end;
+    }
+    return true;
+}
+
+// yyjson.get(str, path, ...) returns the value at each path (JSON pointer or
+// "$.a.b[0]"), nil for missing ones. The text is parsed once for all paths
+// and nothing outside the requested values is converted to Lua.
+static int get(lua_State* L) {
+    size_t len = 0;
+    const char* str = luaL_checklstring(L, 1, &len);
+    int top = lua_gettop(L);
+    luaL_argcheck(L, top >= 2, 2, "path expected");
+
+    thread_local std::vector<std::string> pointers;
+    if (pointers.size() < (size_t)top)
+        pointers.resize((size_t)top);
+    for (int i = 2; i <= top; ++i) {
+        size_t n = 0;
+        const char* path = luaL_checklstring(L, i, &n);
+        if (!json_path_to_pointer({ path, n }, pointers[i - 2]))
+            return luaL_argerror(L, i, "invalid json path");
+    }
+
+    if (str[0] == '\0')
+        return 0;
+
+    json_config* cfg = json_fetch_config(L);
+    luaL_checkstack(L, top, nullptr);
+
+    yyjson_read_err err;
+    yyjson_doc* doc = arena_read(str, len, cfg->decode_arena_limit, &err);
+    if (nullptr == doc) {
+        return luaL_error(
+            L,
+            "decode error: %s code: %d at position: %d\n",
+            err.msg,
+            (int)err.code,
+            (int)err.pos
+        );
+    }
+    int guard = arena_guard(L, doc);
+    for (int i = 2; i <= top; ++i) {
+        const std::string& ptr = pointers[i - 2];
+        yyjson_val* val = yyjson_doc_ptr_getn(doc, ptr.data(), ptr.size());
+        if (nullptr == val)
+            lua_pushnil(L);
+        else
+            decode_one(L, val, cfg);
+    }
+    arena_release(L, doc, guard);
+    return top - 1;
+}
+
+// Streaming NDJSON reader: chunks go in with feed(), decoded records come
+// out of next() one line at a time. Only the unfinished tail of the input
+// is kept, and every record is parsed into the same arena, so memory is
+// bounded by the longest record rather than by the size of the stream.
+static constexpr const char* NDJSON_METANAME = "yyjson.ndjson_reader";
+static constexpr size_t DEFAULT_NDJSON_MAX_RECORD = 16 * 1024 * 1024;
+
+struct ndjson_reader {
+    std::string pending;
+    size_t pos = 0;
+    std::vector<char> arena;
+    json_config cfg;
+    size_t max_record = DEFAULT_NDJSON_MAX_RECORD;
+    size_t records = 0;
+    bool eof = false;
+};
+
+static ndjson_reader* ndjson_check(lua_State* L) {
+    return (ndjson_reader*)luaL_checkudata(L, 1, NDJSON_METANAME);
+}
+
+static int ndjson_gc(lua_State* L) {
+    ndjson_reader* r = (ndjson_reader*)lua_touserdata(L, 1);
+    if (r)
+        std::destroy_at(r);
+    return 0;
+}
+
+static int ndjson_feed(lua_State* L) {
+    ndjson_reader* r = ndjson_check(L);
+    size_t len = 0;
+    const char* data = nullptr;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        data = lua_tolstring(L, 2, &len);
+    } else {
+        data = reinterpret_cast<const char*>(lua_touserdata(L, 2));
+        len = luaL_checkinteger(L, 3);
+    }
+    if (r->eof)
+        return luaL_error(L, "ndjson reader: feed after finish");
+    if (nullptr == data || len == 0)
+        return 0;
+
+    if (r->pos > 0) {
+        r->pending.erase(0, r->pos);
+        r->pos = 0;
+    }
+    // a record longer than max_record can never complete
+    if (r->pending.size() > r->max_record && memchr(r->pending.data(), '\n', r->pending.size()) == nullptr)
+        return luaL_error(L, "ndjson reader: record exceeds %d bytes", (int)r->max_record);
+    r->pending.append(data, len);
+    return 0;
+}
+
+static int ndjson_finish(lua_State* L) {
+    ndjson_check(L)->eof = true;
+    return 0;
+}
+
+// Next decoded record, or nil when no complete line is buffered.
+static int ndjson_next(lua_State* L) {
+    ndjson_reader* r = ndjson_check(L);
+    for (;;) {
+        const char* begin = r->pending.data() + r->pos;
+        size_t avail = r->pending.size() - r->pos;
+        if (avail == 0)
+            return 0;
+
+        const char* nl = (const char*)memchr(begin, '\n', avail);
+        size_t len = nl ? (size_t)(nl - begin) : avail;
+        if (nullptr == nl && !r->eof)
+            return 0;
+        r->pos += nl ? len + 1 : len;
+
+        size_t start = 0;
+        while (start < len && (begin[start] == ' ' || begin[start] == '\t' || begin[start] == '\r'))
+            ++start;
+        if (start == len)
+            continue; // blank line
+        ++r->records;
+        if (len > r->max_record)
+            return luaL_error(L, "ndjson reader: record %d exceeds %d bytes", (int)r->records, (int)r->max_record);
+
+        size_t need = yyjson_read_max_memory_usage(len, 0);
+        if (r->arena.size() < need)
+            r->arena.resize(std::max(need, r->arena.size() * 2));
+        yyjson_alc alc;
+        yyjson_alc_pool_init(&alc, r->arena.data(), r->arena.size());
+
+        yyjson_read_err err;
+        yyjson_doc* doc = yyjson_read_opts((char*)begin, len, 0, &alc, &err);
+        if (nullptr == doc) {
+            return luaL_error(
+                L,
+                "decode error: %s code: %d at position: %d of record %d\n",
+                err.msg,
+                (int)err.code,
+                (int)err.pos,
+                (int)r->records
+            );
+        }
+        decode_one(L, yyjson_doc_get_root(doc), &r->cfg);
+        return 1;
+    }
+}
+
+static int ndjson_records(lua_State* L) {
+    ndjson_check(L);
+    lua_pushcfunction(L, ndjson_next);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+// Bytes buffered but not yet returned as records.
+static int ndjson_pending(lua_State* L) {
+    ndjson_reader* r = ndjson_check(L);
+    lua_pushinteger(L, (lua_Integer)(r->pending.size() - r->pos));
+    return 1;
+}
+
+static int ndjson_reader_new(lua_State* L) {
+    json_config* cfg = json_fetch_config(L);
+    lua_Integer max_record = luaL_optinteger(L, 1, (lua_Integer)DEFAULT_NDJSON_MAX_RECORD);
+    luaL_argcheck(L, max_record > 0, 1, "max record size must be positive");
+
+    void* mem = lua_newuserdatauv(L, sizeof(ndjson_reader), 0);
+    ndjson_reader* r = new (mem) ndjson_reader {};
+    r->cfg = *cfg;
+    r->max_record = (size_t)max_record;
+    luaL_setmetatable(L, NDJSON_METANAME);
     return 1;
 }
 
+static void ndjson_create_metatable(lua_State* L) {
+    luaL_Reg l[] = { { "feed", ndjson_feed },
+                     { "finish", ndjson_finish },
+                     { "next", ndjson_next },
+                     { "records", ndjson_records },
+                     { "pending", ndjson_pending },
+                     { nullptr, nullptr } };
+    luaL_newmetatable(L, NDJSON_METANAME);
+    luaL_newlib(L, l);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, ndjson_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
+// Lazy decode: containers stay in the yyjson_doc and are wrapped in proxy
+// userdata that turn into Lua values only when read. Every proxy keeps the
+// document alive through its first user value; the second one caches the
+// child proxies already handed out, and the third holds the element index
+// of an array that contains containers.
+static constexpr const char* LAZY_DOC_METANAME = "yyjson.lazy_doc";
+static constexpr const char* LAZY_METANAME = "yyjson.lazy";
+static constexpr const char* LAZY_ITER_METANAME = "yyjson.lazy_iter";
+
+struct lazy_doc {
+    yyjson_doc* doc = nullptr;
+    json_config cfg;
+    bool cache = true;
+};
+
+struct lazy_value {
+    yyjson_val* val = nullptr;
+    yyjson_val** index = nullptr; // elements of a non-flat array, once built
+};
+
+struct lazy_iter {
+    yyjson_val* val = nullptr;
+    size_t index = 0;
+    union {
+        yyjson_arr_iter arr;
+        yyjson_obj_iter obj;
+    };
+};
+
+static int lazy_doc_gc(lua_State* L) {
+    lazy_doc* d = (lazy_doc*)lua_touserdata(L, 1);
+    if (d && d->doc) {
+        yyjson_doc_free(d->doc);
+        d->doc = nullptr;
+    }
+    return 0;
+}
+
+static lazy_doc* lazy_get_doc(lua_State* L, int idx) {
+    lua_getiuservalue(L, idx, 1);
+    lazy_doc* d = (lazy_doc*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return d;
+}
+
+// Push a proxy for container `val`, sharing the document held at `owner`
+// (a proxy, or the document itself).
+static void lazy_push_proxy(lua_State* L, int owner, yyjson_val* val, bool owner_is_doc) {
+    owner = lua_absindex(L, owner);
+    lazy_value* p = (lazy_value*)lua_newuserdatauv(L, sizeof(lazy_value), 3);
+    new (p) lazy_value {};
+    p->val = val;
+    if (owner_is_doc)
+        lua_pushvalue(L, owner);
+    else
+        lua_getiuservalue(L, owner, 1);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, LAZY_METANAME);
+}
+
+// Push the child `val` of the proxy at idx, found under the Lua key at key.
+static void lazy_push_child(lua_State* L, int idx, int key, yyjson_val* val, lazy_doc* d) {
+    if (!yyjson_is_ctn(val)) {
+        decode_one(L, val, &d->cfg);
+        return;
+    }
+
+    if (!d->cache) {
+        lazy_push_proxy(L, idx, val, false);
+        return;
+    }
+
+    idx = lua_absindex(L, idx);
+    key = lua_absindex(L, key);
+    if (lua_getiuservalue(L, idx, 2) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, idx, 2);
+    }
+    lua_pushvalue(L, key);
+    if (lua_rawget(L, -2) != LUA_TNIL) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    lazy_push_proxy(L, idx, val, false);
+    lua_pushvalue(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4); // cache[key] = proxy
+    lua_remove(L, -2);
+}
+
+// Object keys that look like integers decode to integer keys, as in decode().
+static void lazy_push_key(lua_State* L, yyjson_val* key, const json_config& cfg) {
+    std::string_view view { unsafe_yyjson_get_str(key), unsafe_yyjson_get_len(key) };
+    if (!view.empty() && cfg.enable_number_key) {
+        char c = view[0];
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            const char* last = view.data() + view.size();
+            int64_t v = 0;
+            auto [p, ec] = std::from_chars(view.data(), last, v);
+            if (ec == std::errc() && p == last) {
+                lua_pushinteger(L, v);
+                return;
+            }
+        }
+    }
+    lua_pushlstring(L, view.data(), view.size());
+}
+
+// Element i of the array proxy at idx. yyjson_arr_get walks the array
+// unless it is flat, so other arrays get an index of their elements on the
+// first access, making every later one O(1).
+static yyjson_val* lazy_arr_get(lua_State* L, int idx, lazy_value* p, size_t i) {
+    if (unsafe_yyjson_arr_is_flat(p->val))
+        return unsafe_yyjson_get_first(p->val) + i;
+    if (nullptr == p->index) {
+        size_t n = unsafe_yyjson_get_len(p->val);
+        auto index = (yyjson_val**)lua_newuserdatauv(L, n * sizeof(yyjson_val*), 0);
+        yyjson_val* val = unsafe_yyjson_get_first(p->val);
+        for (size_t k = 0; k < n; ++k, val = unsafe_yyjson_get_next(val))
+            index[k] = val;
+        lua_setiuservalue(L, idx, 3);
+        p->index = index;
+    }
+    return p->index[i];
+}
+
+static int lazy_index(lua_State* L) {
+    lazy_value* p = (lazy_value*)luaL_checkudata(L, 1, LAZY_METANAME);
+    lazy_doc* d = lazy_get_doc(L, 1);
+    yyjson_val* child = nullptr;
+    if (yyjson_is_arr(p->val)) {
+        if (!lua_isinteger(L, 2))
+            return 0;
+        lua_Integer i = lua_tointeger(L, 2);
+        if (i < 1 || (size_t)i > unsafe_yyjson_get_len(p->val))
+            return 0;
+        child = lazy_arr_get(L, 1, p, (size_t)i - 1);
+    } else {
+        int t = lua_type(L, 2);
+        if (t == LUA_TSTRING) {
+            size_t len = 0;
+            const char* key = lua_tolstring(L, 2, &len);
+            child = yyjson_obj_getn(p->val, key, len);
+        } else if (t == LUA_TNUMBER && lua_isinteger(L, 2) && d->cfg.enable_number_key) {
+            char key[32];
+            auto res = std::to_chars(key, key + sizeof(key), lua_tointeger(L, 2));
+            child = yyjson_obj_getn(p->val, key, (size_t)(res.ptr - key));
+        }
+    }
+    if (nullptr == child)
+        return 0;
+    lazy_push_child(L, 1, 2, child, d);
+    return 1;
+}
+
+static int lazy_newindex(lua_State* L) {
+    return luaL_error(L, "yyjson lazy value is read-only");
+}
+
+static int lazy_len(lua_State* L) {
+    lazy_value* p = (lazy_value*)luaL_checkudata(L, 1, LAZY_METANAME);
+    lua_pushinteger(L, yyjson_is_arr(p->val) ? (lua_Integer)unsafe_yyjson_get_len(p->val) : 0);
+    return 1;
+}
+
+static int lazy_next(lua_State* L) {
+    lazy_iter* it = (lazy_iter*)luaL_checkudata(L, 1, LAZY_ITER_METANAME);
+    lua_getiuservalue(L, 1, 1); // proxy
+    int proxy = lua_gettop(L);
+    lazy_doc* d = lazy_get_doc(L, proxy);
+
+    yyjson_val* val = nullptr;
+    if (yyjson_is_arr(it->val)) {
+        val = yyjson_arr_iter_next(&it->arr);
+        if (nullptr == val)
+            return 0;
+        lua_pushinteger(L, (lua_Integer)++it->index);
+    } else {
+        yyjson_val* key = yyjson_obj_iter_next(&it->obj);
+        if (nullptr == key)
+            return 0;
+        val = yyjson_obj_iter_get_val(key);
+        lazy_push_key(L, key, d->cfg);
+    }
+    lazy_push_child(L, proxy, -1, val, d);
+    return 2;
+}
+
+static int lazy_pairs(lua_State* L) {
+    lazy_value* p = (lazy_value*)luaL_checkudata(L, 1, LAZY_METANAME);
+    lua_pushcfunction(L, lazy_next);
+    lazy_iter* it = (lazy_iter*)lua_newuserdatauv(L, sizeof(lazy_iter), 1);
+    new (it) lazy_iter {};
+    it->val = p->val;
+    if (yyjson_is_arr(p->val))
+        yyjson_arr_iter_init(p->val, &it->arr);
+    else
+        yyjson_obj_iter_init(p->val, &it->obj);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, LAZY_ITER_METANAME);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int decode_lazy(lua_State* L) {
+    size_t len = 0;
+    const char* str = nullptr;
+    int opt = 2;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        str = luaL_checklstring(L, 1, &len);
+    } else {
+        str = reinterpret_cast<const char*>(lua_touserdata(L, 1));
+        len = luaL_checkinteger(L, 2);
+        opt = 3;
+    }
+
+    if (nullptr == str || str[0] == '\0')
+        return 0;
+
+    json_config* cfg = json_fetch_config(L);
+    bool cache = lua_isnoneornil(L, opt) ? true : (bool)lua_toboolean(L, opt);
+
+    lazy_doc* d = (lazy_doc*)lua_newuserdatauv(L, sizeof(lazy_doc), 0);
+    new (d) lazy_doc {};
+    luaL_setmetatable(L, LAZY_DOC_METANAME);
+
+    yyjson_read_err err;
+    d->doc = yyjson_read_opts((char*)str, len, 0, &allocator, &err);
+    if (nullptr == d->doc) {
+        return luaL_error(
+            L,
+            "decode error: %s code: %d at position: %d\n",
+            err.msg,
+            (int)err.code,
+            (int)err.pos
+        );
+    }
+    d->cfg = *cfg;
+    d->cache = cache;
+
+    yyjson_val* root = yyjson_doc_get_root(d->doc);
+    if (!yyjson_is_ctn(root)) {
+        decode_one(L, root, cfg);
+        return 1;
+    }
+    lazy_push_proxy(L, -1, root, true);
+    return 1;
+}
+
+// Fully decode a lazy proxy into plain tables.
+static int totable(lua_State* L) {
+    lazy_value* p = (lazy_value*)luaL_testudata(L, 1, LAZY_METANAME);
+    if (nullptr == p) {
+        lua_settop(L, 1);
+        return 1;
+    }
+    lazy_doc* d = lazy_get_doc(L, 1);
+    decode_one(L, p->val, &d->cfg);
+    return 1;
+}
+
+// Lazy proxies encode straight from the document, without going through Lua.
+static bool encode_lazy(lua_State* L, buffer* writer, int idx) {
+    lazy_value* p = (lazy_value*)luaL_testudata(L, idx, LAZY_METANAME);
+    if (nullptr == p)
+        return false;
+    size_t len = 0;
+    char* json = yyjson_val_write_opts(p->val, 0, &allocator, &len, nullptr);
+    if (nullptr == json)
+        throw std::logic_error { "json encode: lazy value write failed" };
+    writer->write_back(json, len);
+    allocator.free(allocator.ctx, json);
+    return true;
+}
+
+static void lazy_create_metatables(lua_State* L) {
+    luaL_newmetatable(L, LAZY_DOC_METANAME);
+    lua_pushcfunction(L, lazy_doc_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_Reg l[] = { { "__index", lazy_index },
+                     { "__newindex", lazy_newindex },
+                     { "__len", lazy_len },
+                     { "__pairs", lazy_pairs },
+                     { nullptr, nullptr } };
+    luaL_newmetatable(L, LAZY_METANAME);
+    luaL_setfuncs(L, l, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LAZY_ITER_METANAME);
+    lua_pop(L, 1);
+}
+
 static int concat(lua_State* L) {
     if (lua_type(L, 1) == LUA_TSTRING) {
         size_t size;
         const char* sz = lua_tolstring(L, -1, &size);
-        auto buf = new buffer { BUFFER_OPTION_CHEAP_PREPEND + size };
+        auto buf = buffer_pool::instance().acquire(BUFFER_OPTION_CHEAP_PREPEND + size);
         buf->commit(BUFFER_OPTION_CHEAP_PREPEND);
         buf->write_back(sz, size);
         buf->seek(BUFFER_OPTION_CHEAP_PREPEND);
@@ -536,7 +1475,7 @@ static int concat(lua_State* L) {
 
     json_config* cfg = json_fetch_config(L);
 
-    auto buf = new pluto::buffer(cfg->concat_buffer_size);
+    auto buf = buffer_pool::instance().acquire(cfg->concat_buffer_size);
     buf->commit(BUFFER_OPTION_CHEAP_PREPEND);
     try {
         int array_size = (int)lua_rawlen(L, 1);
@@ -578,7 +1517,7 @@ static int concat(lua_State* L) {
         lua_pushlightuserdata(L, buf);
         return 1;
     } catch (const std::exception& ex) {
-        delete buf;
+        buffer_pool::instance().release(buf);
         lua_pushstring(L, ex.what());
     }
     return lua_error(L);
@@ -600,13 +1539,21 @@ static void concat_resp_one(buffer* buf, lua_State* L, int i, json_config* cfg)
             break;
         }
         case LUA_TNUMBER: {
+            char num[44];
+            size_t len = 0;
             if (lua_isinteger(L, i)) {
-                std::string s = std::to_string(lua_tointeger(L, i));
-                write_resp(buf, s.data(), s.size());
+                auto res = std::to_chars(num, num + sizeof(num), lua_tointeger(L, i));
+                len = (size_t)(res.ptr - num);
             } else {
-                std::string s = std::to_string(lua_tonumber(L, i));
-                write_resp(buf, s.data(), s.size());
+#ifndef _MSC_VER // same as buffer::write_chars, floating to_chars is missing from older gcc/clang
+                int n = std::snprintf(num, sizeof(num), "%.16g", lua_tonumber(L, i));
+                len = n > 0 ? (size_t)n : 0;
+#else
+                auto res = std::to_chars(num, num + sizeof(num), lua_tonumber(L, i));
+                len = (size_t)(res.ptr - num);
+#endif
             }
+            write_resp(buf, num, len);
             break;
         }
         case LUA_TBOOLEAN: {
@@ -651,7 +1598,7 @@ static int concat_resp(lua_State* L) {
 
     json_config* cfg = json_fetch_config(L);
 
-    auto buf = new pluto::buffer(cfg->concat_buffer_size);
+    auto buf = buffer_pool::instance().acquire(cfg->concat_buffer_size);
     try {
         int64_t hash = 1;
         if (lua_type(L, 2) == LUA_TTABLE) {
@@ -689,24 +1636,568 @@ static int concat_resp(lua_State* L) {
         lua_pushinteger(L, hash);
         return 2;
     } catch (const std::exception& ex) {
-        delete buf;
+        buffer_pool::instance().release(buf);
+        lua_pushstring(L, ex.what());
+    }
+    return lua_error(L);
+}
+
+// yyjson.concat_resp_batch([shards | "slot",] {cmd...}, {cmd...}, ...)
+// Pipelines many commands in one call. Commands are grouped into one pooled
+// buffer per shard, returned as { [shard] = buffer }, plus the number of
+// buffers. A numeric `shards` (default 1) uses the concat_resp hash of the
+// key (the field for h* commands) and shard = hash % shards + 1. "slot" uses
+// the Redis Cluster slot (CRC16 of the key, {hash tags} honoured) as shard.
+static int concat_resp_batch(lua_State* L) {
+    int first = 1;
+    bool slot_mode = false;
+    lua_Integer shards = 1;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        size_t len = 0;
+        const char* mode = lua_tolstring(L, 1, &len);
+        luaL_argcheck(L, std::string_view(mode, len) == "slot"sv, 1, "'slot' or shard count expected");
+        slot_mode = true;
+        first = 2;
+    } else if (lua_type(L, 1) == LUA_TNUMBER) {
+        shards = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, shards > 0, 1, "shard count must be positive");
+        first = 2;
+    }
+    int top = lua_gettop(L);
+    for (int i = first; i <= top; ++i)
+        luaL_checktype(L, i, LUA_TTABLE);
+
+    json_config* cfg = json_fetch_config(L);
+    thread_local std::vector<std::pair<uint32_t, buffer*>> groups;
+    groups.clear();
+
+    try {
+        for (int i = first; i <= top; ++i) {
+            int n = (int)lua_rawlen(L, i);
+            if (n == 0)
+                continue;
+            luaL_checkstack(L, n, "concat_resp_batch");
+            for (int k = 1; k <= n; ++k)
+                lua_rawgeti(L, i, k);
+            int base = top + 1;
+
+            uint32_t shard = 1;
+            size_t len = 0;
+            if (slot_mode) {
+                if (n > 1 && lua_type(L, base + 1) == LUA_TSTRING) {
+                    const char* key = lua_tolstring(L, base + 1, &len);
+                    shard = redis_cluster_slot({ key, len });
+                } else {
+                    shard = 0;
+                }
+            } else if (shards > 1) {
+                std::string_view hash_part;
+                if (n > 1 && lua_type(L, base + 1) == LUA_TSTRING) {
+                    const char* key = lua_tolstring(L, base + 1, &len);
+                    hash_part = { key, len };
+                }
+                const char* cmd = lua_tolstring(L, base, &len);
+                if (n > 2 && len > 0 && (cmd[0] == 'h' || cmd[0] == 'H')
+                    && lua_type(L, base + 2) == LUA_TSTRING) {
+                    const char* field = lua_tolstring(L, base + 2, &len);
+                    if (len > 0)
+                        hash_part = { field, len };
+                }
+                if (!hash_part.empty()) {
+                    auto hash = static_cast<uint32_t>(pluto::hash_range(hash_part.begin(), hash_part.end()));
+                    shard = (uint32_t)(hash % (uint64_t)shards) + 1;
+                }
+            }
+
+            buffer* buf = nullptr;
+            for (auto& [id, b]: groups) {
+                if (id == shard) {
+                    buf = b;
+                    break;
+                }
+            }
+            if (nullptr == buf) {
+                buf = buffer_pool::instance().acquire(cfg->concat_buffer_size);
+                groups.emplace_back(shard, buf);
+            }
+
+            buf->write_back('*');
+            buf->write_chars(n);
+            for (int k = 0; k < n; ++k)
+                concat_resp_one(buf, L, base + k, cfg);
+            buf->write_back("\r\n", 2);
+            lua_settop(L, top);
+        }
+    } catch (const std::exception& ex) {
+        for (auto& group: groups)
+            buffer_pool::instance().release(group.second);
+        groups.clear();
+        lua_pushstring(L, ex.what());
+        return lua_error(L);
+    }
+
+    lua_createtable(L, 0, (int)groups.size());
+    for (auto& [id, b]: groups) {
+        lua_pushlightuserdata(L, b);
+        lua_rawseti(L, -2, (lua_Integer)id);
+    }
+    lua_pushinteger(L, (lua_Integer)groups.size());
+    groups.clear();
+    return 2;
+}
+
+// Return a buffer made by concat / concat_resp to the pool once it has been
+// consumed. Each buffer can be released once; deleting it instead stays
+// valid, it just skips the pool.
+static int release(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    if (!buffer_pool::instance().release(static_cast<buffer*>(lua_touserdata(L, 1))))
+        return luaL_error(L, "release: not a pooled buffer, or already released");
+    return 0;
+}
+
+// Incremental RESP2/RESP3 reply parser, the reading side of concat_resp.
+// Socket chunks go in with feed(); complete replies come out of next() or
+// drain(). A reply is first scanned to check that all of it is buffered, and
+// only then converted, so a partial frame never leaves half-built tables.
+// The scan resumes where the previous call stopped, so a large reply arriving
+// in many chunks is only walked once. A protocol error drops everything
+// buffered, since the stream can no longer be framed.
+static constexpr const char* RESP_METANAME = "yyjson.resp_parser";
+
+// Default cap on bytes buffered but not yet returned as replies.
+static constexpr size_t RESP_MAX_PENDING = 512 * 1024 * 1024;
+
+struct resp_parser {
+    std::string pending;
+    size_t pos = 0;
+    // scan progress of the reply starting at pos, and the elements each
+    // aggregate opened so far still waits for
+    size_t scan = 0;
+    std::vector<int64_t> open;
+    size_t max_pending = RESP_MAX_PENDING;
+    json_config cfg;
+    bool json = false;
+};
+
+static constexpr size_t RESP_INCOMPLETE = std::string_view::npos;
+
+// Offset of the "\r\n" ending the line that starts at p.
+static size_t resp_line_end(std::string_view s, size_t p) {
+    while (p < s.size()) {
+        const char* cr = (const char*)memchr(s.data() + p, '\r', s.size() - p);
+        if (nullptr == cr)
+            return RESP_INCOMPLETE;
+        size_t i = (size_t)(cr - s.data());
+        if (i + 1 >= s.size())
+            return RESP_INCOMPLETE;
+        if (s[i + 1] == '\n')
+            return i;
+        p = i + 1;
+    }
+    return RESP_INCOMPLETE;
+}
+
+static int64_t resp_integer(std::string_view s, size_t begin, size_t end) {
+    int64_t v = 0;
+    auto [p, ec] = std::from_chars(s.data() + begin, s.data() + end, v);
+    if (ec != std::errc() || p != s.data() + end)
+        throw std::logic_error { "resp: invalid length or integer" };
+    return v;
+}
+
+static bool resp_known_type(char type) {
+    switch (type) {
+        case '+':
+        case '-':
+        case ':':
+        case '_':
+        case '#':
+        case ',':
+        case '(':
+        case '$':
+        case '!':
+        case '=':
+        case '*':
+        case '~':
+        case '>':
+        case '%':
+        case '|':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Walk whole elements from p until the reply that `open` tracks is complete
+// and return the offset just past it. If part of it has not arrived yet,
+// returns RESP_INCOMPLETE with p and open at the point to resume from.
+static size_t resp_scan(std::string_view s, size_t& p, std::vector<int64_t>& open) {
+    while (p < s.size()) {
+        char type = s[p];
+        if (!resp_known_type(type))
+            throw std::logic_error { std::string("resp: protocol error, unknown reply type '") + type + "'" };
+        size_t eol = resp_line_end(s, p + 1);
+        if (eol == RESP_INCOMPLETE)
+            return RESP_INCOMPLETE;
+        size_t q = eol + 2;
+        int64_t elements = 0;
+        switch (type) {
+            case '$':
+            case '!':
+            case '=': {
+                int64_t n = resp_integer(s, p + 1, eol);
+                if (n >= 0) {
+                    if ((uint64_t)n > s.size() - q || s.size() - q - (size_t)n < 2)
+                        return RESP_INCOMPLETE;
+                    q += (size_t)n + 2;
+                }
+                break;
+            }
+            case '*':
+            case '~':
+            case '>':
+            case '%':
+            case '|': {
+                int64_t n = resp_integer(s, p + 1, eol);
+                if (n >= 0) {
+                    elements = (type == '%' || type == '|') ? n * 2 : n;
+                    // attributes are followed by the reply they describe
+                    if (type == '|')
+                        ++elements;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        p = q;
+        if (elements > 0) {
+            if (open.size() >= (size_t)MAX_DEPTH)
+                throw std::logic_error { "resp: nested too depth" };
+            open.push_back(elements);
+            continue;
+        }
+        // one element done; close every aggregate it completes
+        while (!open.empty() && --open.back() == 0)
+            open.pop_back();
+        if (open.empty())
+            return p;
+    }
+    return RESP_INCOMPLETE;
+}
+
+static void resp_push_bulk(lua_State* L, resp_parser* r, const char* data, size_t len) {
+    if (r->json && len > 0 && (data[0] == '{' || data[0] == '[')) {
+        yyjson_read_err err;
+        yyjson_doc* doc = arena_read(data, len, r->cfg.decode_arena_limit, &err);
+        if (nullptr != doc) {
+            int guard = arena_guard(L, doc);
+            decode_one(L, yyjson_doc_get_root(doc), &r->cfg);
+            arena_release(L, doc, guard);
+            return;
+        }
+    }
+    lua_pushlstring(L, data, len);
+}
+
+// Push the (complete) reply starting at p and move p past it. Returns false
+// if the reply is an error or contains one. Null replies push nil.
+static bool resp_push(lua_State* L, resp_parser* r, std::string_view s, size_t& p, int depth) {
+    luaL_checkstack(L, 4, "resp.reply");
+    size_t eol = resp_line_end(s, p + 1);
+    char type = s[p];
+    const char* line = s.data() + p + 1;
+    size_t line_len = eol - p - 1;
+    size_t next = eol + 2;
+    bool ok = true;
+    switch (type) {
+        case '+':
+        case '(':
+            lua_pushlstring(L, line, line_len);
+            break;
+        case '-':
+            lua_pushlstring(L, line, line_len);
+            ok = false;
+            break;
+        case ':':
+            lua_pushinteger(L, (lua_Integer)resp_integer(s, p + 1, eol));
+            break;
+        case '_':
+            lua_pushnil(L);
+            break;
+        case '#':
+            lua_pushboolean(L, line_len > 0 && line[0] == 't');
+            break;
+        case ',': {
+            std::string num { line, line_len };
+            lua_pushnumber(L, (lua_Number)std::strtod(num.c_str(), nullptr));
+            break;
+        }
+        case '$':
+        case '!':
+        case '=': {
+            int64_t n = resp_integer(s, p + 1, eol);
+            if (n < 0) {
+                lua_pushnil(L);
+                break;
+            }
+            const char* data = s.data() + next;
+            size_t len = (size_t)n;
+            next += len + 2;
+            if (type == '=' && len >= 4) {
+                // verbatim string, drop the "txt:" format prefix
+                data += 4;
+                len -= 4;
+            }
+            if (type == '$')
+                resp_push_bulk(L, r, data, len);
+            else
+                lua_pushlstring(L, data, len);
+            ok = (type != '!');
+            break;
+        }
+        case '|': {
+            // attributes are out-of-band metadata; skip them
+            int64_t n = resp_integer(s, p + 1, eol);
+            if (n > 0) {
+                std::vector<int64_t> open { n * 2 };
+                resp_scan(s, next, open);
+            }
+            p = next;
+            return resp_push(L, r, s, p, depth + 1);
+        }
+        case '%': {
+            int64_t n = resp_integer(s, p + 1, eol);
+            if (n < 0) {
+                lua_pushnil(L);
+                break;
+            }
+            lua_createtable(L, 0, (int)n);
+            for (int64_t i = 0; i < n; ++i) {
+                ok = resp_push(L, r, s, next, depth + 1) && ok;
+                ok = resp_push(L, r, s, next, depth + 1) && ok;
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    lua_pushlightuserdata(L, nullptr);
+                }
+                if (lua_isnil(L, -2))
+                    lua_pop(L, 2);
+                else
+                    lua_rawset(L, -3);
+            }
+            break;
+        }
+        default: {
+            // '*' array, '~' set, '>' push
+            int64_t n = resp_integer(s, p + 1, eol);
+            if (n < 0) {
+                lua_pushnil(L);
+                break;
+            }
+            lua_createtable(L, (int)n, 0);
+            for (int64_t i = 1; i <= n; ++i) {
+                ok = resp_push(L, r, s, next, depth + 1) && ok;
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    lua_pushlightuserdata(L, nullptr);
+                }
+                lua_rawseti(L, -2, (lua_Integer)i);
+            }
+            break;
+        }
+    }
+    p = next;
+    return ok;
+}
+
+static resp_parser* resp_check(lua_State* L) {
+    return (resp_parser*)luaL_checkudata(L, 1, RESP_METANAME);
+}
+
+static int resp_gc(lua_State* L) {
+    resp_parser* r = (resp_parser*)lua_touserdata(L, 1);
+    if (r)
+        std::destroy_at(r);
+    return 0;
+}
+
+static int resp_feed(lua_State* L) {
+    resp_parser* r = resp_check(L);
+    size_t len = 0;
+    const char* data = nullptr;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        data = lua_tolstring(L, 2, &len);
+    } else {
+        data = reinterpret_cast<const char*>(lua_touserdata(L, 2));
+        lua_Integer n = luaL_checkinteger(L, 3);
+        luaL_argcheck(L, n >= 0, 3, "negative length");
+        len = (size_t)n;
+    }
+    if (nullptr == data || len == 0)
+        return 0;
+    if (r->pos > 0) {
+        r->pending.erase(0, r->pos);
+        r->scan -= r->pos;
+        r->pos = 0;
+    }
+    if (len > r->max_pending || r->pending.size() > r->max_pending - len)
+        return luaL_error(L, "resp: more than %I bytes pending", (lua_Integer)r->max_pending);
+    r->pending.append(data, len);
+    return 0;
+}
+
+// Convert the next complete reply, pushing ok and value. Returns false,
+// with nothing pushed, when no complete reply is buffered.
+static bool resp_next_reply(lua_State* L, resp_parser* r) {
+    std::string_view s = r->pending;
+    size_t end = resp_scan(s, r->scan, r->open);
+    if (end == RESP_INCOMPLETE)
+        return false;
+    size_t p = r->pos;
+    lua_pushboolean(L, 1);
+    bool ok = resp_push(L, r, s, p, 0);
+    if (!ok) {
+        lua_pushboolean(L, 0);
+        lua_replace(L, -3);
+    }
+    r->pos = end;
+    return true;
+}
+
+// After a protocol error the buffered bytes cannot be framed any more.
+static void resp_reset(resp_parser* r) {
+    r->pending.clear();
+    r->pos = 0;
+    r->scan = 0;
+    r->open.clear();
+}
+
+// parser:next() -> ok, reply; nothing if the next reply is incomplete.
+// ok is false for error replies, and for arrays holding one.
+static int resp_next(lua_State* L) {
+    resp_parser* r = resp_check(L);
+    try {
+        return resp_next_reply(L, r) ? 2 : 0;
+    } catch (const std::exception& ex) {
+        resp_reset(r);
         lua_pushstring(L, ex.what());
     }
     return lua_error(L);
 }
 
+static int resp_replies(lua_State* L) {
+    resp_check(L);
+    lua_pushcfunction(L, resp_next);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+// parser:drain([t]) -> n, t, failed
+// Every complete reply goes into t[1..n] (yyjson.null for nil replies);
+// failed is nil, or a table whose keys are the indexes of error replies.
+static int resp_drain(lua_State* L) {
+    resp_parser* r = resp_check(L);
+    if (lua_istable(L, 2))
+        lua_settop(L, 2);
+    else {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    }
+    lua_pushnil(L); // failed
+    lua_Integer n = 0;
+    bool failed = false;
+    try {
+        while (resp_next_reply(L, r)) {
+            ++n;
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushlightuserdata(L, nullptr);
+            }
+            lua_rawseti(L, 2, n);
+            if (!lua_toboolean(L, -1)) {
+                if (lua_isnil(L, 3)) {
+                    lua_newtable(L);
+                    lua_replace(L, 3);
+                }
+                lua_pushboolean(L, 1);
+                lua_rawseti(L, 3, n);
+            }
+            lua_pop(L, 1);
+        }
+    } catch (const std::exception& ex) {
+        resp_reset(r);
+        lua_pushstring(L, ex.what());
+        failed = true;
+    }
+    if (failed)
+        return lua_error(L);
+    lua_pushinteger(L, n);
+    lua_replace(L, 1);
+    return 3;
+}
+
+// Bytes buffered but not yet returned as replies.
+static int resp_pending(lua_State* L) {
+    resp_parser* r = resp_check(L);
+    lua_pushinteger(L, (lua_Integer)(r->pending.size() - r->pos));
+    return 1;
+}
+
+// yyjson.resp_parser([json [, max_pending]]): with json, bulk strings
+// holding a JSON object or array are returned decoded. feed() raises once
+// more than max_pending bytes (default 512 MiB) are waiting.
+static int resp_parser_new(lua_State* L) {
+    json_config* cfg = json_fetch_config(L);
+    lua_Integer max_pending = luaL_optinteger(L, 2, (lua_Integer)RESP_MAX_PENDING);
+    luaL_argcheck(L, max_pending > 0, 2, "must be positive");
+    void* mem = lua_newuserdatauv(L, sizeof(resp_parser), 0);
+    resp_parser* r = new (mem) resp_parser {};
+    r->cfg = *cfg;
+    r->json = lua_toboolean(L, 1);
+    r->max_pending = (size_t)max_pending;
+    luaL_setmetatable(L, RESP_METANAME);
+    return 1;
+}
+
+static void resp_create_metatable(lua_State* L) {
+    luaL_Reg l[] = { { "feed", resp_feed },
+                     { "next", resp_next },
+                     { "replies", resp_replies },
+                     { "drain", resp_drain },
+                     { "pending", resp_pending },
+                     { nullptr, nullptr } };
+    luaL_newmetatable(L, RESP_METANAME);
+    luaL_newlib(L, l);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, resp_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
 extern "C" {
 int luaopen_yyjson(lua_State* L) {
     luaL_Reg l[] = { { "encode", encode },
                      { "pretty_encode", pretty_encode },
                      { "decode", decode },
+                     { "decode_lazy", decode_lazy },
+                     { "get", get },
+                     { "ndjson_reader", ndjson_reader_new },
+                     { "totable", totable },
                      { "concat", concat },
                      { "concat_resp", concat_resp },
+                     { "concat_resp_batch", concat_resp_batch },
+                     { "release", release },
+                     { "resp_parser", resp_parser_new },
                      { "options", json_options },
                      { "null", nullptr },
                      { nullptr, nullptr } };
 
     luaL_checkversion(L);
+    lazy_create_metatables(L);
+    ndjson_create_metatable(L);
+    resp_create_metatable(L);
+    arena_guard_create(L);
     luaL_newlibtable(L, l);
     json_create_config(L);
     luaL_setfuncs(L, l, 1);
@@ -694,6 +694,8 @@ lcontext(lua_State *L) {
 		ecs_cache_sync,
 	};
 	ctx->api = &c_api;
+	luaL_newmetatable(L, ECS_CONTEXT_METANAME);
+	lua_setmetatable(L, -2);
 	return 1;
 }
 
@@ -34,6 +34,9 @@ struct ecs_capi {
 	int (*cache_sync)(struct ecs_cache *);
 };
 
+// metatable of the userdata world:context() returns
+#define ECS_CONTEXT_METANAME "LUAECS_CONTEXT"
+
 struct ecs_context {
 	struct ecs_capi *api;
 	struct entity_world *world;
@@ -568,6 +568,13 @@ function M:component_id(name)
 	return t.id
 end
 
+-- id, size and { typeid, name, offset } fields of a C component, for pb.component()
+function M:component_layout(name)
+	local t = assert(context[self].typenames[name])
+	assert(t.size > 0 and not t.raw, "Need C component")
+	return t
+end
+
 function M:read_component(reader, name, offset, stride, n)
 	local t = assert(context[self].typenames[name])
 	return persistence_methods._readcomponent(self, reader, t.id, offset, stride, n)